@@ -0,0 +1,807 @@
+/*
+ * bench.cpp
+ * Samuel Laing - 2019
+ *
+ * Standalone micro-benchmarks for the DSP cores. Runs GendyOscillator,
+ * GendyOscillator4, TOversampler, GendyBlep4, StepWalk4, Wavetable and
+ * gRandGen outside of Rack and reports the cost of each mode combination in ns
+ * per sample, the fastest of a few runs after a warm-up.
+ *
+ * With --stats it checks the statistics of the random walks instead:
+ * the moments of every distribution, the bounds the breakpoints stay
+ * in and the spectral centroid of the output.
+ *
+ * usage: bench [-n samples] [--csv] [--budget file [--slack percent]] [--stats] [filter]
+ *   -n samples      number of samples to time per combination
+ *   --csv           print comma separated values instead of a table
+ *   --budget file   fail when a benchmark is slower than in file, the
+ *                   --csv output of an earlier run. Its calibration
+ *                   loop scales it to the speed of this machine
+ *   --slack percent how much slower than its budget a benchmark may
+ *                   run, 20 by default
+ *   --stats         run the statistical checks instead of the timings
+ *   filter          only run benchmarks whose name contains this string
+ *
+ * Exits with 1 if a benchmark went over its budget or a check failed.
+ */
+
+#include <chrono>
+#include <complex>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "GrandyOscillator.hpp"
+#include "Oversampler.hpp"
+#include "Blep.hpp"
+#include "EchoVoice.hpp"
+#include "StepWalk.hpp"
+#include "wavetable.hpp"
+
+using namespace rack;
+
+static const char *DIST_NAMES[NUM_DISTS] = {
+  "linear", "cauchy", "arcsine", "logistic", "hypcos", "expon", "sinus"
+};
+
+static const char *STEP_NAMES[NUM_STEP_TYPES] = {"step", "ramp", "exp"};
+
+static const char *ENV_NAMES[] = {"sin", "tri", "hann", "welch", "tukey"};
+
+static const int BPT_COUNTS[] = {3, 6, 12, 25, MAX_BPTS};
+static const int NUM_BPT_COUNTS = sizeof(BPT_COUNTS) / sizeof(BPT_COUNTS[0]);
+
+static const float SAMPLE_TIME = 1.f / 44100.f;
+
+// results are summed in here so the optimizer can't drop the work
+static volatile float sink = 0.f;
+
+struct Options {
+  long samples = 1 << 16;
+  bool csv = false;
+  bool stats = false;
+  float slack = 20.f;
+  const char *filter = NULL;
+};
+
+static Options opts;
+
+// ns per sample each benchmark may take, from --budget, and the -n it
+// was recorded with
+static std::map<std::string, double> budget;
+static long budget_samples = 0;
+
+// every benchmark is timed this many times and the fastest counts
+#define BENCH_RUNS 5
+
+// how long a benchmark runs untimed first, so caches, branch predictors
+// and the clock speed of the core have settled, and how long the
+// machine is kept busy before the first one
+#define WARMUP_MS 20
+#define SWEEP_WARMUP_MS 500
+
+// times a benchmark over budget is run again before it fails
+#define BUDGET_RETRIES 8
+
+// the calibration loop is timed this many times and the fastest counts
+#define CALIBRATE_RUNS 5
+
+// how much slower this machine runs than the one the budget was recorded
+// on, by the calibration loop. Budgets are scaled by it
+static double speed = 1.0;
+
+// benchmarks over budget plus failed checks
+static int failures = 0;
+
+// name of the calibration loop's row in the --csv output
+#define CALIBRATE_NAME "calibrate"
+
+/*
+ * Read the --csv output of an earlier run as the budget
+ */
+static bool loadBudget(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (!f) return false;
+
+  char line[256];
+  while (fgets(line, sizeof(line), f)) {
+    char *c1 = strchr(line, ',');
+    char *c2 = c1 ? strchr(c1 + 1, ',') : NULL;
+    if (!c2) continue;
+
+    // skips the header, its last field isn't a number
+    char *end;
+    double ns = strtod(c2 + 1, &end);
+    if (end == c2 + 1) continue;
+
+    std::string name(line, c1 - line);
+    budget[name] = ns;
+    if (name == CALIBRATE_NAME) budget_samples = atol(c1 + 1);
+  }
+
+  fclose(f);
+  return true;
+}
+
+/*
+ * Time a fixed loop of the arithmetic the DSP cores are made of, random
+ * draws, multiplies and a table lookup, in ns per iteration. The fastest
+ * of a few runs counts
+ */
+static double calibrate() {
+  static float table[256];
+  for (int i=0; i<256; i++) table[i] = i / 256.f;
+
+  double best = 0.0;
+  for (int r=0; r<CALIBRATE_RUNS; r++) {
+    uint32_t x = 1;
+    float y = 0.f;
+
+    auto start = std::chrono::steady_clock::now();
+    for (long i=0; i<opts.samples; i++) {
+      x = x * 1664525u + 1013904223u;
+      y = y * 0.999f + table[x >> 24] * (float) (x & 0xffff) * (1.f / 65536.f);
+    }
+    auto end = std::chrono::steady_clock::now();
+    sink = sink + y;
+
+    double ns = std::chrono::duration<double, std::nano>(end - start).count() / opts.samples;
+    if (r == 0 || ns < best) best = ns;
+  }
+  return best;
+}
+
+/*
+ * Scale the budget to how fast the machine runs right now, if it has a
+ * calibration row
+ */
+static void recalibrate() {
+  auto b = budget.find(CALIBRATE_NAME);
+  if (b != budget.end() && b->second > 0.0) speed = calibrate() / b->second;
+}
+
+/*
+ * Call f(n) over and over for at least ms milliseconds
+ */
+template <typename F>
+static void warmUp(long n, int ms, F f) {
+  auto start = std::chrono::steady_clock::now();
+  do f(n);
+  while (std::chrono::steady_clock::now() - start < std::chrono::milliseconds(ms));
+}
+
+/*
+ * Time f(n) which is expected to produce n samples, and print the
+ * result as ns per sample, the fastest of BENCH_RUNS runs
+ */
+template <typename F>
+static void run(const std::string &name, long samples, F f) {
+  if (opts.filter && name.find(opts.filter) == std::string::npos) return;
+
+  // warm up caches and let the breakpoints settle
+  warmUp(std::max(samples / 8, 1L), WARMUP_MS, f);
+
+  auto time = [&]() {
+    auto start = std::chrono::steady_clock::now();
+    f(samples);
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count() / samples;
+  };
+
+  double ns = time();
+  for (int i=1; i<BENCH_RUNS; i++) ns = std::min(ns, time());
+
+  // over budget, the fastest of a few more runs counts, so a longer
+  // stall of the machine doesn't fail it. The machine may have slowed
+  // down as a whole, so it is calibrated again first
+  auto b = budget.find(name);
+  bool has_budget = b != budget.end();
+  auto limit = [&]() { return b->second * speed * (1.0 + opts.slack / 100.0); };
+  for (int i=0; i<BUDGET_RETRIES && has_budget && ns > limit(); i++) {
+    recalibrate();
+    ns = std::min(ns, time());
+  }
+
+  if (opts.csv) printf("%s,%ld,%.3f\n", name.c_str(), samples, ns);
+  else printf("%-52s %10.3f ns/sample\n", name.c_str(), ns);
+  fflush(stdout);
+
+  if (has_budget && ns > limit()) {
+    fprintf(stderr, "%s over budget: %.3f ns/sample, budget %.3f\n", name.c_str(), ns, b->second * speed);
+    failures++;
+  }
+}
+
+static std::string oscName(const char *osc, bool fm, bool mirror, int dt, int et, int bpts) {
+  char buf[128];
+  snprintf(buf, sizeof(buf), "%s/%s/%s/%s/%s/bpts=%d", osc,
+      fm ? "fm" : "sample", mirror ? "mirror" : "wrap",
+      DIST_NAMES[dt], ENV_NAMES[et], bpts);
+  return buf;
+}
+
+static void benchGendyOscillator() {
+  for (int fm=0; fm<2; fm++)
+  for (int mirror=0; mirror<2; mirror++)
+  for (int dt=0; dt<NUM_DISTS; dt++)
+  for (int et=0; et<NUM_ENVS; et++)
+  for (int b=0; b<NUM_BPT_COUNTS; b++) {
+    GendyOscillator go;
+    go.setMode(mirror, fm, (DistType) dt);
+    go.setEnvType((EnvType) et);
+    go.num_bpts = BPT_COUNTS[b];
+    go.seed(1);
+
+    run(oscName("GendyOscillator", fm, mirror, dt, et, BPT_COUNTS[b]), opts.samples, [&](long n) {
+      float acc = 0.f;
+      for (long i=0; i<n; i++) {
+        go.process(SAMPLE_TIME);
+        acc += go.out();
+      }
+      sink += acc;
+    });
+  }
+}
+
+/*
+ * Times are reported per voice, i.e. per lane sample
+ */
+static void benchGendyOscillator4() {
+  for (int fm=0; fm<2; fm++)
+  for (int mirror=0; mirror<2; mirror++)
+  for (int dt=0; dt<NUM_DISTS; dt++)
+  for (int et=0; et<NUM_ENVS; et++)
+  for (int b=0; b<NUM_BPT_COUNTS; b++) {
+    GendyOscillator4 go;
+    go.setMode(mirror, fm, (DistType) dt);
+    go.setEnvType((EnvType) et);
+    for (int i=0; i<4; i++) {
+      go.num_bpts[i] = BPT_COUNTS[b];
+      go.seed(i, i + 1);
+    }
+
+    // detune the lanes so they don't wrap in lockstep
+    go.freq = simd::float_4(261.626f, 277.183f, 293.665f, 311.127f);
+
+    run(oscName("GendyOscillator4", fm, mirror, dt, et, BPT_COUNTS[b]), opts.samples * 4, [&](long n) {
+      simd::float_4 acc = 0.f;
+      for (long i=0; i<n / 4; i++) {
+        go.process(SAMPLE_TIME);
+        acc += go.out();
+      }
+      sink += acc[0] + acc[1] + acc[2] + acc[3];
+    });
+  }
+}
+
+/*
+ * A full GendyOscillator4 bank behind the decimator, as Grandy runs it.
+ * Times are per voice at the engine rate
+ */
+static void benchOversampler() {
+  for (int fm=0; fm<2; fm++)
+  for (int f=1; f<=MAX_OVERSAMPLE; f*=2) {
+    GendyOscillator4 go;
+    go.setMode(false, fm, LINEAR);
+    for (int i=0; i<4; i++) {
+      go.num_bpts[i] = 12;
+      go.seed(i, i + 1);
+    }
+    go.freq = simd::float_4(261.626f, 277.183f, 293.665f, 311.127f);
+
+    TOversampler<simd::float_4> os;
+    os.setFactor(f);
+
+    char name[64];
+    snprintf(name, sizeof(name), "Oversampler/GendyOscillator4/%s/x%d", fm ? "fm" : "sample", f);
+
+    run(name, opts.samples * 4, [&](long n) {
+      simd::float_4 acc = 0.f;
+      for (long i=0; i<n / 4; i++) {
+        acc += os.process(SAMPLE_TIME, [&](float subSampleTime) {
+          go.process(subSampleTime);
+          return go.out();
+        });
+      }
+      sink += acc[0] + acc[1] + acc[2] + acc[3];
+    });
+  }
+}
+
+/*
+ * The minBLEP alternative to the oversampler. Its cost grows with the
+ * number of breakpoints per sample, so it is timed at the usual pitch and
+ * three octaves up. Times are per voice
+ */
+static void benchBlep() {
+  for (int fm=0; fm<2; fm++)
+  for (int octave=0; octave<=3; octave+=3) {
+    GendyOscillator4 go;
+    go.setMode(false, fm, LINEAR);
+    for (int i=0; i<4; i++) {
+      go.num_bpts[i] = 12;
+      go.seed(i, i + 1);
+    }
+    go.freq = simd::float_4(261.626f, 277.183f, 293.665f, 311.127f) * (float) (1 << octave);
+
+    GendyBlep4 blep;
+    blep.reset(go);
+
+    char name[64];
+    snprintf(name, sizeof(name), "Blep/GendyOscillator4/%s/octave=%d", fm ? "fm" : "sample", octave);
+
+    run(name, opts.samples * 4, [&](long n) {
+      simd::float_4 acc = 0.f;
+      for (long i=0; i<n / 4; i++) {
+        go.process(SAMPLE_TIME);
+        acc += blep.process(go);
+      }
+      sink += acc[0] + acc[1] + acc[2] + acc[3];
+    });
+  }
+}
+
+/*
+ * The StochStepper's walk, free running at its default rate and clocked
+ * by a trigger every 64 samples. Times are per channel
+ */
+static void benchStepWalk() {
+  for (int st=0; st<NUM_STEP_TYPES; st++)
+  for (int clocked=0; clocked<2; clocked++) {
+    StepWalk4 walk;
+    walk.step_type = (StepType) st;
+    walk.clocked = clocked;
+    for (int i=0; i<4; i++) walk.seed(i, i + 1);
+    walk.freq = simd::float_4(2.f, 3.f, 5.f, 7.f);
+
+    char name[64];
+    snprintf(name, sizeof(name), "StepWalk4/%s/%s", STEP_NAMES[st], clocked ? "clocked" : "free");
+
+    run(name, opts.samples * 4, [&](long n) {
+      simd::float_4 acc = 0.f;
+      for (long i=0; i<n / 4; i++) {
+        walk.process(SAMPLE_TIME, clocked && (i & 63) == 0 ? 0xf : 0);
+        acc += walk.out();
+      }
+      sink += acc[0] + acc[1] + acc[2] + acc[3];
+    });
+  }
+}
+
+template <int SIZE>
+static void benchWavetableSize() {
+  for (int et=0; et<NUM_ENVS; et++) {
+    TWavetable<SIZE> table((EnvType) et);
+    char name[64];
+
+    snprintf(name, sizeof(name), "Wavetable<%d>::getLinear/%s", SIZE, ENV_NAMES[et]);
+    run(name, opts.samples, [&](long n) {
+      float acc = 0.f;
+      float x = 0.f;
+      for (long i=0; i<n; i++) {
+        acc += table.getLinear(x);
+        x += 0.0061f;
+        if (x >= 1.f) x -= 1.f;
+      }
+      sink += acc;
+    });
+
+    snprintf(name, sizeof(name), "Wavetable<%d>::getHermite/%s", SIZE, ENV_NAMES[et]);
+    run(name, opts.samples, [&](long n) {
+      float acc = 0.f;
+      float x = 0.f;
+      for (long i=0; i<n; i++) {
+        acc += table.getHermite(x);
+        x += 0.0061f;
+        if (x >= 1.f) x -= 1.f;
+      }
+      sink += acc;
+    });
+
+    // per lane
+    snprintf(name, sizeof(name), "Wavetable<%d>::getLinear4/%s", SIZE, ENV_NAMES[et]);
+    run(name, opts.samples * 4, [&](long n) {
+      simd::float_4 acc = 0.f;
+      simd::float_4 x(0.f, 0.25f, 0.5f, 0.75f);
+      for (long i=0; i<n / 4; i++) {
+        acc += table.getLinear(x);
+        x += 0.0061f;
+        x = simd::ifelse(x >= 1.f, x - 1.f, x);
+      }
+      sink += acc[0] + acc[1] + acc[2] + acc[3];
+    });
+
+    snprintf(name, sizeof(name), "Wavetable<%d>::getHermite4/%s", SIZE, ENV_NAMES[et]);
+    run(name, opts.samples * 4, [&](long n) {
+      simd::float_4 acc = 0.f;
+      simd::float_4 x(0.f, 0.25f, 0.5f, 0.75f);
+      for (long i=0; i<n / 4; i++) {
+        acc += table.getHermite(x);
+        x += 0.0061f;
+        x = simd::ifelse(x >= 1.f, x - 1.f, x);
+      }
+      sink += acc[0] + acc[1] + acc[2] + acc[3];
+    });
+  }
+}
+
+static void benchWavetable() {
+  benchWavetableSize<ENV_TABLE_SIZE>();
+  benchWavetableSize<TABLE_SIZE>();
+}
+
+static void benchRandGen() {
+  for (int dt=0; dt<NUM_DISTS; dt++) {
+    gRandGen rg;
+    rg.seed(1);
+
+    run(std::string("gRandGen::next/") + DIST_NAMES[dt], opts.samples, [&](long n) {
+      float acc = 0.f;
+      for (long i=0; i<n; i++) {
+        acc += rg.next((DistType) dt);
+      }
+      sink += acc;
+    });
+  }
+}
+
+/*
+ * Print the outcome of one statistical check
+ */
+static void report(const std::string &name, bool ok, const std::string &detail) {
+  if (!ok) failures++;
+
+  if (opts.csv) printf("%s,%s,%s\n", name.c_str(), ok ? "ok" : "FAIL", detail.c_str());
+  else printf("%-52s %4s  %s\n", name.c_str(), ok ? "ok" : "FAIL", detail.c_str());
+  fflush(stdout);
+}
+
+static bool wanted(const std::string &name) {
+  return !opts.filter || name.find(opts.filter) != std::string::npos;
+}
+
+/*
+ * E[x^k] of x running linearly from a to b
+ */
+static double segmentMoment(double a, double b, int k) {
+  if (fabs(b - a) < 1e-12) return pow(a, k);
+  return (pow(b, k + 1) - pow(a, k + 1)) / ((k + 1) * (b - a));
+}
+
+/*
+ * Draws of every distribution should have the mean and variance of the
+ * interpolated inverse cdf table they are looked up in, within six
+ * standard errors, and stay in -1..1
+ */
+static void statsDist() {
+  long n = opts.samples * 16;
+
+  for (int dt=0; dt<NUM_DISTS; dt++) {
+    std::string name = std::string("stats/dist/") + DIST_NAMES[dt];
+    if (!wanted(name)) continue;
+
+    double e[5] = {};
+    for (int i=0; i<DIST_TABLE_SIZE; i++) {
+      for (int k=1; k<=4; k++) e[k] += segmentMoment(dist_tables[dt][i], dist_tables[dt][i + 1], k) / DIST_TABLE_SIZE;
+    }
+
+    double mu = e[1];
+    double var = e[2] - mu * mu;
+    double mu4 = e[4] - 4 * mu * e[3] + 6 * mu * mu * e[2] - 3 * mu * mu * mu * mu;
+
+    gRandGen rg;
+    rg.seed(1);
+
+    double sum = 0.0, sum2 = 0.0;
+    float lo = 0.f, hi = 0.f;
+    for (long i=0; i<n; i++) {
+      float x = rg.next((DistType) dt);
+      sum += x;
+      sum2 += (double) x * x;
+      lo = std::min(lo, x);
+      hi = std::max(hi, x);
+    }
+
+    double mean = sum / n;
+    double v = sum2 / n - mean * mean;
+
+    double z_mean = (mean - mu) / sqrt(var / n);
+    double z_var = (v - var) / sqrt((mu4 - var * var) / n);
+
+    bool ok = fabs(z_mean) < 6.0 && fabs(z_var) < 6.0 && lo >= -1.f && hi <= 1.f;
+    report(name, ok, string::f("mean %.4f (%.4f, z %.1f) var %.4f (%.4f, z %.1f) range %.3f..%.3f",
+        mean, mu, z_mean, v, var, z_var, lo, hi));
+  }
+}
+
+/*
+ * Every breakpoint a walk steps has to land inside its bounds, under
+ * wrap and mirror alike. The steps are as large as the knobs allow so
+ * the walks hit the bounds often
+ */
+static void statsWalk() {
+  long n = opts.samples * 4;
+
+  for (int mirror=0; mirror<2; mirror++)
+  for (int dt=0; dt<NUM_DISTS; dt++) {
+    std::string mode = std::string(mirror ? "mirror/" : "wrap/") + DIST_NAMES[dt];
+
+    std::string name = "stats/walk/GendyOscillator/" + mode;
+    if (wanted(name)) {
+      GendyOscillator go;
+      go.setMode(mirror, false, (DistType) dt);
+      go.max_amp_step = 1.f;
+      go.max_dur_step = 1.f;
+      go.seed(1);
+
+      long steps = 0, outside = 0;
+      for (long i=0; i<n; i++) {
+        int prev = go.index;
+        go.process(SAMPLE_TIME);
+        if (go.index == prev) continue;
+
+        int k = go.index;
+        steps++;
+        if (go.amps[k] < -1.f || go.amps[k] > 1.f || go.durs[k] < 0.5f || go.durs[k] > 1.5f ||
+            go.offs[k] < 0.f || go.offs[k] > 1.f || go.rats[k] < 0.7f || go.rats[k] > 1.3f) outside++;
+      }
+      report(name, steps > 0 && outside == 0, string::f("%ld of %ld steps out of bounds", outside, steps));
+    }
+
+    name = "stats/walk/GendyOscillator4/" + mode;
+    if (wanted(name)) {
+      GendyOscillator4 go;
+      go.setMode(mirror, false, (DistType) dt);
+      for (int i=0; i<4; i++) {
+        go.max_amp_step[i] = 1.f;
+        go.max_dur_step[i] = 1.f;
+        go.seed(i, i + 1);
+      }
+      go.freq = simd::float_4(261.626f, 277.183f, 293.665f, 311.127f);
+
+      long steps = 0, outside = 0;
+      for (long i=0; i<n / 4; i++) {
+        int prev[4];
+        for (int j=0; j<4; j++) prev[j] = go.index[j];
+        go.process(SAMPLE_TIME);
+
+        for (int j=0; j<4; j++) {
+          if (go.index[j] == prev[j]) continue;
+
+          int k = go.index[j];
+          steps++;
+          if (go.amps[k][j] < -1.f || go.amps[k][j] > 1.f || go.durs[k][j] < 0.5f || go.durs[k][j] > 1.5f ||
+              go.offs[k][j] < 0.f || go.offs[k][j] > 1.f || go.rats[k][j] < 0.7f || go.rats[k][j] > 1.3f) outside++;
+        }
+      }
+      report(name, steps > 0 && outside == 0, string::f("%ld of %ld steps out of bounds", outside, steps));
+    }
+
+    // fast enough to step every few hundred samples, and ramping so
+    // the output has to stay between the breakpoints too
+    name = "stats/walk/StepWalk4/" + mode;
+    if (wanted(name)) {
+      StepWalk4 walk;
+      walk.is_mirroring = mirror;
+      walk.dt = (DistType) dt;
+      walk.step_type = RAMP;
+      for (int i=0; i<4; i++) {
+        walk.max_amp_step[i] = 1.f;
+        walk.max_dur_step[i] = 1.f;
+        walk.seed(i, i + 1);
+      }
+      walk.freq = simd::float_4(100.f, 150.f, 220.f, 330.f);
+
+      long steps = 0, outside = 0;
+      for (long i=0; i<n / 4; i++) {
+        walk.process(SAMPLE_TIME, 0);
+
+        for (int j=0; j<4; j++) {
+          if (walk.out()[j] < -1.f || walk.out()[j] > 1.f) outside++;
+          if (!(walk.step_flag & (1 << j))) continue;
+
+          int k = walk.index[j];
+          steps++;
+          if (walk.amps[k][j] < -1.f || walk.amps[k][j] > 1.f || walk.durs[k][j] < 0.5f || walk.durs[k][j] > 1.5f) outside++;
+        }
+      }
+      report(name, steps > 0 && outside == 0, string::f("%ld of %ld steps or samples out of bounds", outside, steps));
+    }
+
+    // GenEcho walking a second of sine, accumulating so the amplitudes
+    // wander the whole range
+    name = "stats/walk/EchoVoice/" + mode;
+    if (wanted(name)) {
+      CaptureBuffer *b = new CaptureBuffer(44100);
+      for (unsigned int i=0; i<b->size; i++) b->_sample[i] = 5.f * sinf(i * 0.05f);
+      b->sample = b->_sample;
+
+      EchoVoice v;
+      v.swap(b);
+      v.rg.seed(1);
+      v.setLength(1.f);
+      v.setSpacing(MIN_BPT_SPACING);
+      v.max_amp_step = 1.f;
+      v.max_dur_step = 1.f;
+
+      long steps = 0, outside = 0;
+      for (long i=0; i<n; i++) {
+        unsigned int prev = v.index;
+        float x = v.process(&env_tables[TUKEY], mirror, true, (DistType) dt);
+        if (x < -5.f || x > 5.f) outside++;
+        if (v.index == prev) continue;
+
+        unsigned int k = v.index;
+        steps++;
+        if (b->mAmps[k] < -1.f || b->mAmps[k] > 1.f || b->mDurs[k] < 0.5f || b->mDurs[k] > 1.5f) outside++;
+      }
+      report(name, steps > 0 && outside == 0, string::f("%ld of %ld steps or samples out of bounds", outside, steps));
+
+      delete v.swap(NULL);
+    }
+  }
+}
+
+/*
+ * In place radix-2 FFT, n a power of two
+ */
+static void fft(std::complex<double> *x, int n) {
+  if (n == 1) return;
+
+  std::vector<std::complex<double>> even(n / 2), odd(n / 2);
+  for (int i=0; i<n / 2; i++) {
+    even[i] = x[2 * i];
+    odd[i] = x[2 * i + 1];
+  }
+  fft(even.data(), n / 2);
+  fft(odd.data(), n / 2);
+
+  for (int k=0; k<n / 2; k++) {
+    std::complex<double> t = std::polar(1.0, -2.0 * M_PI * k / n) * odd[k];
+    x[k] = even[k] + t;
+    x[k + n / 2] = even[k] - t;
+  }
+}
+
+// frame length of the spectra, and how many are averaged. The walks
+// take a while to settle, so it doesn't follow -n
+#define CENTROID_FRAME 4096
+#define CENTROID_FRAMES 256
+
+// centroid of a GRANDY voice with its knobs at 0 and seed 1 in Hz, as
+// measured, by fm off / on, wrap / mirror and distribution. A mode may
+// be off by CENTROID_TOLERANCE of it, which covers PRECISE_MATH and
+// compiler differences
+static const double CENTROID_EXPECTED[2][2][NUM_DISTS] = {
+  {{7728, 8086, 7583, 7825, 7243, 7560, 8196}, {8558, 8790, 8544, 8555, 10032, 9860, 8678}},
+  {{2439, 2639, 2336, 2478, 2166, 2251, 2704}, {3015, 3038, 3004, 3020, 3582, 3080, 3031}}
+};
+#define CENTROID_TOLERANCE 0.05
+
+/*
+ * Spectral centroid of the average Hann windowed magnitude spectrum of
+ * every mode's output
+ */
+static void statsCentroid() {
+  for (int fm=0; fm<2; fm++)
+  for (int mirror=0; mirror<2; mirror++)
+  for (int dt=0; dt<NUM_DISTS; dt++) {
+    std::string name = string::f("stats/centroid/GendyOscillator/%s/%s/%s",
+        fm ? "fm" : "sample", mirror ? "mirror" : "wrap", DIST_NAMES[dt]);
+    if (!wanted(name)) continue;
+
+    // the knobs at 0, as GRANDY starts out
+    GendyOscillator go;
+    go.setMode(mirror, fm, (DistType) dt);
+    go.setEnvType(TUKEY);
+    go.g_rate = go.f_car = go.f_mod = 261.626f;
+    go.i_mod = 10.f;
+    go.seed(1);
+
+    // let the breakpoints settle
+    for (int i=0; i<CENTROID_FRAME; i++) go.process(SAMPLE_TIME);
+
+    std::vector<double> mag(CENTROID_FRAME / 2, 0.0);
+    std::vector<std::complex<double>> x(CENTROID_FRAME);
+    for (int f=0; f<CENTROID_FRAMES; f++) {
+      for (int i=0; i<CENTROID_FRAME; i++) {
+        go.process(SAMPLE_TIME);
+        x[i] = go.out() * (0.5 - 0.5 * cos(2.0 * M_PI * i / CENTROID_FRAME));
+      }
+      fft(x.data(), CENTROID_FRAME);
+      for (int k=0; k<CENTROID_FRAME / 2; k++) mag[k] += std::abs(x[k]);
+    }
+
+    // leave out dc, the walks drift
+    double sum = 0.0, weighted = 0.0;
+    for (int k=1; k<CENTROID_FRAME / 2; k++) {
+      sum += mag[k];
+      weighted += mag[k] * k / (SAMPLE_TIME * CENTROID_FRAME);
+    }
+    double centroid = sum > 0.0 ? weighted / sum : 0.0;
+
+    double expected = CENTROID_EXPECTED[fm][mirror][dt];
+    double lo = expected * (1.0 - CENTROID_TOLERANCE), hi = expected * (1.0 + CENTROID_TOLERANCE);
+    report(name, centroid >= lo && centroid <= hi,
+        string::f("centroid %.0f Hz (%.0f..%.0f)", centroid, lo, hi));
+  }
+}
+
+int main(int argc, char **argv) {
+  for (int i=1; i<argc; i++) {
+    if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+      opts.samples = atol(argv[++i]);
+    }
+    else if (!strcmp(argv[i], "--csv")) {
+      opts.csv = true;
+    }
+    else if (!strcmp(argv[i], "--stats")) {
+      opts.stats = true;
+    }
+    else if (!strcmp(argv[i], "--budget") && i + 1 < argc) {
+      if (!loadBudget(argv[++i])) {
+        fprintf(stderr, "can't read budget %s\n", argv[i]);
+        return 1;
+      }
+    }
+    else if (!strcmp(argv[i], "--slack") && i + 1 < argc) {
+      opts.slack = atof(argv[++i]);
+    }
+    else if (argv[i][0] == '-') {
+      fprintf(stderr, "usage: %s [-n samples] [--csv] [--budget file [--slack percent]] [--stats] [filter]\n", argv[0]);
+      return 1;
+    }
+    else {
+      opts.filter = argv[i];
+    }
+  }
+
+  initDistTables();
+  initWavetables();
+
+  if (opts.samples < 8) opts.samples = 8;
+
+  if (opts.stats) {
+    if (opts.csv) printf("check,result,detail\n");
+
+    statsDist();
+    statsWalk();
+    statsCentroid();
+  }
+  else {
+    if (opts.csv) printf("benchmark,samples,ns_per_sample\n");
+
+    // a budget only compares with runs of the same length
+    if (budget_samples && budget_samples != opts.samples) {
+      fprintf(stderr, "the budget was recorded with -n %ld, not %ld\n", budget_samples, opts.samples);
+      return 1;
+    }
+
+    // recorded with every run, so a budget can be compared on a machine
+    // faster or slower than its own. The core is kept busy first, so it
+    // has reached its clock speed by the time anything is timed
+    warmUp(opts.samples, SWEEP_WARMUP_MS, [](long n) { calibrate(); });
+    double ns = calibrate();
+    if (opts.csv) printf("%s,%ld,%.3f\n", CALIBRATE_NAME, opts.samples, ns);
+    else printf("%-52s %10.3f ns/sample\n", CALIBRATE_NAME, ns);
+
+    auto b = budget.find(CALIBRATE_NAME);
+    if (b != budget.end() && b->second > 0.0) {
+      speed = ns / b->second;
+      fprintf(stderr, "this machine runs %.2fx as slow as the budget's\n", speed);
+    }
+
+    benchRandGen();
+    benchWavetable();
+    benchGendyOscillator();
+    benchGendyOscillator4();
+    benchOversampler();
+    benchBlep();
+    benchStepWalk();
+  }
+
+  return failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,132 @@
+/*
+ * shims.cpp
+ * Samuel Laing - 2019
+ *
+ * Stand-ins for the few Rack library symbols the DSP headers use, so
+ * they can be linked into a standalone binary without libRack
+ */
+
+#include <cstdarg>
+#include <cstdio>
+#include <complex>
+#include <random>
+#include <vector>
+
+#include "rack.hpp"
+
+namespace rack {
+  namespace logger {
+    void log(Level level, const char* filename, int line, const char* format, ...) {
+      // only let warnings through, DEBUG is too chatty for timing runs
+      if (level < WARN_LEVEL) return;
+      va_list args;
+      va_start(args, format);
+      fprintf(stderr, "[%s:%d] ", filename, line);
+      vfprintf(stderr, format, args);
+      fprintf(stderr, "\n");
+      va_end(args);
+    }
+  }
+
+  namespace string {
+    std::string f(const char* format, ...) {
+      va_list args;
+      va_start(args, format);
+      int size = vsnprintf(NULL, 0, format, args);
+      va_end(args);
+
+      std::string s(size, '\0');
+      va_start(args, format);
+      vsnprintf(&s[0], size + 1, format, args);
+      va_end(args);
+      return s;
+    }
+  }
+
+  namespace dsp {
+    /*
+     * In place radix-2 FFT, inverse unscaled
+     */
+    static void shimFft(std::vector<std::complex<double>> &x, bool inverse) {
+      int n = x.size();
+      for (int i=1, j=0; i<n; i++) {
+        int bit = n >> 1;
+        for (; j & bit; bit >>= 1) j ^= bit;
+        j ^= bit;
+        if (i < j) std::swap(x[i], x[j]);
+      }
+
+      for (int len=2; len<=n; len<<=1) {
+        std::complex<double> w = std::polar(1.0, (inverse ? 2 : -2) * M_PI / len);
+        for (int i=0; i<n; i+=len) {
+          std::complex<double> wk = 1.0;
+          for (int k=0; k<len / 2; k++) {
+            std::complex<double> a = x[i + k];
+            std::complex<double> b = x[i + k + len / 2] * wk;
+            x[i + k] = a + b;
+            x[i + k + len / 2] = a - b;
+            wk *= w;
+          }
+        }
+      }
+    }
+
+    /*
+     * Same construction as Rack's: windowed sinc, made minimum phase
+     * through the real cepstrum and integrated into a step
+     */
+    void minBlepImpulse(int z, int o, float *output) {
+      int n = 2 * z * o;
+      std::vector<std::complex<double>> x(n);
+
+      for (int i=0; i<n; i++) {
+        double p = -z + 2.0 * z * i / (n - 1);
+        double sinc = p == 0.0 ? 1.0 : std::sin(M_PI * p) / (M_PI * p);
+        double t = 2 * M_PI * i / (n - 1);
+        double window = 0.35875 - 0.48829 * std::cos(t) + 0.14128 * std::cos(2 * t) - 0.01168 * std::cos(3 * t);
+        x[i] = sinc * window;
+      }
+
+      shimFft(x, false);
+      for (int i=0; i<n; i++) x[i] = std::log(std::max(std::abs(x[i]), 1e-9));
+      shimFft(x, true);
+      for (int i=0; i<n; i++) x[i] /= n;
+
+      for (int i=1; i<n / 2; i++) x[i] *= 2.0;
+      for (int i=n / 2 + 1; i<n; i++) x[i] = 0.0;
+
+      shimFft(x, false);
+      for (int i=0; i<n; i++) x[i] = std::exp(x[i]);
+      shimFft(x, true);
+
+      double total = 0.0;
+      std::vector<double> step(n);
+      for (int i=0; i<n; i++) {
+        total += x[i].real();
+        step[i] = total;
+      }
+      for (int i=0; i<n; i++) output[i] = step[i] / total;
+    }
+  }
+
+  namespace random {
+    static std::mt19937 rng(0);
+
+    uint32_t u32() {
+      return rng();
+    }
+
+    uint64_t u64() {
+      return ((uint64_t) rng() << 32) | rng();
+    }
+
+    float uniform() {
+      return (rng() >> 8) / 16777216.f;
+    }
+
+    float normal() {
+      static std::normal_distribution<float> dist;
+      return dist(rng);
+    }
+  }
+}
@@ -0,0 +1,582 @@
+/*
+ * render.cpp
+ * Samuel Laing - 2019
+ *
+ * Headless offline renderer. Runs the DSP of Grandy, Stitcher and
+ * GenEcho outside of Rack, with a parameter set from a JSON job file,
+ * and writes each job to a WAV file as fast as the CPU allows. Jobs are
+ * rendered in parallel, one per core.
+ *
+ * With --check every job is compared instead of written out. A job
+ * holding a "golden" fingerprint, the level, peak and zero crossings of
+ * an earlier render, is compared against that within its "tolerance".
+ * Any other is compared sample by sample against the file it would
+ * write, a golden render made earlier by the same build. The same seed
+ * always renders the same samples, so any difference means the sound of
+ * a module changed. --record stores the fingerprints in the job files.
+ *
+ * usage: render [-j threads] [--check | --record] jobs.json...
+ *   -j threads   number of jobs rendered at once, all cores by default
+ *   --check      compare against the golden renders, exits with 1 if any
+ *                of them differ
+ *   --record     write every job's fingerprint into its job file
+ *   jobs.json    a job object or an array of them, see README.md
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <jansson.h>
+
+#include "GrandyOscillator.hpp"
+#include "Oversampler.hpp"
+#include "Blep.hpp"
+#include "Stitch.hpp"
+#include "EchoVoice.hpp"
+#include "wavetable.hpp"
+#include "wavfile.hpp"
+
+using namespace rack;
+
+static const char *DIST_NAMES[NUM_DISTS] = {
+  "linear", "cauchy", "arcsine", "logistic", "hypcos", "expon", "sinus"
+};
+
+static const char *ENV_NAMES[NUM_ENVS] = {"sin", "tri", "hann", "welch", "tukey"};
+
+// frames rendered between writes to the WAV file
+#define RENDER_BLOCK 4096
+
+// the same as the modules' knobs at 0
+#define DEFAULT_FREQ 261.626f
+
+// how far a sample may be off its golden render in --check, it is a
+// float file so anything but rounding is a change
+#define CHECK_TOLERANCE 1e-6f
+
+// how far, relatively, a fingerprint may be off its golden one by
+// default. PRECISE_MATH moves them by around 0.001%, a changed sound by
+// whole percents
+#define FINGERPRINT_TOLERANCE 0.001f
+
+static bool check = false;
+static bool record = false;
+
+// job files are only changed by one thread at a time
+static std::mutex record_mutex;
+
+struct Job {
+  std::string module;
+  std::string out;
+  float seconds = 10.f;
+  int rate = 44100;
+  int seed = 1;
+  int voices = 0;
+  int oversample = 1;
+  bool band_limited = false;
+  json_t *params = NULL;
+
+  // the job object itself, and its golden fingerprint if it has one
+  json_t *json = NULL;
+  json_t *golden = NULL;
+  float tolerance = FINGERPRINT_TOLERANCE;
+};
+
+/*
+ * What --check compares a render by when it has no golden file: its
+ * rms level and peak over every channel, and zero crossings per second
+ * and channel
+ */
+struct Fingerprint {
+  double rms = 0.0;
+  double peak = 0.0;
+  double crossings = 0.0;
+};
+
+/*
+ * Params are looked up by name, a missing or mistyped one keeps its
+ * default
+ */
+static float num(json_t *o, const char *key, float def) {
+  json_t *j = json_object_get(o, key);
+  return json_is_number(j) ? json_number_value(j) : def;
+}
+
+static bool flag(json_t *o, const char *key, bool def) {
+  json_t *j = json_object_get(o, key);
+  return json_is_boolean(j) ? json_is_true(j) : def;
+}
+
+static std::string str(json_t *o, const char *key, const std::string &def) {
+  json_t *j = json_object_get(o, key);
+  return json_is_string(j) ? json_string_value(j) : def;
+}
+
+/*
+ * One of names, given by name or by index
+ */
+static int pick(json_t *o, const char *key, const char **names, int n, int def) {
+  json_t *j = json_object_get(o, key);
+  if (json_is_integer(j)) return clamp((int) json_integer_value(j), 0, n - 1);
+  if (!json_is_string(j)) return def;
+
+  for (int i=0; i<n; i++) {
+    if (!strcmp(json_string_value(j), names[i])) return i;
+  }
+  WARN("Unknown %s \"%s\"", key, json_string_value(j));
+  return def;
+}
+
+/*
+ * Render frames in blocks of RENDER_BLOCK, f(out, n) fills n frames of
+ * channels interleaved samples
+ */
+template <typename F>
+static void renderFrames(const Job &job, WavWriter &wav, int channels, F f) {
+  std::vector<float> block(RENDER_BLOCK * channels);
+  long frames = (long) (job.seconds * job.rate);
+
+  for (long done=0; done<frames; done+=RENDER_BLOCK) {
+    int n = (int) std::min((long) RENDER_BLOCK, frames - done);
+    f(block.data(), n);
+    wav.write(block.data(), (size_t) n * channels);
+  }
+}
+
+/*
+ * One GRANDY oscillator per voice, four voices per SIMD bank
+ */
+static bool renderGrandy(const Job &job, WavWriter &wav, int voices) {
+  json_t *p = job.params;
+  float dt = 1.f / job.rate;
+  int banks = (voices + 3) / 4;
+
+  std::vector<GendyOscillator4> gos(banks);
+  std::vector<TOversampler<simd::float_4>> oversamplers(banks);
+  std::vector<GendyBlep4> bleps(banks);
+
+  EnvType env = (EnvType) pick(p, "env", ENV_NAMES, NUM_ENVS, TUKEY);
+  DistType dist = (DistType) pick(p, "dist", DIST_NAMES, NUM_DISTS, LINEAR);
+
+  for (int b=0; b<banks; b++) {
+    GendyOscillator4 &go = gos[b];
+
+    go.reset();
+    for (int i=0; i<4; i++) go.seed(i, streamSeed(job.seed, b * 4 + i));
+
+    go.setEnvType(env);
+    go.setMode(flag(p, "mirror", false), flag(p, "fm", true), dist);
+
+    for (int i=0; i<4; i++) {
+      go.num_bpts[i] = clamp((int) num(p, "bpts", 12), 2, MAX_BPTS);
+      go.max_amp_step[i] = num(p, "amp_step", 0.05f);
+      go.max_dur_step[i] = num(p, "dur_step", 0.01f);
+    }
+
+    go.freq = num(p, "freq", DEFAULT_FREQ);
+    go.g_rate = num(p, "grain_rate", DEFAULT_FREQ);
+    go.f_car = num(p, "fm_carrier", DEFAULT_FREQ);
+    go.f_mod = num(p, "fm_mod", DEFAULT_FREQ);
+    go.i_mod = num(p, "fm_index", 10.f);
+
+    oversamplers[b].setFactor(job.oversample);
+    bleps[b].reset(go);
+  }
+
+  renderFrames(job, wav, voices, [&](float *out, int n) {
+    for (int i=0; i<n; i++) {
+      for (int b=0; b<banks; b++) {
+        GendyOscillator4 &go = gos[b];
+        GendyBlep4 &blep = bleps[b];
+        simd::float_4 x = oversamplers[b].process(dt, [&](float subSampleTime) {
+          go.process(subSampleTime);
+          return job.band_limited ? blep.process(go) : go.out();
+        });
+
+        for (int c=b*4; c<std::min(voices, b*4 + 4); c++) out[i * voices + c] = x[c % 4];
+      }
+    }
+  });
+
+  return true;
+}
+
+/*
+ * Every voice stitches its own copy of the oscillators listed under
+ * "oscillators"
+ */
+static bool renderStitcher(const Job &job, WavWriter &wav, int voices) {
+  const int max_oscs = 4 * STITCHER_MAX_BANKS;
+
+  json_t *p = job.params;
+  json_t *oscs = json_object_get(p, "oscillators");
+  float dt = 1.f / job.rate;
+
+  int num_oscs = json_is_array(oscs) ? clamp((int) json_array_size(oscs), 1, max_oscs) : 4;
+  int stutters[max_oscs];
+
+  std::vector<StitchVoice> vs(voices);
+  std::vector<Oversampler> oversamplers(voices);
+
+  DistType dist = (DistType) pick(p, "dist", DIST_NAMES, NUM_DISTS, LINEAR);
+  float f_mod = num(p, "fm_mod", DEFAULT_FREQ);
+
+  for (int c=0; c<voices; c++) {
+    StitchVoice &v = vs[c];
+    v.reset(job.seed, c * max_oscs);
+
+    for (int k=0; k<num_oscs; k++) {
+      json_t *o = json_array_get(oscs, k);
+      GendyOscillator4 &bank = v.banks[k / 4];
+      int i = k % 4;
+
+      bank.num_bpts[i] = clamp((int) num(o, "bpts", 12), 2, MAX_BPTS);
+      bank.max_amp_step[i] = num(o, "amp_step", 0.05f);
+      bank.max_dur_step[i] = num(o, "dur_step", 0.01f);
+      bank.freq[i] = num(o, "freq", DEFAULT_FREQ);
+      bank.g_rate[i] = num(o, "grain_rate", DEFAULT_FREQ);
+      bank.f_car[i] = num(o, "fm_carrier", DEFAULT_FREQ);
+      bank.i_mod[i] = num(o, "fm_index", 10.f);
+      stutters[k] = clamp((int) num(o, "stutter", 5), 1, 5);
+    }
+
+    for (int b=0; b<STITCHER_MAX_BANKS; b++) {
+      v.banks[b].setMode(flag(p, "mirror", false), flag(p, "fm", true), dist);
+      v.banks[b].f_mod = f_mod;
+    }
+
+    oversamplers[c].setFactor(job.oversample);
+    v.setBandLimited(job.band_limited);
+  }
+
+  renderFrames(job, wav, voices, [&](float *out, int n) {
+    for (int i=0; i<n; i++) {
+      for (int c=0; c<voices; c++) {
+        out[i * voices + c] = oversamplers[c].process(dt, [&](float subSampleTime) {
+          return vs[c].process(subSampleTime, num_oscs, stutters);
+        });
+      }
+    }
+  });
+
+  return true;
+}
+
+/*
+ * GenEcho reworking "source". A mono file feeds every voice, the
+ * channels of any other feed voice c from channel c, wrapping around.
+ * The file is resampled to the render rate by linear interpolation
+ */
+static bool renderGenEcho(const Job &job, WavWriter &wav, int voices, WavReader &src) {
+  json_t *p = job.params;
+
+  std::vector<float> raw((size_t) src.frames * src.channels);
+  unsigned int frames = src.readFrames(raw.data(), src.frames);
+
+  int len = bufferLengthFor((float) frames / src.sample_rate);
+  unsigned int size = BUFFER_SECONDS[len] * job.rate;
+  double step = (double) src.sample_rate / job.rate;
+
+  const EnvTable *env = &env_tables[pick(p, "env", ENV_NAMES, NUM_ENVS, TUKEY)];
+  DistType dist = (DistType) pick(p, "dist", DIST_NAMES, NUM_DISTS, LINEAR);
+  bool mirror = flag(p, "mirror", false);
+  bool accumulate = flag(p, "accumulate", false);
+
+  std::vector<EchoVoice> vs(voices);
+
+  for (int c=0; c<voices; c++) {
+    EchoVoice &v = vs[c];
+    CaptureBuffer *b = new CaptureBuffer(size);
+    int sc = c % src.channels;
+
+    for (unsigned int i=0; i<size; i++) {
+      double x = i * step;
+      unsigned int j = (unsigned int) x;
+      if (j + 1 >= frames) break;
+
+      float y0 = raw[(size_t) j * src.channels + sc];
+      float y1 = raw[(size_t) (j + 1) * src.channels + sc];
+      b->_sample[i] = 5.f * (y0 + (float) (x - j) * (y1 - y0));
+    }
+    b->sample = b->_sample;
+
+    v.swap(b);
+    v.rg.seed(streamSeed(job.seed, c));
+
+    v.setLength(num(p, "length", 1.f));
+    v.setSpacing((unsigned int) (num(p, "spacing", 100.5f / 44100.f) * job.rate));
+    v.max_amp_step = num(p, "amp_step", 0.275f);
+    v.max_dur_step = num(p, "dur_step", 0.271f);
+  }
+
+  renderFrames(job, wav, voices, [&](float *out, int n) {
+    for (int i=0; i<n; i++) {
+      for (int c=0; c<voices; c++) {
+        out[i * voices + c] = 0.2f * vs[c].process(env, mirror, accumulate, dist);
+      }
+    }
+  });
+
+  for (int c=0; c<voices; c++) delete vs[c].swap(NULL);
+  return true;
+}
+
+/*
+ * Compare the render at path against the golden render at golden, and
+ * say where they first differ
+ */
+static bool compareGolden(const std::string &golden, const std::string &path, std::string &result) {
+  WavReader a, b;
+  if (!a.open(golden)) {
+    result = "no golden render";
+    return false;
+  }
+  if (!b.open(path)) {
+    result = "can't read the render back";
+    return false;
+  }
+  if (a.channels != b.channels || a.sample_rate != b.sample_rate || a.frames != b.frames) {
+    result = string::f("golden render is %d ch, %d Hz, %u frames, not %d ch, %d Hz, %u frames",
+        a.channels, a.sample_rate, a.frames, b.channels, b.sample_rate, b.frames);
+    return false;
+  }
+
+  std::vector<float> x(RENDER_BLOCK * a.channels), y(RENDER_BLOCK * b.channels);
+  long frame = 0;
+
+  for (int n; (n = a.readFrames(x.data(), RENDER_BLOCK)) > 0; frame += n) {
+    b.readFrames(y.data(), n);
+    for (int i=0; i<n * a.channels; i++) {
+      if (std::fabs(x[i] - y[i]) > CHECK_TOLERANCE) {
+        result = string::f("differs from golden render at frame %ld, channel %d (%f, not %f)",
+            frame + i / a.channels, i % a.channels, y[i], x[i]);
+        return false;
+      }
+    }
+  }
+
+  result = "matches golden render";
+  return true;
+}
+
+/*
+ * Fingerprint the render at path
+ */
+static bool fingerprint(const std::string &path, Fingerprint &fp) {
+  WavReader wav;
+  if (!wav.open(path) || wav.frames == 0) return false;
+
+  std::vector<float> x(RENDER_BLOCK * wav.channels);
+  std::vector<float> last(wav.channels, 0.f);
+  double sum = 0.0;
+  long crossings = 0;
+
+  for (int n; (n = wav.readFrames(x.data(), RENDER_BLOCK)) > 0;) {
+    for (int i=0; i<n * wav.channels; i++) {
+      int c = i % wav.channels;
+      sum += (double) x[i] * x[i];
+      fp.peak = std::max(fp.peak, (double) std::fabs(x[i]));
+      if ((x[i] < 0.f) != (last[c] < 0.f)) crossings++;
+      last[c] = x[i];
+    }
+  }
+
+  fp.rms = std::sqrt(sum / ((double) wav.frames * wav.channels));
+  fp.crossings = crossings * (double) wav.sample_rate / ((double) wav.frames * wav.channels);
+  return true;
+}
+
+/*
+ * Compare the render at path against the job's golden fingerprint
+ */
+static bool compareFingerprint(const Job &job, const std::string &path, std::string &result) {
+  Fingerprint fp;
+  if (!fingerprint(path, fp)) {
+    result = "can't read the render back";
+    return false;
+  }
+
+  const char *keys[3] = {"rms", "peak", "crossings"};
+  double values[3] = {fp.rms, fp.peak, fp.crossings};
+
+  for (int k=0; k<3; k++) {
+    double golden = num(job.golden, keys[k], -1.f);
+    if (std::fabs(values[k] - golden) > job.tolerance * std::fabs(golden)) {
+      result = string::f("%s is %g, not %g within %g%%", keys[k], values[k], golden, 100.0 * job.tolerance);
+      return false;
+    }
+  }
+
+  result = "matches golden fingerprint";
+  return true;
+}
+
+/*
+ * Store the fingerprint of the render at path as the job's golden one
+ */
+static bool recordFingerprint(const Job &job, const std::string &path, std::string &result) {
+  Fingerprint fp;
+  if (!fingerprint(path, fp)) {
+    result = "can't read the render back";
+    return false;
+  }
+
+  json_t *golden = json_object();
+  json_object_set_new(golden, "rms", json_real(fp.rms));
+  json_object_set_new(golden, "peak", json_real(fp.peak));
+  json_object_set_new(golden, "crossings", json_real(fp.crossings));
+
+  std::lock_guard<std::mutex> lock(record_mutex);
+  json_object_set_new(job.json, "golden", golden);
+  result = string::f("rms %g, peak %g, %g crossings/s", fp.rms, fp.peak, fp.crossings);
+  return true;
+}
+
+static bool renderJob(const Job &job) {
+  auto start = std::chrono::steady_clock::now();
+
+  int voices = job.voices;
+  WavReader src;
+
+  if (job.module == "genecho") {
+    std::string source = str(job.params, "source", "");
+    if (source.empty() || !src.open(source)) {
+      WARN("%s: GenEcho needs a \"source\" WAV file", job.out.c_str());
+      return false;
+    }
+    if (voices == 0) voices = std::min(src.channels, (int) PORT_MAX_CHANNELS);
+  }
+  else if (job.module != "grandy" && job.module != "stitcher") {
+    WARN("%s: unknown module \"%s\"", job.out.c_str(), job.module.c_str());
+    return false;
+  }
+
+  voices = clamp(voices, 1, (int) PORT_MAX_CHANNELS);
+
+  // checks render next to the golden file and compare afterwards
+  std::string path = (check || record) ? job.out + ".check.wav" : job.out;
+
+  WavWriter wav;
+  if (!wav.open(path, voices, job.rate)) return false;
+
+  bool ok;
+  if (job.module == "grandy") ok = renderGrandy(job, wav, voices);
+  else if (job.module == "stitcher") ok = renderStitcher(job, wav, voices);
+  else ok = renderGenEcho(job, wav, voices, src);
+
+  wav.close();
+
+  double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  std::string result;
+  if (record) {
+    ok = ok && recordFingerprint(job, path, result);
+    remove(path.c_str());
+  }
+  else if (check) {
+    ok = ok && (job.golden ? compareFingerprint(job, path, result) : compareGolden(job.out, path, result));
+    remove(path.c_str());
+  }
+
+  printf("%-40s %8.1f s in %7.2f s, %7.1fx realtime %s\n", job.out.c_str(), job.seconds, s, job.seconds / s, result.c_str());
+  fflush(stdout);
+
+  return ok;
+}
+
+static Job parseJob(json_t *j) {
+  Job job;
+  job.module = str(j, "module", "");
+  job.out = str(j, "out", job.module + ".wav");
+  job.seconds = std::max(0.f, num(j, "seconds", job.seconds));
+  job.rate = clamp((int) num(j, "rate", job.rate), 1000, 768000);
+  job.seed = (int) num(j, "seed", job.seed);
+  job.voices = (int) num(j, "voices", job.voices);
+  job.oversample = (int) num(j, "oversample", job.oversample);
+  job.band_limited = flag(j, "band_limited", job.band_limited);
+  job.params = json_object_get(j, "params");
+  job.json = j;
+  job.golden = json_object_get(j, "golden");
+  job.tolerance = num(j, "tolerance", job.tolerance);
+  return job;
+}
+
+int main(int argc, char **argv) {
+  int threads = std::max(1u, std::thread::hardware_concurrency());
+  std::vector<json_t*> files;
+  std::vector<const char*> paths;
+  std::vector<Job> jobs;
+
+  for (int i=1; i<argc; i++) {
+    if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+      threads = std::max(1, atoi(argv[++i]));
+      continue;
+    }
+    if (!strcmp(argv[i], "--check")) {
+      check = true;
+      continue;
+    }
+    if (!strcmp(argv[i], "--record")) {
+      record = true;
+      continue;
+    }
+
+    json_error_t error;
+    json_t *rootJ = json_load_file(argv[i], 0, &error);
+    if (!rootJ) {
+      fprintf(stderr, "%s:%d: %s\n", argv[i], error.line, error.text);
+      return 1;
+    }
+    files.push_back(rootJ);
+    paths.push_back(argv[i]);
+
+    if (json_is_array(rootJ)) {
+      for (size_t k=0; k<json_array_size(rootJ); k++) jobs.push_back(parseJob(json_array_get(rootJ, k)));
+    }
+    else {
+      jobs.push_back(parseJob(rootJ));
+    }
+  }
+
+  if (jobs.empty()) {
+    fprintf(stderr, "usage: %s [-j threads] [--check | --record] jobs.json...\n", argv[0]);
+    return 1;
+  }
+
+  initDistTables();
+  initWavetables();
+
+  // every thread takes the next job until there are none left
+  std::atomic<size_t> next(0);
+  std::atomic<int> failed(0);
+  std::vector<std::thread> pool;
+
+  for (int t=0; t<std::min(threads, (int) jobs.size()); t++) {
+    pool.push_back(std::thread([&]() {
+      for (size_t k=next++; k<jobs.size(); k=next++) {
+        if (!renderJob(jobs[k])) failed++;
+      }
+    }));
+  }
+
+  for (size_t t=0; t<pool.size(); t++) pool[t].join();
+
+  for (size_t f=0; f<files.size(); f++) {
+    if (record && json_dump_file(files[f], paths[f], JSON_INDENT(2) | JSON_REAL_PRECISION(6)) != 0) {
+      fprintf(stderr, "can't write %s\n", paths[f]);
+      failed++;
+    }
+    json_decref(files[f]);
+  }
+
+  return failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,255 @@
+/*
+ * Blep.hpp
+ * Samuel Laing - 2019
+ *
+ * Band-limited breakpoints. A GRANDY waveform is a chain of straight
+ * segments and every breakpoint is a corner, which aliases. Instead of
+ * oversampling the whole oscillator, precomputed minBLAMP residuals are
+ * added where a corner falls between two samples, and minBLEP residuals
+ * where the Stitcher jumps from one oscillator to the next.
+ */
+
+#ifndef __BLEP_HPP__
+#define __BLEP_HPP__
+
+#include "rack.hpp"
+#include "GrandyOscillator.hpp"
+
+// zero crossings and oversampling of the impulse tables, as Rack's VCO
+#define BLEP_ZERO_CROSSINGS 16
+#define BLEP_OVERSAMPLE 32
+
+// grain samples kept for delaying them as far as the minBLAMPs, the
+// delay plus the interpolator's reach
+#define GRAIN_DELAY_TAPS 5
+
+namespace rack {
+
+  /*
+   * Counterpart of dsp::MinBlepGenerator for changes of slope. A
+   * minimum phase ramp lags the naive one by the minBLEP's delay, so its
+   * residual never dies out. Instead the caller subtracts delay() times
+   * the current slope, making the naive signal as late as the ramps, and
+   * the residual against that ends at 0. The table is the same for every
+   * generator and only built once
+   */
+  template <int Z, int O, typename T = float>
+  struct MinBlampGenerator {
+    struct Table {
+      float impulse[2 * Z * O + 1];
+      float delay;
+
+      Table() {
+        float step[2 * Z * O + 1];
+        dsp::minBlepImpulse(Z, O, step);
+        step[2 * Z * O] = 1.f;
+
+        double acc = 0.0;
+        for (int i=0; i<=2 * Z * O; i++) {
+          impulse[i] = acc;
+          acc += (step[i] - 1.0) / O;
+        }
+
+        delay = -impulse[2 * Z * O];
+        for (int i=0; i<=2 * Z * O; i++) impulse[i] += delay;
+      }
+    };
+
+    T buf[2 * Z] = {};
+    int pos = 0;
+    const float *impulse = table().impulse;
+
+    static const Table &table() {
+      static const Table t;
+      return t;
+    }
+
+    /*
+     * Samples the smoothed ramps run late
+     */
+    static float delay() {
+      return table().delay;
+    }
+
+    /*
+     * The residual t samples after a change of slope by 1
+     */
+    static float residual(float t) {
+      if (!(0.f <= t && t < 2 * Z)) return 0.f;
+
+      const float *impulse = table().impulse;
+      float index = t * O;
+      int i = (int) index;
+      return impulse[i] + (index - i) * (impulse[i + 1] - impulse[i]);
+    }
+
+    /*
+     * The slope changed by x per sample, -p samples before the sample
+     * about to be output, -1 < p <= 0
+     */
+    void insertDiscontinuity(float p, T x) {
+      if (!(-1 < p && p <= 0)) return;
+
+      for (int j=0; j<2 * Z; j++) {
+        float index = ((float) j - p) * O;
+        int i = (int) index;
+        float value = impulse[i] + (index - i) * (impulse[i + 1] - impulse[i]);
+        buf[(pos + j) % (2 * Z)] += x * value;
+      }
+    }
+
+    /*
+     * For T = simd::float_4, lane i changed slope by x[i] at p[i], lanes
+     * with nothing to insert have x[i] = 0. Inserts them all at once
+     */
+    void insertDiscontinuities(simd::float_4 p, simd::float_4 x) {
+      p = simd::clamp(p, -0.999f, 0.f);
+
+      for (int j=0; j<2 * Z; j++) {
+        simd::float_4 index = ((float) j - p) * O;
+        simd::float_4 v0, v1;
+        for (int l=0; l<4; l++) {
+          int i = (int) index[l];
+          v0[l] = impulse[i];
+          v1[l] = impulse[i + 1];
+        }
+        simd::float_4 ph = index - simd::floor(index);
+        buf[(pos + j) % (2 * Z)] += x * (v0 + ph * (v1 - v0));
+      }
+    }
+
+    T process() {
+      T v = buf[pos];
+      buf[pos] = T(0);
+      pos = (pos + 1) % (2 * Z);
+      return v;
+    }
+
+    void reset() {
+      for (int j=0; j<2 * Z; j++) buf[j] = T(0);
+    }
+  };
+
+  typedef dsp::MinBlepGenerator<BLEP_ZERO_CROSSINGS, BLEP_OVERSAMPLE, float> MinBlep;
+  typedef MinBlampGenerator<BLEP_ZERO_CROSSINGS, BLEP_OVERSAMPLE, float> MinBlamp;
+  typedef MinBlampGenerator<BLEP_ZERO_CROSSINGS, BLEP_OVERSAMPLE, simd::float_4> MinBlamp4;
+
+  /*
+   * Band limits the output of a GendyOscillator4, called with it after
+   * every sample it computes. When a lane steps a breakpoint its phase
+   * tells how long ago, in fractions of a sample, the segment ended, and
+   * the change in slope is smoothed from that instant on. Fm grains
+   * don't get a minBLEP: the grain envelope is close to 0 at the
+   * breakpoints, so they hardly step there, and what they alias is their
+   * carriers, which only oversampling helps.
+   *
+   * The smoothed polygon runs MinBlamp4::delay() late, so the grains
+   * riding on it are split off and put through a fractional delay of the
+   * same length, keeping the two aligned
+   */
+  struct GendyBlep4 {
+    MinBlamp4 blamp;
+
+    // the last few grain samples, newest at grain_pos
+    simd::float_4 grain[GRAIN_DELAY_TAPS + 1];
+    int grain_pos = 0;
+
+    // slope of every lane's segment per sample and how fast its phase
+    // ran. The output is the naive one delayed by MinBlamp4::delay()
+    simd::float_4 slope = 0.f;
+    simd::float_4 speed = 0.f;
+
+    GendyBlep4() {
+      for (int j=0; j<=GRAIN_DELAY_TAPS; j++) grain[j] = 0.f;
+    }
+
+    /*
+     * Forget pending corrections and pick up go where it is, when
+     * switching on or after go was reset
+     */
+    void reset(const GendyOscillator4 &go) {
+      blamp.reset();
+      for (int j=0; j<=GRAIN_DELAY_TAPS; j++) grain[j] = 0.f;
+      slope = (go.amp_next - go.amp) * go.speed;
+      speed = go.speed;
+    }
+
+    /*
+     * Where in the sample just computed lane i stepped, -1 < p <= 0.
+     * The sample was output at phase - speed, that far past the end of
+     * the last segment at the speed it ran at. Only valid before process
+     */
+    float stepOffset(const GendyOscillator4 &go, int i) const {
+      if (speed[i] <= 0.f) return 0.f;
+      return -clamp((go.phase[i] - go.speed[i]) / speed[i], 0.f, 0.999f);
+    }
+
+    simd::float_4 process(const GendyOscillator4 &go) {
+      simd::float_4 s = (go.amp_next - go.amp) * go.speed;
+
+      if (go.step_flag) {
+        simd::float_4 p = 0.f;
+        simd::float_4 kink = 0.f;
+
+        for (int i=0; i<4; i++) {
+          if (!(go.step_flag & (1 << i))) continue;
+          p[i] = stepOffset(go, i);
+          kink[i] = s[i] - slope[i];
+        }
+
+        blamp.insertDiscontinuities(p, kink);
+      }
+
+      slope = s;
+      speed = go.speed;
+
+      // amp_out was interpolated at the phase before it advanced
+      simd::float_4 polygon = go.amp + (go.phase - go.speed) * (go.amp_next - go.amp);
+
+      grain_pos = (grain_pos + 1) % (GRAIN_DELAY_TAPS + 1);
+      grain[grain_pos] = go.amp_out - polygon;
+
+      return polygon - MinBlamp4::delay() * s + blamp.process() + delayedGrain();
+    }
+
+    /*
+     * The grain signal delay() samples ago, by 4 point Lagrange
+     * interpolation around it
+     */
+    simd::float_4 delayedGrain() const {
+      const float *taps = grainTaps();
+      simd::float_4 g = 0.f;
+      for (int j=0; j<4; j++) {
+        int k = (grain_pos - (grainTapOffset() + j) + 2 * (GRAIN_DELAY_TAPS + 1)) % (GRAIN_DELAY_TAPS + 1);
+        g += taps[j] * grain[k];
+      }
+      return g;
+    }
+
+    // the taps sit at grainTapOffset() + 0..3 samples ago
+    static int grainTapOffset() {
+      return (int) MinBlamp4::delay() - 1;
+    }
+
+    static const float *grainTaps() {
+      struct Taps {
+        float t[4];
+
+        Taps() {
+          float x = MinBlamp4::delay() - grainTapOffset();
+          for (int j=0; j<4; j++) {
+            float l = 1.f;
+            for (int m=0; m<4; m++) {
+              if (m != j) l *= (x - m) / (float) (j - m);
+            }
+            t[j] = l;
+          }
+        }
+      };
+      static const Taps taps;
+      return taps.t;
+    }
+  };
+}
+
+#endif
@@ -0,0 +1,94 @@
+/*
+ * ControlRate.hpp
+ * Samuel Laing - 2019
+ *
+ * Helpers for evaluating params and CV at control rate. Modules read
+ * their params once every CONTROL_RATE_DIVISION samples and hand the
+ * results to the oscillators through linear ramps, so the per-sample
+ * path never touches powf / rescale / quadraticBipolar.
+ */
+
+#ifndef __CONTROLRATE_HPP__
+#define __CONTROLRATE_HPP__
+
+#include "rack.hpp"
+#include "dsp/digital.hpp"
+
+#define CONTROL_RATE_DIVISION 32
+
+namespace rack {
+
+  /*
+   * Linear ramp from the current value to a new target over a fixed
+   * number of samples. T is either float or simd::float_4
+   */
+  template <typename T>
+  struct TParamRamp {
+    T value = 0.f;
+    T target = 0.f;
+    T inc = 0.f;
+    int remaining = 0;
+    bool primed = false;
+
+    /*
+     * Jump straight to v, cancelling any ramp in progress
+     */
+    void reset(T v) {
+      value = v;
+      target = v;
+      inc = 0.f;
+      remaining = 0;
+      primed = true;
+    }
+
+    /*
+     * Ramp towards t over the given number of samples. The very first
+     * target is taken immediately, there is nothing to smooth from yet
+     */
+    void setTarget(T t, int samples = CONTROL_RATE_DIVISION) {
+      if (!primed) {
+        reset(t);
+        return;
+      }
+      target = t;
+      inc = (target - value) / (float) samples;
+      remaining = samples;
+    }
+
+    T process() {
+      if (remaining > 0) {
+        remaining--;
+        // land exactly on the target to avoid drift
+        value = (remaining == 0) ? target : value + inc;
+      }
+      return value;
+    }
+  };
+
+  typedef TParamRamp<float> ParamRamp;
+
+  struct ControlRate {
+    dsp::ClockDivider divider;
+    bool first = true;
+
+    ControlRate() {
+      divider.setDivision(CONTROL_RATE_DIVISION);
+    }
+
+    /*
+     * Returns true on the samples where params should be read again.
+     * Always fires on the first call so oscillators start from the
+     * current knob positions
+     */
+    bool process() {
+      bool tick = divider.process();
+      if (first) {
+        first = false;
+        return true;
+      }
+      return tick;
+    }
+  };
+}
+
+#endif
@@ -0,0 +1,89 @@
+/*
+ * DistMenu.hpp
+ * Samuel Laing - 2019
+ *
+ * Context menu for picking any of the probability distributions. The
+ * panel switches only reach the first three, the rest are set from
+ * here. A module using it needs a PDST_PARAM, the 0 - 2 panel switch,
+ * and a hidden XDST_PARAM holding a distribution past the switch's, 0
+ * for none.
+ */
+
+#ifndef __DISTMENU_HPP__
+#define __DISTMENU_HPP__
+
+#include "rack.hpp"
+#include "wavetable.hpp"
+
+namespace rack {
+
+  static const char *DIST_LABELS[NUM_DISTS] = {
+    "Linear",
+    "Cauchy",
+    "Arcsine",
+    "Logistic",
+    "Hyperbolic cosine",
+    "Exponential",
+    "Sinus"
+  };
+
+  /*
+   * The distribution picked by the switch or the menu, read at control
+   * rate. One from the menu overrides the switch until the switch is
+   * moved
+   */
+  struct DistSelect {
+    // switch position on the last call, -1 before the first
+    int last_switch = -1;
+
+    DistType process(Param &pdst, Param &xdst) {
+      // patches from when the switch param held every distribution
+      if (pdst.getValue() > 2.f) {
+        xdst.setValue(clamp((int) pdst.getValue(), 0, NUM_DISTS - 1));
+        pdst.setValue(0.f);
+      }
+
+      int sw = clamp((int) pdst.getValue(), 0, 2);
+      if (last_switch >= 0 && sw != last_switch) xdst.setValue(0.f);
+      last_switch = sw;
+
+      int x = clamp((int) xdst.getValue(), 0, NUM_DISTS - 1);
+      return (DistType) (x > 0 ? x : sw);
+    }
+  };
+
+  template <class TModule>
+  struct DistItem : MenuItem {
+    TModule *module;
+    DistType dt;
+
+    void onAction(const event::Action &e) override {
+      if (dt <= 2) {
+        module->params[TModule::PDST_PARAM].setValue(dt);
+        module->params[TModule::XDST_PARAM].setValue(0.f);
+      }
+      else {
+        module->params[TModule::XDST_PARAM].setValue(dt);
+      }
+    }
+  };
+
+  template <class TModule>
+  void appendDistMenu(Menu *menu, TModule *module) {
+    int sw = clamp((int) module->params[TModule::PDST_PARAM].getValue(), 0, 2);
+    int x = clamp((int) module->params[TModule::XDST_PARAM].getValue(), 0, NUM_DISTS - 1);
+    int current = x > 0 ? x : sw;
+
+    menu->addChild(new MenuSeparator);
+    menu->addChild(createMenuLabel("Distribution"));
+
+    for (int i=0; i<NUM_DISTS; i++) {
+      DistItem<TModule> *item = createMenuItem<DistItem<TModule>>(DIST_LABELS[i], CHECKMARK(current == i));
+      item->module = module;
+      item->dt = (DistType) i;
+      menu->addChild(item);
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,431 @@
+/*
+ * EchoVoice.hpp
+ * Samuel Laing - 2019
+ *
+ * One voice of GenEcho: a capture buffer and the stochastic breakpoint
+ * walk that reworks it grain by grain. Only needs the DSP headers, so
+ * GenEcho's sound can also be rendered outside of Rack.
+ */
+
+#ifndef __ECHOVOICE_HPP__
+#define __ECHOVOICE_HPP__
+
+#include <atomic>
+#include <vector>
+
+#include "wavetable.hpp"
+#include "State.hpp"
+#include "ControlRate.hpp"
+
+// fewest samples between breakpoints at any supported engine rate,
+// bounds the number of breakpoints a buffer needs
+#define MIN_BPT_SPACING 100
+
+// buffer lengths to pick from, in seconds
+#define NUM_BUFFER_LENGTHS 6
+
+static const int BUFFER_SECONDS[NUM_BUFFER_LENGTHS] = {1, 5, 10, 30, 60, 180};
+
+/*
+ * The shortest buffer length that holds seconds of audio, the longest
+ * if none does
+ */
+inline int bufferLengthFor(float seconds) {
+  for (int i=0; i<NUM_BUFFER_LENGTHS; i++) {
+    if (BUFFER_SECONDS[i] >= seconds) return i;
+  }
+  return NUM_BUFFER_LENGTHS - 1;
+}
+
+// most memory the buffers of all voices may take together, a sample
+// costs its capture, working copy and generation
+#define CAPTURE_POOL_BYTES (512u << 20)
+#define CAPTURE_SAMPLE_BYTES 12
+
+/*
+ * Samples per voice for buffer length len at rate, cut short so the
+ * buffers of n voices fit in the pool
+ */
+inline unsigned int bufferSize(int len, unsigned int rate, int n) {
+  unsigned int size = BUFFER_SECONDS[len] * rate;
+  return std::min(size, (unsigned int) (CAPTURE_POOL_BYTES / CAPTURE_SAMPLE_BYTES / std::max(n, 1)));
+}
+
+// most samples of a grain computed in one go, spans never cross a
+// control rate tick
+#define GRAIN_SPAN CONTROL_RATE_DIVISION
+
+namespace rack {
+
+  /*
+   * The captured sample, its working copy and the breakpoint walk over
+   * it. Sized for a length in seconds at one engine rate. In the module
+   * they are only ever allocated or freed on the worker thread
+   */
+  struct CaptureBuffer {
+    unsigned int size;
+    unsigned int max_bpts;
+
+    std::vector<float> sample;
+    std::vector<float> _sample;
+
+    std::vector<float> mAmps;
+    std::vector<float> mDurs;
+
+    // generation of each slot, see EchoVoice::sampleAt
+    std::vector<uint32_t> sample_gens;
+    std::vector<uint32_t> bpt_gens;
+
+    // restored from a saved patch, the walk continues from these
+    // positions instead of the start when the buffer is swapped in
+    bool resume = false;
+    unsigned int resume_idx = 0;
+    unsigned int resume_index = 0;
+
+    // decoded from a file, the buffer length it was sized for, which the
+    // audio thread sets the length param to when swapping it in. -1 to
+    // leave the param alone
+    int length = -1;
+
+    CaptureBuffer(unsigned int size) : size(size), max_bpts(size / MIN_BPT_SPACING + 2),
+      sample(size, 0.f), _sample(size, 0.f),
+      mAmps(max_bpts, 0.f), mDurs(max_bpts, 1.f),
+      sample_gens(size, 0), bpt_gens(max_bpts, 0) {}
+  };
+
+  /*
+   * One channel of GenEcho: its capture buffer, read head and breakpoint
+   * walk. A voice has no buffer until its channel is in use
+   */
+  struct EchoVoice {
+    // owned by the audio thread, NULL while the voice is inactive
+    CaptureBuffer *buf = NULL;
+
+    dsp::SchmittTrigger gTrigger;
+    dsp::SchmittTrigger resetTrigger;
+
+    float phase = 1.0;
+
+    unsigned int sample_length = 44100;
+
+    unsigned int idx = 0;
+
+    // spacing between breakpoints in samples at the current rate
+    unsigned int bpt_spc = 1500;
+    unsigned int env_dur = bpt_spc / 2;
+
+    // number of breakpoints - to be calculated according to size of
+    // the sample
+    unsigned int num_bpts = 44100 / bpt_spc;
+
+    // generation counters so resets cost O(1). A sample or breakpoint
+    // whose generation is behind the current one is stale, and is
+    // restored the first time it is touched. Only ever changed by the
+    // audio thread
+    std::atomic<uint32_t> sample_gen{0};
+    std::atomic<uint32_t> bpt_gen{1};
+
+    unsigned int index = 0;
+
+    float max_amp_step = 0.05f;
+    float max_dur_step = 0.05f;
+
+    float amp = 0.f; 
+    float amp_next = 0.f;
+    float g_idx = 0.f; 
+    float g_idx_next = 0.5f;
+
+    // when true read in from wav0_input and store in the sample buffer
+    bool sampling = false;
+    unsigned int s_i = 0;
+
+    gRandGen rg;
+
+    // the next span_len samples of the walk, computed ahead by fillSpan
+    // and handed out one per sample by nextSample. Each entry is the
+    // output and the walk's state after it. Anything that would change
+    // them drops the span, and it is computed again from where the walk is
+    float span_out[GRAIN_SPAN];
+    float span_phase[GRAIN_SPAN];
+    float span_g_idx[GRAIN_SPAN];
+    float span_g_idx_next[GRAIN_SPAN];
+    unsigned int span_pos = 0;
+    unsigned int span_len = 0;
+
+    /*
+     * The working sample at i, restored from the captured one if a reset
+     * happened since it was last touched
+     */
+    float &sampleAt(unsigned int i) {
+      if (buf->sample_gens[i] != sample_gen) {
+        buf->sample_gens[i] = sample_gen;
+        buf->sample[i] = buf->_sample[i];
+      }
+      return buf->sample[i];
+    }
+
+    /*
+     * Clear breakpoint i back to its starting values if it is stale
+     */
+    void touchBpt(unsigned int i) {
+      if (buf->bpt_gens[i] != bpt_gen) {
+        buf->bpt_gens[i] = bpt_gen;
+        buf->mAmps[i] = 0.f;
+        buf->mDurs[i] = 1.f;
+      }
+    }
+
+    void dropSpan() {
+      span_pos = span_len = 0;
+    }
+
+    void restoreSample() {
+      sample_gen++;
+      dropSpan();
+    }
+
+    void clearBpts() {
+      bpt_gen++;
+      dropSpan();
+      // the current breakpoint's duration is read every sample
+      if (buf) touchBpt(index);
+    }
+
+    /*
+     * Take over buffer b, NULL to go inactive. Returns the one it had
+     */
+    CaptureBuffer *swap(CaptureBuffer *b) {
+      CaptureBuffer *old = buf;
+      buf = b;
+
+      dropSpan();
+      sampling = false;
+      s_i = 0;
+      if (!b) return old;
+
+      sample_length = std::min(sample_length, buf->size);
+      num_bpts = std::min(num_bpts, buf->max_bpts);
+
+      // a restored buffer holds the walk as it was saved, every slot is
+      // current. Anything else starts over with cleared breakpoints
+      if (b->resume) {
+        idx = std::min(b->resume_idx, buf->size - 1);
+        index = std::min(b->resume_index, buf->max_bpts - 1);
+        sample_gen = 0;
+        bpt_gen = 0;
+        return old;
+      }
+
+      idx = 0;
+      index = 0;
+      sample_gen = 0;
+      bpt_gen = 1;
+      touchBpt(index);
+      return old;
+    }
+
+    void save(StateWriter &w) {
+      w.put<uint32_t>(idx);
+      w.put<uint32_t>(index);
+      w.put(phase);
+      w.put(amp);
+      w.put(amp_next);
+      w.put(g_idx);
+      w.put(g_idx_next);
+      w.putArray(rg.gen.s, 4);
+    }
+
+    /*
+     * Read what save wrote. idx and index only apply once the saved
+     * buffer is swapped in, so they are handed back instead
+     */
+    void load(StateReader &r, unsigned int &saved_idx, unsigned int &saved_index) {
+      saved_idx = r.get<uint32_t>();
+      saved_index = r.get<uint32_t>();
+      r.get(phase);
+      r.get(amp);
+      r.get(amp_next);
+      r.get(g_idx);
+      r.get(g_idx_next);
+      r.getArray(rg.gen.s, 4);
+    }
+
+    /*
+     * Play the first fraction of the buffer, 0.1 to 1
+     */
+    void setLength(float fraction) {
+      sample_length = (int) (clamp(fraction, 0.1f, 1.f) * buf->size);
+    }
+
+    /*
+     * Space breakpoints spc samples apart, the buffer is cut into as many
+     * segments as fit into the played part
+     */
+    void setSpacing(unsigned int spc) {
+      bpt_spc = std::max(1u, spc);
+      num_bpts = std::min(sample_length / bpt_spc + 1, buf->max_bpts);
+      env_dur = bpt_spc / 2;
+    }
+
+    /*
+     * Start capturing into the buffer from the top, clearing the
+     * breakpoints
+     */
+    void gate() {
+      clearBpts();
+
+      num_bpts = std::max(1u, std::min(sample_length / bpt_spc, buf->max_bpts));
+      sampling = true;
+      idx = 0;
+      s_i = 0;
+    }
+
+    /*
+     * Store the next captured sample, only while sampling. The last 50
+     * samples of the buffer crossfade back into its start
+     */
+    void capture(float in) {
+      if (s_i >= buf->size - 50) {
+        float x,y,p;
+        x = buf->sample[s_i-1];
+        y = sampleAt(0);
+        p = 0.f;
+        while (s_i < buf->size) {
+          buf->sample[s_i] = (x * (1-p)) + (y * p);
+          buf->sample_gens[s_i] = sample_gen;
+          p += 1.f / 50.f;
+          s_i++;
+        }
+        DEBUG("Finished sampling");
+        sampling = false;
+      } else {
+        buf->sample[s_i] = in; 
+        buf->_sample[s_i] = buf->sample[s_i];
+        buf->sample_gens[s_i] = sample_gen;
+        s_i++;
+      } 
+    }
+
+    void fillSpan(const EnvTable *env, bool is_mirroring, bool is_accumulating, DistType dt, unsigned int limit);
+
+    /*
+     * Advance the walk by one sample and return it
+     */
+    float process(const EnvTable *env, bool is_mirroring, bool is_accumulating, DistType dt) {
+      // while capturing, the slot played next is only written in the same
+      // sample, so the span can't run ahead
+      if (span_pos == span_len) fillSpan(env, is_mirroring, is_accumulating, dt, sampling ? 1 : GRAIN_SPAN);
+
+      return nextSample();
+    }
+
+    /*
+     * Write the next sample of the span to the buffer, move the walk on
+     * past it and return it
+     */
+    float nextSample() {
+      unsigned int k = span_pos++;
+
+      buf->sample[idx] = span_out[k];
+      buf->sample_gens[idx] = sample_gen;
+
+      phase = span_phase[k];
+      g_idx = span_g_idx[k];
+      g_idx_next = span_g_idx_next[k];
+
+      idx++;
+      if (idx >= sample_length) idx %= sample_length;
+
+      return span_out[k];
+    }
+  };
+
+  /*
+   * Step to the next breakpoint if the last segment is over, then compute
+   * up to limit samples of the walk, stopping at the end of the segment
+   * or of the played part of the buffer. Within a segment the amplitude
+   * and the rates of the grain and of phase are constant, so the walk is
+   * a few adds per sample and the grain is applied to the whole span four
+   * samples at a time. The buffer itself is only written by nextSample
+   */
+  inline void EchoVoice::fillSpan(const EnvTable *env, bool is_mirroring, bool is_accumulating, DistType dt, unsigned int limit) {
+    float *mAmps = buf->mAmps.data();
+    float *mDurs = buf->mDurs.data();
+
+    if (phase >= 1.0) {
+      phase -= 1.0;
+
+      amp = amp_next;
+      index = (index + 1) % num_bpts;
+      touchBpt(index);
+
+      // adjust vals
+      float astp = max_amp_step * rg.next(dt);
+      float dstp = max_dur_step * rg.next(dt);
+
+      if (is_mirroring) {
+        mAmps[index] = mirror((is_accumulating ? mAmps[index] : 0.f) + astp, -1.0f, 1.0f); 
+        mDurs[index] = mirror(mDurs[index] + (dstp), 0.5, 1.5);
+      }
+      else {
+        mAmps[index] = wrap((is_accumulating ? mAmps[index] : 0.f) + astp, -1.0f, 1.0f); 
+        mDurs[index] = wrap(mDurs[index] + dstp, 0.5, 1.5);
+      }
+
+      amp_next = mAmps[index];
+
+      // step/adjust grain sample offsets 
+      g_idx = g_idx_next;
+      g_idx_next = 0.0;
+    }
+
+    // idx may be past the end after the length was shortened, it wraps
+    // after one sample
+    unsigned int n_max = idx < sample_length ? std::min(limit, sample_length - idx) : 1;
+
+    float g_inc = 1.f / (4.f * env_dur);
+    float p_inc = 1.f / (mDurs[index] * bpt_spc);
+
+    float g[GRAIN_SPAN];
+    float gi = g_idx;
+    float gn = g_idx_next;
+    float p = phase;
+    unsigned int n = 0;
+
+    do {
+      g[n] = gi;
+      gi = dspmath::fmod1(gi + g_inc);
+      gn = dspmath::fmod1(gn + g_inc);
+      p += p_inc;
+
+      span_g_idx[n] = gi;
+      span_g_idx_next[n] = gn;
+      span_phase[n] = p;
+      n++;
+    } while (n < n_max && p < 1.0);
+
+    // current values of the span's samples, stale ones restored, plus
+    // the enveloped amplitude
+    const float *sample = buf->sample.data() + idx;
+    const float *_sample = buf->_sample.data() + idx;
+    const uint32_t *gens = buf->sample_gens.data() + idx;
+
+    unsigned int k = 0;
+    for (; k + 4 <= n; k += 4) {
+      __m128i live = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *) (gens + k)), _mm_set1_epi32(sample_gen));
+      simd::float_4 s = simd::ifelse(simd::float_4(_mm_castsi128_ps(live)), simd::float_4::load(sample + k), simd::float_4::load(_sample + k));
+      simd::float_4 e = env->get(simd::float_4::load(g + k));
+
+      wrap(s + (amp * e), -5.f, 5.f).store(span_out + k);
+    }
+    for (; k < n; k++) {
+      float s = gens[k] == sample_gen ? sample[k] : _sample[k];
+      span_out[k] = wrap(s + (amp * env->get(g[k])), -5.f, 5.f);
+    }
+
+    span_pos = 0;
+    span_len = n;
+  }
+}
+
+#endif
@@ -9,11 +9,30 @@
 
 #include "dsp/digital.hpp"
 #include "dsp/resampler.hpp"
+#include "osdialog.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <vector>
 
 #include "wavetable.hpp"
+#include "wavfile.hpp"
+#include "EchoVoice.hpp"
+#include "State.hpp"
+#include "ControlRate.hpp"
+#include "Worker.hpp"
+#include "SeedMenu.hpp"
+#include "DistMenu.hpp"
+#include "RecordMenu.hpp"
+#include "TimingMenu.hpp"
 
-#define MAX_BPTS 4096 
-#define MAX_SAMPLE_SIZE 44100 
+// breakpoint spacing knob and CV are in samples at this rate, and are
+// converted to time so the sound doesn't change with the engine rate
+#define BPT_REFERENCE_RATE 44100.f
 
 struct GenEcho : Module {
 	enum ParamIds {
@@ -30,6 +49,9 @@ struct GenEcho : Module {
     MIRR_PARAM,
     PDST_PARAM,
     ACCM_PARAM,
+    SEED_PARAM,
+    BLEN_PARAM,
+    XDST_PARAM,
     NUM_PARAMS
 	};
 	enum InputIds {
@@ -50,64 +72,91 @@ struct GenEcho : Module {
 		NUM_LIGHTS
 	};
 
-	float phase = 1.0;
 	float blinkPhase = 0.0;
 
   dsp::SchmittTrigger smpTrigger;
-  dsp::SchmittTrigger gTrigger;
-  dsp::SchmittTrigger g2Trigger;
-  dsp::SchmittTrigger resetTrigger;
 
-  float sample[MAX_SAMPLE_SIZE] = {0.f};
-  float _sample[MAX_SAMPLE_SIZE] = {0.f};
+  EchoVoice voices[PORT_MAX_CHANNELS];
 
-  unsigned int channels;
-  unsigned int sampleRate;
- 
-  unsigned int sample_length = MAX_SAMPLE_SIZE;
+  // the widest polyphonic input, or the loaded file's channel count,
+  // sets the number of voices
+  int channels = 1;
 
-  unsigned int idx = 0;
+  // the buffer pool, one slot per voice, shared with the worker. fresh
+  // is a newly allocated buffer waiting to be swapped in, retired a
+  // swapped out one waiting to be freed. Buffers are only freed by the
+  // worker
+  std::atomic<CaptureBuffer*> fresh[PORT_MAX_CHANNELS];
+  std::atomic<CaptureBuffer*> retired[PORT_MAX_CHANNELS];
 
-  // spacing between breakpoints... in samples rn
-  unsigned int bpt_spc = 1500;
-  unsigned int env_dur = bpt_spc / 2;
+  // buffer size, engine rate and number of voices the audio thread asks
+  // for, and the size the worker last allocated for each voice, 0 for
+  // none, and the rate it allocated them at, 0 for restored buffers
+  // which are kept at any rate
+  std::atomic<unsigned int> wanted_size;
+  std::atomic<unsigned int> wanted_rate;
+  std::atomic<int> wanted_channels;
+  unsigned int built_size[PORT_MAX_CHANNELS] = {};
+  unsigned int built_rate = 44100;
 
-  // number of breakpoints - to be calculated according to size of
-  // the sample
-  unsigned int num_bpts = MAX_SAMPLE_SIZE / bpt_spc;
+  // audio file the buffers are filled from, empty when capturing from
+  // WAV0_INPUT, and the id naming this module's sidecar file, the
+  // buffers saved with the patch. Never touched by the audio thread
+  std::mutex path_mutex;
+  std::string path;
+  std::string state_id;
 
-  float mAmps[MAX_BPTS] = {0.f};
-  float mDurs[MAX_BPTS] = {1.f};
+  // channels in the loaded file, 0 when there is none
+  std::atomic<int> file_channels;
 
-  Wavetable env = Wavetable(TRI); 
+  // saving asks for a snapshot, which the audio thread takes between two
+  // blocks and hands to the worker to write out. Buffers aren't swapped
+  // until it is written, so none in it is freed. A sidecar is only
+  // written again once a capture or a loaded file changed the buffers,
+  // as counted by dirty_gen
+  std::atomic<bool> snapshot_request;
+  std::atomic<bool> snapshot_ready;
+  CaptureBuffer *snap_buf[PORT_MAX_CHANNELS] = {};
+  uint32_t snap_gen = 0;
+  std::atomic<uint32_t> dirty_gen;
 
-  unsigned int index = 0;
-  
-  float max_amp_step = 0.05f;
-  float max_dur_step = 0.05f;
+  // some voice captured from WAV0_INPUT since the last control tick
+  bool captured = false;
+
+  // every sidecar written carries a tag, and the patch saved with it
+  // names the tag. An older copy of the patch then rejects a sidecar
+  // written since, instead of resuming its walks over other buffers
+  std::atomic<uint64_t> save_tag;
 
-  float amp = 0.f; 
-  float amp_next = 0.f;
-  float g_idx = 0.f; 
-  float g_idx_next = 0.5f;
- 
-  // when true read in from wav0_input and store in the sample buffer
-  bool sampling = false;
-  unsigned int s_i = 0;
+  // the last sidecar the worker wrote or read, dirty_gen and its tag then
+  std::string written_name;
+  std::atomic<uint32_t> written_gen;
+  std::atomic<uint64_t> written_tag;
 
-  float bpts_sig = 1.f;
-  float astp_sig = 1.f;
-  float dstp_sig = 1.f;
+  unsigned int sampleRate = 44100;
 
-  float astp = 1.f;
-  float dstp = 1.f;
+  const EnvTable *env = &env_tables[TRI];
 
   bool is_mirroring = false;
   bool is_accumulating = false;
   
-  gRandGen rg;
   DistType dt = LINEAR; 
 
+  // seed the walks were last seeded with, -1 forces a reseed
+  int seed = -1;
+
+  // params are read at control rate
+  ControlRate control;
+
+  // the distribution from the panel switch or the menu
+  DistSelect dist;
+
+  Recorder recorder;
+  ProcessTimer timer;
+
+  // declared last so it is stopped before anything it touches goes away
+  Worker worker;
+
   GenEcho() {
     config(NUM_PARAMS, NUM_INPUTS, NUM_OUTPUTS, NUM_LIGHTS);
 
@@ -122,129 +171,827 @@ struct GenEcho : Module {
     configParam(ACCM_PARAM, 0.f, 1.f, 0.f);
     configParam(MIRR_PARAM, 0.f, 1.f, 0.f);
     configParam(PDST_PARAM, 0.f, 2.f, 0.f);
+    configParam(XDST_PARAM, 0.f, NUM_DISTS - 1, 0.f, "Distribution");
+    configParam(SEED_PARAM, 0.f, MAX_SEED, 0.f, "Random seed");
+    configParam(BLEN_PARAM, 0.f, NUM_BUFFER_LENGTHS - 1, 0.f, "Buffer length");
+
+    for (int c=0; c<PORT_MAX_CHANNELS; c++) {
+      fresh[c] = NULL;
+      retired[c] = NULL;
+    }
+
+    // one voice of one second at 44.1 kHz until the engine rate and the
+    // inputs are known
+    voices[0].swap(new CaptureBuffer(44100));
+    built_size[0] = voices[0].buf->size;
+    wanted_size = built_size[0];
+    wanted_rate = 44100;
+    wanted_channels = 1;
+    file_channels = 0;
+
+    snapshot_request = false;
+    snapshot_ready = false;
+    dirty_gen = 0;
+    written_gen = 0;
+    save_tag = 0;
+    written_tag = 0;
+    state_id = newStateId();
+
+    worker.start([this]() {
+      if (snapshot_ready) writeSnapshot();
+      allocate();
+    });
+  }
+
+  ~GenEcho() {
+    worker.stop();
+
+    // the engine no longer runs this module, so a snapshot still asked
+    // for can be taken and written right here
+    if (snapshot_request || snapshot_ready) {
+      if (!snapshot_ready) takeSnapshot();
+      writeSnapshot();
+    }
+    releaseStateId(state_id);
+
+    for (int c=0; c<PORT_MAX_CHANNELS; c++) {
+      delete voices[c].buf;
+      delete fresh[c].load();
+      delete retired[c].load();
+    }
   }
 
   void process(const ProcessArgs &args) override;
+  void processControls();
+  void reseed();
+  void allocate();
+  void swapBuffers();
+  void decode(WavReader &wav, unsigned int rate, CaptureBuffer **bs, int n);
+  bool loadFile(const std::string &p);
+  void loadSample(const std::string &p);
+  void unloadSample();
+  std::string samplePath();
+
+  static std::string newStateId();
+  static bool claimStateId(const std::string &id);
+  static void releaseStateId(const std::string &id);
+  static int deleteUnusedSidecars();
+  std::string sidecarName();
+  static std::string sidecarPath(const std::string &name);
+  void takeSnapshot();
+  void writeSnapshot();
+  bool writeSidecar(const std::string &file, uint64_t tag);
+  bool readSidecar(const std::string &file, uint64_t tag, CaptureBuffer **bs);
+
+  json_t *dataToJson() override;
+  void dataFromJson(json_t *rootJ) override;
 };
 
 void GenEcho::process(const ProcessArgs &args) {
-  // Implement a simple sine oscillator
-  //float deltaTime = engineGetSampleTime();
-  float amp_out = 0.0;
+  sampleRate = (unsigned int) args.sampleRate;
+
+  timer.begin();
+
+  if (control.process()) {
+    timer.mark(TIMING_CONTROL);
+    processControls();
+  }
+
+  // handle sample reset, the button resets every voice
+  bool reset_all = smpTrigger.process(params[TRIG_PARAM].getValue());
+
+  for (int c=0; c<channels; c++) {
+    EchoVoice &v = voices[c];
+
+    // a new channel gets its buffer from the worker shortly
+    if (!v.buf) {
+      outputs[SINE_OUTPUT].setVoltage(0.f, c);
+      continue;
+    }
+
+    if (v.resetTrigger.process(inputs[RSET_INPUT].getPolyVoltage(c) / 2.f) || reset_all) {
+      v.restoreSample();
+      v.clearBpts();
+      timer.mark(TIMING_RESET);
+    }
+
+    // handle sample trigger through gate 
+    if (v.gTrigger.process(inputs[GATE_INPUT].getPolyVoltage(c) / 2.f)) {
+      v.gate();
+      timer.mark(TIMING_RESET);
+    }
+
+    if (v.sampling) {
+      v.capture(inputs[WAV0_INPUT].getPolyVoltage(c));
+      captured = true;
+    }
+
+    // the next span is computed when this one runs out, starting with
+    // the breakpoint step when the phase has wrapped
+    if (v.span_pos == v.span_len) timer.mark(v.phase >= 1.f ? TIMING_BREAKPOINT : TIMING_SPAN);
+
+    // get that amp OUT
+    outputs[SINE_OUTPUT].setVoltage(v.process(env, is_mirroring, is_accumulating, dt), c);
+  }
+
+  outputs[SINE_OUTPUT].setChannels(channels);
+
+  if (recorder.active) recorder.push(outputs[SINE_OUTPUT].voltages);
+
+  timer.end();
+}
+
+/*
+ * Read every param and CV input, called once per CONTROL_RATE_DIVISION
+ * samples. Every input is polyphonic, voice c reads channel c
+ */
+void GenEcho::processControls() {
+  channels = std::max(1, std::min((int) PORT_MAX_CHANNELS, file_channels.load()));
+  for (int i=0; i<NUM_INPUTS; i++) channels = std::max(channels, inputs[i].getChannels());
+
+  // a capture changes what a sidecar holds, playing over it doesn't
+  if (captured) {
+    dirty_gen.store(dirty_gen.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    captured = false;
+  }
+
+  if (!snapshot_ready && snapshot_request.exchange(false)) {
+    takeSnapshot();
+    worker.wake();
+  }
+
+  // take over whatever buffers the worker has ready, a loaded file's
+  // come with the length they were sized for. Then ask for new ones if
+  // the length, the engine rate or the number of voices changed
+  swapBuffers();
+
+  int len = clamp((int) params[BLEN_PARAM].getValue(), 0, NUM_BUFFER_LENGTHS - 1);
+  unsigned int size = bufferSize(len, sampleRate, channels);
+
+  if (size != wanted_size.load() || sampleRate != wanted_rate.load() || channels != wanted_channels.load()) {
+    wanted_rate = sampleRate;
+    wanted_size = size;
+    wanted_channels = channels;
+    worker.wake();
+  }
+
+  int new_seed = (int) params[SEED_PARAM].getValue();
+  if (new_seed != seed) {
+    timer.mark(TIMING_RESET);
+    seed = new_seed;
+    reseed();
+  }
 
   // handle the 3 switches for accumlating and mirror toggle
   // and probability distrobution selection
   is_accumulating = (int) params[ACCM_PARAM].getValue();
   is_mirroring = (int) params[MIRR_PARAM].getValue();
-  dt = (DistType) params[PDST_PARAM].getValue();
+  dt = dist.process(params[PDST_PARAM], params[XDST_PARAM]);
 
-  // read in cv vals for astp, dstp and bpts
-  bpts_sig = 5.f * dsp::quadraticBipolar((inputs[BPTS_INPUT].getVoltage() / 5.f) * params[BPTSCV_PARAM].getValue());
-  astp_sig = dsp::quadraticBipolar((inputs[ASTP_INPUT].getVoltage() / 5.f) * params[ASTPCV_PARAM].getValue());
-  dstp_sig = dsp::quadraticBipolar((inputs[DSTP_INPUT].getVoltage() / 5.f) * params[DSTPCV_PARAM].getValue());
+  // snap knob for selecting envelope for the grain
+  int env_num = (int) clamp(roundf(params[ENVS_PARAM].getValue()), 1.0f, 4.0f);
 
-  max_amp_step = rescale(params[ASTP_PARAM].getValue() + (astp_sig / 4.f), 0.0, 1.0, 0.05, 0.3);
-  max_dur_step = rescale(params[DSTP_PARAM].getValue() + (dstp_sig / 4.f), 0.0, 1.0, 0.01, 0.3);
+  if (env != &env_tables[env_num]) timer.mark(TIMING_ENV);
+  env = &env_tables[env_num];
 
-  sample_length = (int) (clamp(params[SLEN_PARAM].getValue(), 0.1, 1.f) * MAX_SAMPLE_SIZE);
+  for (int c=0; c<channels; c++) {
+    EchoVoice &v = voices[c];
+    if (!v.buf) continue;
 
-  bpt_spc = (unsigned int) params[BPTS_PARAM].getValue() + 800;
-  bpt_spc += (unsigned int) rescale(bpts_sig, -1.f, 1.f, 1.f, 200.f);
-  num_bpts = sample_length / bpt_spc + 1;
- 
-  env_dur = bpt_spc / 2;
+    // spans were computed with the old values
+    v.dropSpan();
 
-  // snap knob for selecting envelope for the grain
-  int env_num = (int) clamp(roundf(params[ENVS_PARAM].getValue()), 1.0f, 4.0f);
+    // read in cv vals for astp, dstp and bpts
+    float bpts_sig = 5.f * dsp::quadraticBipolar((inputs[BPTS_INPUT].getPolyVoltage(c) / 5.f) * params[BPTSCV_PARAM].getValue());
+    float astp_sig = dsp::quadraticBipolar((inputs[ASTP_INPUT].getPolyVoltage(c) / 5.f) * params[ASTPCV_PARAM].getValue());
+    float dstp_sig = dsp::quadraticBipolar((inputs[DSTP_INPUT].getPolyVoltage(c) / 5.f) * params[DSTPCV_PARAM].getValue());
+
+    v.max_amp_step = rescale(params[ASTP_PARAM].getValue() + (astp_sig / 4.f), 0.0, 1.0, 0.05, 0.3);
+    v.max_dur_step = rescale(params[DSTP_PARAM].getValue() + (dstp_sig / 4.f), 0.0, 1.0, 0.01, 0.3);
+
+    v.setLength(params[SLEN_PARAM].getValue());
 
-  if (env.et != (EnvType) env_num) {
-    env.switchEnvType((EnvType) env_num);
+    // breakpoint spacing as a time, converted to samples at the engine rate
+    float bpt_time = (params[BPTS_PARAM].getValue() + 800.f + rescale(bpts_sig, -1.f, 1.f, 1.f, 200.f)) / BPT_REFERENCE_RATE;
+    v.setSpacing((unsigned int) (bpt_time * sampleRate));
   }
+}
+
+/*
+ * Runs on the worker thread: free retired buffers and allocate the
+ * wanted ones, refilled from the audio file if one is loaded. Only the
+ * voices in use get a buffer, and a fresh buffer that was never swapped
+ * in is replaced
+ */
+void GenEcho::allocate() {
+  for (int c=0; c<PORT_MAX_CHANNELS; c++) delete retired[c].exchange(NULL);
 
-  // handle sample reset
-  if (smpTrigger.process(params[TRIG_PARAM].getValue()) || resetTrigger.process(inputs[RSET_INPUT].getVoltage() / 2.f)) {
-    for (unsigned int i=0; i<MAX_SAMPLE_SIZE; i++) sample[i] = _sample[i];
-    for (unsigned int i=0; i<MAX_BPTS; i++) {
-      mAmps[i] = 0.f;
-      mDurs[i] = 1.f; 
+  unsigned int size = wanted_size.load();
+  unsigned int rate = wanted_rate.load();
+  int n = wanted_channels.load();
+  if (size == 0) return;
+
+  // a pool capped buffer keeps its size at another rate, but a file
+  // still has to be resampled for it
+  bool rate_changed = built_rate != 0 && built_rate != rate;
+  built_rate = rate;
+
+  CaptureBuffer *bs[PORT_MAX_CHANNELS] = {};
+  bool any = false;
+
+  for (int c=0; c<PORT_MAX_CHANNELS; c++) {
+    if (c >= n) {
+      // the audio thread retires the buffer of an unused voice
+      built_size[c] = 0;
+      delete fresh[c].exchange(NULL);
+    }
+    else if (built_size[c] != size || rate_changed) {
+      built_size[c] = size;
+      bs[c] = new CaptureBuffer(size);
+      any = true;
     }
   }
 
-  // handle sample trigger through gate 
-  if (g2Trigger.process(inputs[GATE_INPUT].getVoltage() / 2.f)) {
+  if (!any) return;
 
-    // reset accumulated breakpoint vals
-    for (unsigned int i=0; i<MAX_BPTS; i++) {
-      mAmps[i] = 0.f;
-      mDurs[i] = 1.f;
-    }
+  std::string p = samplePath();
+  WavReader wav;
+  if (!p.empty() && wav.open(p)) decode(wav, rate, bs, n);
+
+  for (int c=0; c<n; c++) {
+    if (bs[c]) delete fresh[c].exchange(bs[c]);
+  }
+}
+
+/*
+ * Stream an audio file into the first n buffers of bs, resampled to the
+ * engine rate and scaled to +/-5V. A mono file fills every buffer, the
+ * channels of any other feed voice c from channel c, wrapping around.
+ * NULL buffers are skipped and files longer than the buffers are cut
+ * short. Worker thread only
+ */
+void GenEcho::decode(WavReader &wav, unsigned int rate, CaptureBuffer **bs, int n) {
+  const int block = 1024;
+  int nc = std::min(wav.channels, (int) PORT_MAX_CHANNELS);
+
+  std::vector<dsp::Frame<PORT_MAX_CHANNELS>> in(block);
+  std::vector<dsp::Frame<PORT_MAX_CHANNELS>> out(block);
+  std::vector<float> raw(block * wav.channels);
+
+  dsp::SampleRateConverter<PORT_MAX_CHANNELS> src;
+  src.setChannels(nc);
+  src.setRates(wav.sample_rate, rate);
 
-    num_bpts = sample_length / bpt_spc;
-    sampling = true;
-    idx = 0;
-    s_i = 0;
-  }
-
-  if (sampling) {
-    if (s_i >= MAX_SAMPLE_SIZE - 50) {
-      float x,y,p;
-      x = sample[s_i-1];
-      y = sample[0];
-      p = 0.f;
-      while (s_i < MAX_SAMPLE_SIZE) {
-        sample[s_i] = (x * (1-p)) + (y * p);
-        p += 1.f / 50.f;
-        s_i++;
+  unsigned int size = 0;
+  for (int c=0; c<n; c++) {
+    if (bs[c]) size = bs[c]->size;
+  }
+
+  unsigned int pos = 0;
+
+  // convert the first frames of in, writing at most up to end
+  auto convert = [&](int frames, unsigned int end) {
+    // the converter may not take the whole block in one go
+    int offset = 0;
+    while (offset < frames && pos < end) {
+      int in_frames = frames - offset;
+      int out_frames = std::min((unsigned int) block, end - pos);
+      src.process(in.data() + offset, &in_frames, out.data(), &out_frames);
+
+      for (int c=0; c<n; c++) {
+        if (!bs[c]) continue;
+        float *dst = bs[c]->_sample.data() + pos;
+        for (int i=0; i<out_frames; i++) dst[i] = out[i].samples[c % nc];
       }
-      DEBUG("Finished sampling");
-      sampling = false;
-    } else {
-      sample[s_i] = inputs[WAV0_INPUT].getVoltage(); 
-      _sample[s_i] = sample[s_i];
-      s_i++;
-    } 
+      pos += out_frames;
+      offset += in_frames;
+
+      if (in_frames == 0 && out_frames == 0) break;
+    }
+  };
+
+  while (pos < size) {
+    int frames = wav.readFrames(raw.data(), block);
+    if (frames == 0) break;
+
+    for (int i=0; i<frames; i++) {
+      for (int c=0; c<nc; c++) in[i].samples[c] = 5.f * raw[i * wav.channels + c];
+    }
+    convert(frames, size);
   }
 
-  if (phase >= 1.0) {
-    phase -= 1.0;
+  // the converter holds back the last frames until it sees what follows
+  // them, so drain it with silence up to the resampled length of the file
+  unsigned int end = (unsigned int) std::min((uint64_t) size, (uint64_t) wav.frames * rate / wav.sample_rate);
+  for (int i=0; i<block; i++) {
+    for (int c=0; c<nc; c++) in[i].samples[c] = 0.f;
+  }
+  while (pos < end) {
+    unsigned int last = pos;
+    convert(block, end);
+    if (pos == last) break;
+  }
 
-    amp = amp_next;
-    index = (index + 1) % num_bpts;
-    
-    // adjust vals
-    astp = max_amp_step * rg.my_rand(dt, random::normal());
-    dstp = max_dur_step * rg.my_rand(dt, random::normal());
+  for (int c=0; c<n; c++) {
+    if (bs[c]) bs[c]->sample = bs[c]->_sample;
+  }
+}
+
+/*
+ * Decode an audio file and swap it in as the capture of every voice,
+ * picking the shortest buffer length that holds all of it. Worker
+ * thread only
+ */
+bool GenEcho::loadFile(const std::string &p) {
+  WavReader wav;
+  if (!wav.open(p)) return false;
+
+  float seconds = (float) wav.frames / wav.sample_rate;
+  int len = bufferLengthFor(seconds);
+
+  // every voice of the file gets a buffer right away, without waiting
+  // for the audio thread to ask for them
+  int n = std::max(wanted_channels.load(), std::min(wav.channels, (int) PORT_MAX_CHANNELS));
+
+  unsigned int rate = wanted_rate.load();
+  unsigned int size = bufferSize(len, rate, n);
+
+  CaptureBuffer *bs[PORT_MAX_CHANNELS] = {};
+  for (int c=0; c<n; c++) {
+    bs[c] = new CaptureBuffer(size);
+    bs[c]->length = len;
+  }
+  decode(wav, rate, bs, n);
+
+  {
+    std::lock_guard<std::mutex> lock(path_mutex);
+    path = p;
+  }
+
+  // the audio thread sets the length param as it swaps these in, and
+  // until then asks for buffers of the old length. A slot still holding
+  // a retired buffer takes nothing new, so free those first
+  for (int c=0; c<PORT_MAX_CHANNELS; c++) delete retired[c].exchange(NULL);
 
-    if (is_mirroring) {
-      mAmps[index] = mirror((is_accumulating ? mAmps[index] : 0.f) + astp, -1.0f, 1.0f); 
-      mDurs[index] = mirror(mDurs[index] + (dstp), 0.5, 1.5);
+  file_channels = wav.channels;
+  built_rate = rate;
+  for (int c=0; c<n; c++) {
+    built_size[c] = size;
+    delete fresh[c].exchange(bs[c]);
+  }
+
+  wanted_size = size;
+  wanted_channels = n;
+
+  INFO("Loaded %s, %.1f s, %d channels", p.c_str(), seconds, wav.channels);
+  return true;
+}
+
+/*
+ * Load an audio file on the worker. Called from the UI thread
+ */
+void GenEcho::loadSample(const std::string &p) {
+  worker.post([this, p]() { loadFile(p); });
+}
+
+/*
+ * Go back to capturing from WAV0_INPUT with empty buffers
+ */
+void GenEcho::unloadSample() {
+  worker.post([this]() {
+    {
+      std::lock_guard<std::mutex> lock(path_mutex);
+      path.clear();
     }
-    else {
-      mAmps[index] = wrap((is_accumulating ? mAmps[index] : 0.f) + astp, -1.0f, 1.0f); 
-      mDurs[index] = wrap(mDurs[index] + dstp, 0.5, 1.5);
+    file_channels = 0;
+
+    for (int c=0; c<PORT_MAX_CHANNELS; c++) {
+      if (built_size[c]) delete fresh[c].exchange(new CaptureBuffer(built_size[c]));
     }
-  
-    amp_next = mAmps[index];
-    
-    // step/adjust grain sample offsets 
-    g_idx = g_idx_next;
-    g_idx_next = 0.0;
+  });
+}
+
+std::string GenEcho::samplePath() {
+  std::lock_guard<std::mutex> lock(path_mutex);
+  return path;
+}
+
+/*
+ * Take over fresh buffers from the worker and hand back those of voices
+ * no longer in use. A new buffer starts out empty, the capture is lost
+ * when the length or engine rate changes
+ */
+void GenEcho::swapBuffers() {
+  // the snapshot being written may hold the buffers that would go
+  if (snapshot_ready) return;
+
+  bool wake = false;
+
+  for (int c=0; c<PORT_MAX_CHANNELS; c++) {
+    // wait until the worker has freed the last one
+    if (retired[c].load() != NULL) continue;
+
+    CaptureBuffer *b = c < channels ? fresh[c].exchange(NULL) : NULL;
+    if (!b && (c < channels || !voices[c].buf)) continue;
+
+    retired[c] = voices[c].swap(b);
+    if (b && b->length >= 0) params[BLEN_PARAM].setValue(b->length);
+
+    // a buffer read back from the sidecar is already saved
+    if (!b || !b->resume) dirty_gen.store(dirty_gen.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    wake = true;
   }
 
-  // change amp in sample buffer
-  sample[idx] = wrap(sample[idx] + (amp * env.get(g_idx)), -5.f, 5.f);
-  amp_out = sample[idx];
+  if (wake) worker.wake();
+}
 
-  idx = (idx + 1) % sample_length;
-  g_idx = fmod(g_idx + (1.f / (4.f * env_dur)), 1.f);
-  g_idx_next = fmod(g_idx_next + (1.f / (4.f * env_dur)), 1.f);
-  
-  phase += 1.f / (mDurs[index] * bpt_spc);
+// state ids of every GenEcho in the rack, so no two share a sidecar
+static std::mutex state_ids_mutex;
+static std::set<std::string> state_ids;
+
+/*
+ * Make up an id no other module has and no sidecar file is named
+ * after, and claim it
+ */
+std::string GenEcho::newStateId() {
+  while (true) {
+    std::string id = string::f("%08x%08x", random::u32(), random::u32());
+    if (!system::isFile(asset::user(pluginInstance->slug) + "/GenEcho-" + id + ".bin") && claimStateId(id)) return id;
+  }
+}
+
+/*
+ * Claim id for a module, false if another one already has it
+ */
+bool GenEcho::claimStateId(const std::string &id) {
+  std::lock_guard<std::mutex> lock(state_ids_mutex);
+  return state_ids.insert(id).second;
+}
+
+void GenEcho::releaseStateId(const std::string &id) {
+  std::lock_guard<std::mutex> lock(state_ids_mutex);
+  state_ids.erase(id);
+}
+
+/*
+ * Delete every GenEcho sidecar that no module in the rack uses, the
+ * buffers of removed modules and of patches not open. Returns how many
+ * were deleted
+ */
+int GenEcho::deleteUnusedSidecars() {
+  std::set<std::string> used;
+  {
+    std::lock_guard<std::mutex> lock(state_ids_mutex);
+    for (const std::string &id : state_ids) used.insert(sidecarPath("GenEcho-" + id + ".bin"));
+  }
+
+  int deleted = 0;
+  for (const std::string &file : system::getEntries(asset::user(pluginInstance->slug))) {
+    std::string name = string::filename(file);
+    if (name.compare(0, 8, "GenEcho-") != 0 || string::filenameExtension(name) != "bin") continue;
+    if (used.count(sidecarPath(name))) continue;
+    if (remove(file.c_str()) == 0) deleted++;
+  }
+  return deleted;
+}
+
+std::string GenEcho::sidecarName() {
+  std::lock_guard<std::mutex> lock(path_mutex);
+  return "GenEcho-" + state_id + ".bin";
+}
+
+/*
+ * Sidecar files live in a folder of the plugin's own under the user
+ * directory, the patch JSON only holds the name
+ */
+std::string GenEcho::sidecarPath(const std::string &name) {
+  return asset::user(pluginInstance->slug) + "/" + name;
+}
+
+/*
+ * Audio thread, note which buffer every voice has for the worker to
+ * write out
+ */
+void GenEcho::takeSnapshot() {
+  for (int c=0; c<PORT_MAX_CHANNELS; c++) snap_buf[c] = voices[c].buf;
+  snap_gen = dirty_gen.load(std::memory_order_relaxed);
+  snapshot_ready = true;
+}
+
+/*
+ * Worker thread, write the snapshot to this module's sidecar under the
+ * tag the patch was saved with, unless the buffers and the tag are
+ * unchanged since the last one
+ */
+void GenEcho::writeSnapshot() {
+  std::string name = sidecarName();
+  uint64_t tag = save_tag;
+
+  if (snap_gen != written_gen || tag != written_tag || name != written_name) {
+    system::createDirectory(asset::user(pluginInstance->slug));
+    if (writeSidecar(sidecarPath(name), tag)) {
+      written_name = name;
+      written_gen = snap_gen;
+      written_tag = tag;
+    }
+  }
+
+  snapshot_ready = false;
+}
+
+/*
+ * Write the capture of every voice in the snapshot to file, the sample
+ * as recorded or loaded. What playing has done to it since and the
+ * breakpoints are not saved, a restored voice decomposes the capture
+ * afresh. Inactive voices are saved with a size of 0. Worker thread only
+ */
+bool GenEcho::writeSidecar(const std::string &file, uint64_t tag) {
+  FILE *f = fopen(file.c_str(), "wb");
+  if (!f) {
+    WARN("Could not create %s", file.c_str());
+    return false;
+  }
 
-  // get that amp OUT
-  outputs[SINE_OUTPUT].setVoltage(amp_out);
+  StateWriter w;
+  w.header(GENECHO_BUFFER);
+  w.put<uint64_t>(tag);
+  w.put<uint32_t>(PORT_MAX_CHANNELS);
+  bool ok = fwrite(w.data.data(), 1, w.data.size(), f) == w.data.size();
+
+  for (int c=0; ok && c<PORT_MAX_CHANNELS; c++) {
+    CaptureBuffer *b = snap_buf[c];
+    uint32_t size = b ? b->size : 0;
+    ok = fwrite(&size, sizeof(uint32_t), 1, f) == 1;
+    if (b) ok = ok && fwrite(b->_sample.data(), sizeof(float), size, f) == size;
+  }
+
+  fclose(f);
+  if (!ok) WARN("Could not write %s", file.c_str());
+  return ok;
+}
+
+/*
+ * Read the buffers written by writeSidecar into bs, NULL for inactive
+ * voices. False if the file is missing, doesn't match or was written
+ * for another save than the one tagged tag, 0 for a patch from before
+ * tags. Sidecars before version 5 hold a single voice, before version 7
+ * they hold the played-over sample and the breakpoints as well. Worker
+ * thread only
+ */
+bool GenEcho::readSidecar(const std::string &file, uint64_t tag, CaptureBuffer **bs) {
+  FILE *f = fopen(file.c_str(), "rb");
+  if (!f) return false;
+
+  uint8_t head[20];
+  StateReader r(head, fread(head, 1, sizeof(head), f));
+  r.header(GENECHO_BUFFER);
+
+  uint64_t file_tag = r.version >= 7 ? r.get<uint64_t>() : 0;
+  unsigned int n = r.version >= 5 ? r.get<uint32_t>() : 1;
+  fseek(f, 8 + (r.version >= 7 ? 8 : 0) + (r.version >= 5 ? 4 : 0), SEEK_SET);
+
+  if (r.ok && tag != 0 && file_tag != tag) {
+    INFO("%s was saved with another copy of the patch, not resuming from it", file.c_str());
+    fclose(f);
+    return false;
+  }
+
+  bool ok = r.ok && n <= PORT_MAX_CHANNELS;
+
+  for (unsigned int c=0; ok && c<n; c++) {
+    uint32_t size_bpts[2] = {};
+    ok = fread(size_bpts, sizeof(uint32_t), r.version >= 7 ? 1 : 2, f) == (r.version >= 7 ? 1u : 2u);
+    unsigned int size = size_bpts[0];
+    unsigned int max_bpts = size_bpts[1];
+
+    // the size is bounded by the longest buffer at a generous engine rate
+    if (!ok || size > BUFFER_SECONDS[NUM_BUFFER_LENGTHS - 1] * 768000u ||
+        (r.version < 7 && size > 0 && max_bpts != size / MIN_BPT_SPACING + 2)) {
+      ok = false;
+      break;
+    }
+    if (size == 0) continue;
+
+    CaptureBuffer *b = bs[c] = new CaptureBuffer(size);
+
+    if (r.version >= 7) {
+      ok = fread(b->_sample.data(), sizeof(float), size, f) == size;
+      b->sample = b->_sample;
+      continue;
+    }
+
+    ok = fread(b->sample.data(), sizeof(float), size, f) == size;
+    ok = ok && fread(b->_sample.data(), sizeof(float), size, f) == size;
+
+    for (unsigned int i=0; ok && i<max_bpts; i++) {
+      float x[2];
+      ok = fread(x, sizeof(float), 2, f) == 2;
+      b->mAmps[i] = x[0];
+      b->mDurs[i] = x[1];
+    }
+  }
+
+  fclose(f);
+
+  if (!ok) {
+    WARN("%s is not a GenEcho buffer or is truncated", file.c_str());
+    for (int c=0; c<PORT_MAX_CHANNELS; c++) {
+      delete bs[c];
+      bs[c] = NULL;
+    }
+  }
+
+  return ok;
 }
 
+/*
+ * The walks go into the patch JSON, the buffers into a sidecar file. It
+ * is written in the background from a snapshot the audio thread takes,
+ * so saving never waits for the disk
+ */
+json_t *GenEcho::dataToJson() {
+  json_t *rootJ = json_object();
+
+  std::string p = samplePath();
+  if (!p.empty()) json_object_set_new(rootJ, "path", json_string(p.c_str()));
+
+  StateWriter w;
+  w.header(GENECHO_STATE);
+  w.put<int32_t>(seed);
+  w.put<uint32_t>(PORT_MAX_CHANNELS);
+  for (int c=0; c<PORT_MAX_CHANNELS; c++) voices[c].save(w);
+  json_object_set_new(rootJ, "state", w.toJson());
+
+  json_object_set_new(rootJ, "id", json_string(state_id.c_str()));
+  json_object_set_new(rootJ, "sidecar", json_string(sidecarName().c_str()));
+
+  // buffers changed since the sidecar was last written get a new tag,
+  // unchanged ones keep the tag of the sidecar they are in
+  uint64_t tag = written_tag;
+  if (tag == 0 || dirty_gen != written_gen) {
+    do tag = random::u64(); while (tag == 0);
+  }
+  save_tag = tag;
+  json_object_set_new(rootJ, "tag", json_string(string::f("%016llx", (unsigned long long) tag).c_str()));
+
+  snapshot_request = true;
+  return rootJ;
+}
+
+/*
+ * Restore the walks and read the sidecar back on the worker. Without a
+ * usable sidecar the audio file is loaded again, or capture starts over
+ */
+void GenEcho::dataFromJson(json_t *rootJ) {
+  json_t *pathJ = json_object_get(rootJ, "path");
+  json_t *sidecarJ = json_object_get(rootJ, "sidecar");
+  json_t *idJ = json_object_get(rootJ, "id");
+  json_t *tagJ = json_object_get(rootJ, "tag");
+  std::string p = pathJ ? json_string_value(pathJ) : "";
+  std::string name = sidecarJ ? json_string_value(sidecarJ) : "";
+  uint64_t tag = tagJ ? strtoull(json_string_value(tagJ), NULL, 16) : 0;
+
+  // the saved id is kept, so the same sidecar is written again. Older
+  // patches only name the sidecar. A duplicate reads the original's
+  // sidecar and keeps an id of its own
+  std::string id = idJ ? json_string_value(idJ) : "";
+  if (id.empty() && name.size() > 12 && name.compare(0, 8, "GenEcho-") == 0) id = name.substr(8, name.size() - 12);
+
+  if (!id.empty() && id != state_id && claimStateId(id)) {
+    releaseStateId(state_id);
+    std::lock_guard<std::mutex> lock(path_mutex);
+    state_id = id;
+  }
+
+  std::vector<uint8_t> data;
+  std::shared_ptr<std::vector<unsigned int>> saved_idx = std::make_shared<std::vector<unsigned int>>(2 * PORT_MAX_CHANNELS, 0);
+  bool resume = false;
+
+  if (stateFromJson(json_object_get(rootJ, "state"), data)) {
+    StateReader r(data.data(), data.size());
+    if (r.header(GENECHO_STATE)) {
+      int saved_seed = r.get<int32_t>();
+
+      // before version 5 there was a single voice
+      unsigned int n = r.version >= 5 ? r.get<uint32_t>() : 1;
+      if (n > PORT_MAX_CHANNELS) r.ok = false;
+
+      for (unsigned int c=0; r.ok && c<n; c++) {
+        voices[c].load(r, (*saved_idx)[2 * c], (*saved_idx)[2 * c + 1]);
+      }
+
+      // the seed param is already restored, matching it skips the reseed
+      resume = r.ok;
+      seed = resume ? saved_seed : -1;
+    }
+    if (!resume) WARN("GenEcho: could not restore saved state, reseeding");
+  }
+
+  worker.post([this, p, name, tag, resume, saved_idx]() {
+    CaptureBuffer *bs[PORT_MAX_CHANNELS] = {};
+
+    if (!resume || name.empty() || !readSidecar(sidecarPath(name), tag, bs)) {
+      if (!p.empty()) loadFile(p);
+      return;
+    }
+
+    // unchanged, the sidecar just read needn't be written again
+    if (name == sidecarName()) {
+      written_name = name;
+      written_gen = dirty_gen.load();
+      written_tag = tag;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(path_mutex);
+      path = p;
+    }
+
+    WavReader wav;
+    file_channels = (!p.empty() && wav.open(p)) ? wav.channels : 0;
+
+    int n = 1;
+    for (int c=0; c<PORT_MAX_CHANNELS; c++) {
+      CaptureBuffer *b = bs[c];
+      if (!b) continue;
+
+      b->resume = true;
+      b->resume_idx = (*saved_idx)[2 * c];
+      b->resume_index = (*saved_idx)[2 * c + 1];
+
+      n = c + 1;
+      built_size[c] = b->size;
+      built_rate = 0;
+      wanted_size = b->size;
+      delete fresh[c].exchange(b);
+    }
+
+    wanted_channels = n;
+  });
+}
+
+/*
+ * Restore the captured samples and restart every walk from the current
+ * seed, voice c from stream c
+ */
+void GenEcho::reseed() {
+  for (int c=0; c<PORT_MAX_CHANNELS; c++) {
+    EchoVoice &v = voices[c];
+    v.dropSpan();
+    v.rg.seed(streamSeed(seed, c));
+    v.phase = 1.f;
+    v.index = 0;
+    v.restoreSample();
+    v.clearBpts();
+    v.idx = 0;
+    v.amp = v.amp_next = 0.f;
+    v.g_idx = 0.f;
+    v.g_idx_next = 0.5f;
+  }
+}
+
+struct LoadSampleItem : MenuItem {
+  GenEcho *module;
+
+  void onAction(const event::Action &e) override {
+    std::string dir = asset::user("");
+    std::string p = module->samplePath();
+    if (!p.empty()) dir = string::directory(p);
+
+    osdialog_filters *filters = osdialog_filters_parse("WAV:wav");
+    char *file = osdialog_file(OSDIALOG_OPEN, dir.c_str(), NULL, filters);
+    osdialog_filters_free(filters);
+
+    if (!file) return;
+    module->loadSample(file);
+    free(file);
+  }
+};
+
+struct UnloadSampleItem : MenuItem {
+  GenEcho *module;
+
+  void onAction(const event::Action &e) override {
+    module->unloadSample();
+  }
+};
+
+struct DeleteSidecarsItem : MenuItem {
+  void onAction(const event::Action &e) override {
+    int n = GenEcho::deleteUnusedSidecars();
+    INFO("Deleted %d unused GenEcho buffer files", n);
+  }
+};
+
+struct BufferLengthItem : MenuItem {
+  GenEcho *module;
+  int len;
+
+  void onAction(const event::Action &e) override {
+    module->params[GenEcho::BLEN_PARAM].setValue(len);
+  }
+};
+
 struct GenEchoWidget : ModuleWidget {
 	GenEchoWidget(GenEcho *module) {
     setModule(module);
@@ -279,6 +1026,48 @@ struct GenEchoWidget : ModuleWidget {
 
     addOutput(createOutput<PJ301MPort>(Vec(50.50, 347.46), module, GenEcho::SINE_OUTPUT));
   }
+
+  void appendContextMenu(Menu *menu) override {
+    GenEcho *module = dynamic_cast<GenEcho*>(this->module);
+    if (!module) return;
+
+    appendDistMenu(menu, module);
+
+    std::string p = module->samplePath();
+
+    menu->addChild(new MenuSeparator);
+    menu->addChild(createMenuLabel(p.empty() ? "Sample: from input" : "Sample: " + string::filename(p)));
+
+    LoadSampleItem *loadItem = createMenuItem<LoadSampleItem>("Load sample...");
+    loadItem->module = module;
+    menu->addChild(loadItem);
+
+    if (!p.empty()) {
+      UnloadSampleItem *unloadItem = createMenuItem<UnloadSampleItem>("Unload sample");
+      unloadItem->module = module;
+      menu->addChild(unloadItem);
+    }
+
+    int len = (int) module->params[GenEcho::BLEN_PARAM].getValue();
+
+    menu->addChild(new MenuSeparator);
+    menu->addChild(createMenuLabel("Buffer length"));
+
+    for (int i=0; i<NUM_BUFFER_LENGTHS; i++) {
+      BufferLengthItem *item = createMenuItem<BufferLengthItem>(string::f("%d s", BUFFER_SECONDS[i]), CHECKMARK(len == i));
+      item->module = module;
+      item->len = i;
+      menu->addChild(item);
+    }
+
+    // sidecars outlive their modules, other patches may still use them
+    menu->addChild(new MenuSeparator);
+    menu->addChild(createMenuItem<DeleteSidecarsItem>("Delete saved buffers of modules not in this patch"));
+
+    appendSeedMenu(menu, module);
+    appendRecordMenu(menu, module, GenEcho::SINE_OUTPUT);
+    appendTimingMenu(menu, module);
+  }
 };
 
 Model *modelGenEcho = createModel<GenEcho, GenEchoWidget>("GenEcho");
@@ -7,9 +7,16 @@
  */
 
 #include "plugin.hpp"
-#include "dsp/resampler.hpp"
 
 #include "GrandyOscillator.hpp"
+#include "ControlRate.hpp"
+#include "Oversampler.hpp"
+#include "Blep.hpp"
+#include "SeedMenu.hpp"
+#include "DistMenu.hpp"
+#include "OversampleMenu.hpp"
+#include "RecordMenu.hpp"
+#include "TimingMenu.hpp"
 
 struct Grandy : Module {
 	enum ParamIds {
@@ -33,6 +40,10 @@ struct Grandy : Module {
     IMODCV_PARAM,
     PDST_PARAM,
     MIRR_PARAM,
+    SEED_PARAM,
+    OVSM_PARAM,
+    BLEP_PARAM,
+    XDST_PARAM,
     NUM_PARAMS
 	};
 	enum InputIds {
@@ -59,18 +70,42 @@ struct Grandy : Module {
 
   dsp::SchmittTrigger smpTrigger;
   
-  GendyOscillator go;
+  // up to 16 voices, four per SIMD oscillator bank
+  GendyOscillator4 gos[4];
+  TOversampler<simd::float_4> oversamplers[4];
+  int channels = 1;
+
+  // smooth every breakpoint with minBLEPs instead of, or on top of,
+  // oversampling
+  GendyBlep4 bleps[4];
+  bool band_limited = false;
 
   EnvType env = (EnvType) 1;
 
-  float freq_sig = 0.f;
-  float astp_sig = 0.f;
-  float dstp_sig = 0.f;
-  float grat_sig = 0.f;
-  float envs_sig = 0.f;
-  float bpts_sig = 0.f;
-  float fmod_sig = 0.f;
-  float imod_sig = 0.f;
+  // seed the oscillators were last seeded with, -1 forces a reseed
+  int seed = -1;
+
+  // params are read at control rate and ramped per sample
+  ControlRate control;
+  TParamRamp<simd::float_4> freq_ramp[4];
+  TParamRamp<simd::float_4> grat_ramp[4];
+  TParamRamp<simd::float_4> fmod_ramp[4];
+  ParamRamp fcar_ramp;
+  ParamRamp imod_ramp;
+
+  // the distribution from the panel switch or the menu
+  DistSelect dist;
+
+  Recorder recorder;
+  ProcessTimer timer;
+
+  simd::float_4 freq_sig = 0.f;
+  simd::float_4 astp_sig = 0.f;
+  simd::float_4 dstp_sig = 0.f;
+  simd::float_4 grat_sig = 0.f;
+  simd::float_4 bpts_sig = 0.f;
+  simd::float_4 fmod_sig = 0.f;
+  simd::float_4 imod_sig = 0.f;
 
   bool fm_is_on = false;
 
@@ -86,6 +121,7 @@ struct Grandy : Module {
     configParam(ASTP_PARAM, 0.f, 1.f, 0.f);
     configParam(ASTPCV_PARAM, 0.f, 1.f, 0.f);
     configParam(PDST_PARAM, 0.f, 2.f, 0.f);
+    configParam(XDST_PARAM, 0.f, NUM_DISTS - 1, 0.f, "Distribution");
     configParam(MIRR_PARAM, 0.f, 1.f, 0.f);
     configParam(GRAT_PARAM, -6.f, 3.f, 0.f);
     configParam(GRATCV_PARAM, 0.f, 1.f, 0.f);
@@ -96,71 +132,200 @@ struct Grandy : Module {
     configParam(IMOD_PARAM, -4.f, 4.f, 0.f);
     configParam(IMODCV_PARAM, 0.f, 1.f, 0.f);
     configParam(FMTR_PARAM, 0.0f, 1.0f, 0.0f);
+    configParam(SEED_PARAM, 0.f, MAX_SEED, 0.f, "Random seed");
+    configParam(OVSM_PARAM, 0.f, NUM_OVERSAMPLE_RATES - 1, 0.f, "Oversampling");
+    configParam(BLEP_PARAM, 0.f, 1.f, 0.f, "Band-limited breakpoints");
   }
 
   void process(const ProcessArgs &args) override;
+  void processControls();
+  void reseed();
   float wrap(float,float,float);
+
+  json_t *dataToJson() override;
+  void dataFromJson(json_t *rootJ) override;
 };
 
 void Grandy::process(const ProcessArgs &args) {
   float deltaTime = args.sampleTime;
 
+  timer.begin();
+
+  if (control.process()) {
+    timer.mark(TIMING_CONTROL);
+    processControls();
+  }
+
+  for (int c=0; c<channels; c+=4) {
+    GendyOscillator4 &go = gos[c / 4];
+
+    go.freq = freq_ramp[c / 4].process();
+    go.g_rate = grat_ramp[c / 4].process();
+    go.f_mod = fmod_ramp[c / 4].process();
+    go.f_car = fcar_ramp.value;
+    go.i_mod = imod_ramp.value;
+
+    // params hold still across the sub samples of one engine sample
+    int stepped = 0;
+    GendyBlep4 &blep = bleps[c / 4];
+    simd::float_4 out = oversamplers[c / 4].process(deltaTime, [&](float subSampleTime) {
+      go.process(subSampleTime);
+      stepped |= go.step_flag;
+      return band_limited ? blep.process(go) : go.out();
+    });
+    if (stepped) timer.mark(TIMING_BREAKPOINT);
+
+    outputs[SINE_OUTPUT].setVoltageSimd(5.0f * out, c);
+  }
+
+  fcar_ramp.process();
+  imod_ramp.process();
+
+  outputs[SINE_OUTPUT].setChannels(channels);
+
+  if (recorder.active) recorder.push(outputs[SINE_OUTPUT].voltages);
+
+  timer.end();
+}
+
+/*
+ * Read every param and CV input, called once per CONTROL_RATE_DIVISION
+ * samples. Switches and step sizes are applied directly, pitch-like
+ * values become the targets of the per-sample ramps
+ */
+void Grandy::processControls() {
+  using simd::float_4;
+
+  // the number of voices follows the widest polyphonic input
+  channels = 1;
+  for (int i=0; i<NUM_INPUTS; i++) {
+    channels = std::max(channels, inputs[i].getChannels());
+  }
+
+  int new_seed = (int) params[SEED_PARAM].getValue();
+  if (new_seed != seed) {
+    timer.mark(TIMING_RESET);
+    seed = new_seed;
+    reseed();
+  }
+
+  int oversample = 1 << clamp((int) params[OVSM_PARAM].getValue(), 0, NUM_OVERSAMPLE_RATES - 1);
+  for (int i=0; i<4; i++) oversamplers[i].setFactor(oversample);
+
+  bool new_band_limited = params[BLEP_PARAM].getValue() > 0.5f;
+  if (new_band_limited != band_limited) {
+    band_limited = new_band_limited;
+    for (int i=0; i<4; i++) bleps[i].reset(gos[i]);
+  }
+
   // snap knob for selecting envelope for the grain
   int env_num = (int) clamp(roundf(params[ENVS_PARAM].getValue()), 1.0f, 4.0f);
 
   if (env != (EnvType) env_num) {
     DEBUG("Switching to env type: %d", env_num);
     env = (EnvType) env_num;
-    go.env.switchEnvType(env);
+    for (int i=0; i<4; i++) gos[i].setEnvType(env);
+    timer.mark(TIMING_ENV);
   }
 
-  // handle mirror / fold switch
-  go.is_mirroring = (int) params[MIRR_PARAM].getValue();
- 
-  // accept modulation of signal inputs for each parameter
-  freq_sig = (inputs[FREQ_INPUT].getVoltage() / 5.f) * params[FREQCV_PARAM].getValue();
-  
-  bpts_sig = 5.f * dsp::quadraticBipolar((inputs[BPTS_INPUT].getVoltage() / 5.f) * params[BPTSCV_PARAM].getValue());
-  astp_sig = dsp::quadraticBipolar((inputs[ASTP_INPUT].getVoltage() / 5.f) * params[ASTPCV_PARAM].getValue());
-  dstp_sig = dsp::quadraticBipolar((inputs[DSTP_INPUT].getVoltage() / 5.f) * params[DSTPCV_PARAM].getValue());
-  grat_sig = (inputs[GRAT_INPUT].getVoltage() / 5.f) * params[GRATCV_PARAM].getValue();
+  // switches and knobs shared by all voices
+  bool is_mirroring = (int) params[MIRR_PARAM].getValue();
+  DistType dt = dist.process(params[PDST_PARAM], params[XDST_PARAM]);
+  bool is_fm_on = !(params[FMTR_PARAM].getValue() > 0.0f);
+
+  int bpts_param = (int) params[BPTS_PARAM].getValue();
+  fcar_ramp.setTarget(clamp(261.626f * dspmath::exp2(params[FCAR_PARAM].getValue()), 1.f, 5000.f));
+  imod_ramp.setTarget(rescale(params[IMOD_PARAM].getValue(), 0.f, 1.f, 10.f, 3000.f));
+
+  for (int c=0; c<channels; c+=4) {
+    GendyOscillator4 &go = gos[c / 4];
+
  
-  // fm control sigs
-  fmod_sig = (inputs[FMOD_INPUT].getVoltage() / 5.f) * params[FMODCV_PARAM].getValue();
-  imod_sig = dsp::quadraticBipolar((inputs[IMOD_INPUT].getVoltage() / 5.f) * params[IMODCV_PARAM].getValue());
+    // accept modulation of signal inputs for each parameter
+    freq_sig = (inputs[FREQ_INPUT].getPolyVoltageSimd<float_4>(c) / 5.f) * params[FREQCV_PARAM].getValue();
+    
+    bpts_sig = 5.f * dsp::quadraticBipolar((inputs[BPTS_INPUT].getPolyVoltageSimd<float_4>(c) / 5.f) * params[BPTSCV_PARAM].getValue());
+    astp_sig = dsp::quadraticBipolar((inputs[ASTP_INPUT].getPolyVoltageSimd<float_4>(c) / 5.f) * params[ASTPCV_PARAM].getValue());
+    dstp_sig = dsp::quadraticBipolar((inputs[DSTP_INPUT].getPolyVoltageSimd<float_4>(c) / 5.f) * params[DSTPCV_PARAM].getValue());
+    grat_sig = (inputs[GRAT_INPUT].getPolyVoltageSimd<float_4>(c) / 5.f) * params[GRATCV_PARAM].getValue();
+   
+    // fm control sigs
+    fmod_sig = (inputs[FMOD_INPUT].getPolyVoltageSimd<float_4>(c) / 5.f) * params[FMODCV_PARAM].getValue();
+    imod_sig = dsp::quadraticBipolar((inputs[IMOD_INPUT].getPolyVoltageSimd<float_4>(c) / 5.f) * params[IMODCV_PARAM].getValue());
 
-  int new_nbpts = clamp((int) params[BPTS_PARAM].getValue() + (int) bpts_sig, 2, MAX_BPTS);
-  if (new_nbpts != go.num_bpts) go.num_bpts = new_nbpts;
+    float_4 max_amp_step = simd::rescale(params[ASTP_PARAM].getValue() + (astp_sig / 4.f), 0.0, 1.0, 0.05, 0.3);
+    float_4 max_dur_step = simd::rescale(params[DSTP_PARAM].getValue() + (dstp_sig / 4.f), 0.0, 1.0, 0.01, 0.3);
 
-  // better frequency control
-  freq_sig += params[FREQ_PARAM].getValue();
-  grat_sig += params[GRAT_PARAM].getValue();
+    for (int i=0; i<4; i++) {
+      go.num_bpts[i] = clamp(bpts_param + (int) bpts_sig[i], 2, MAX_BPTS);
+      go.max_amp_step[i] = max_amp_step[i];
+      go.max_dur_step[i] = max_dur_step[i];
+    }
 
-  go.freq = clamp(261.626f * powf(2.0f, freq_sig), 1.f, 3000.f);
+    // better frequency control
+    freq_sig += params[FREQ_PARAM].getValue();
+    grat_sig += params[GRAT_PARAM].getValue();
 
-  go.max_amp_step = rescale(params[ASTP_PARAM].getValue() + (astp_sig / 4.f), 0.0, 1.0, 0.05, 0.3);
-  go.max_dur_step = rescale(params[DSTP_PARAM].getValue() + (dstp_sig / 4.f), 0.0, 1.0, 0.01, 0.3);
-  go.freq_mul = rescale(params[FREQ_PARAM].getValue(), -1.0, 1.0, 0.05, 4.0);
-  go.g_rate = clamp(261.626f * powf(2.0f, grat_sig), 1e-6, 3000.f);
+    freq_ramp[c / 4].setTarget(simd::clamp(261.626f * dspmath::exp2(freq_sig), 1.f, 3000.f));
+    grat_ramp[c / 4].setTarget(simd::clamp(261.626f * dspmath::exp2(grat_sig), 1e-6, 3000.f));
 
-  go.dt = (DistType) params[PDST_PARAM].getValue();
+    // mirror / fold switch, distribution and fm toggle
+    go.setMode(is_mirroring, is_fm_on, dt);
+   
+    fmod_sig += params[FMOD_PARAM].getValue();
+    imod_sig += params[IMOD_PARAM].getValue();
 
-  // set fm params
-  go.is_fm_on = !(params[FMTR_PARAM].getValue() > 0.0f);
- 
-  fmod_sig += params[FMOD_PARAM].getValue();
-  imod_sig += params[IMOD_PARAM].getValue();
+    fmod_ramp[c / 4].setTarget(simd::clamp(261.626f * dspmath::exp2(fmod_sig), 1.f, 5000.f));
+  }
+}
 
-  go.f_car = clamp(261.626f * powf(2.0f, params[FCAR_PARAM].getValue()), 1.f, 5000.f);
-  go.f_mod = clamp(261.626f * powf(2.0f, fmod_sig), 1.f, 5000.f);
-  
-  go.i_mod = rescale(params[IMOD_PARAM].getValue(), 0.f, 1.f, 10.f, 3000.f);
 
-  go.process(deltaTime);
+/*
+ * Restart every voice's walk from the current seed, voice c gets stream c
+ */
+void Grandy::reseed() {
+  for (int b=0; b<4; b++) {
+    gos[b].reset();
+    for (int i=0; i<4; i++) gos[b].seed(i, streamSeed(seed, b * 4 + i));
+    bleps[b].reset(gos[b]);
+  }
+}
 
-  outputs[SINE_OUTPUT].setVoltage(5.0f * go.out());
+/*
+ * Save every breakpoint walk so a reloaded patch continues where it left
+ * off instead of starting over from the seed
+ */
+json_t *Grandy::dataToJson() {
+  StateWriter w;
+  w.header(GRANDY_STATE);
+  w.put<int32_t>(seed);
+  for (int b=0; b<4; b++) gos[b].save(w);
+
+  json_t *rootJ = json_object();
+  json_object_set_new(rootJ, "state", w.toJson());
+  return rootJ;
 }
 
+void Grandy::dataFromJson(json_t *rootJ) {
+  std::vector<uint8_t> data;
+  if (!stateFromJson(json_object_get(rootJ, "state"), data)) return;
+
+  StateReader r(data.data(), data.size());
+  if (r.header(GRANDY_STATE)) {
+    int saved_seed = r.get<int32_t>();
+    for (int b=0; b<4; b++) gos[b].load(r);
+    for (int b=0; b<4; b++) bleps[b].reset(gos[b]);
+
+    // the seed param is already restored, matching it skips the reseed
+    if (r.ok) {
+      seed = saved_seed;
+      return;
+    }
+  }
+
+  WARN("Grandy: could not restore saved state, reseeding");
+  seed = -1;
+}
 
 struct GrandyWidget : ModuleWidget {
 	GrandyWidget(Grandy *module) {
@@ -222,6 +387,17 @@ struct GrandyWidget : ModuleWidget {
     // output signal 
     addOutput(createOutput<PJ301MPort>(Vec(124.003, 348.50), module, Grandy::SINE_OUTPUT));
 	}
+
+  void appendContextMenu(Menu *menu) override {
+    Grandy *module = dynamic_cast<Grandy*>(this->module);
+    if (!module) return;
+
+    appendDistMenu(menu, module);
+    appendOversampleMenu(menu, module);
+    appendSeedMenu(menu, module);
+    appendRecordMenu(menu, module, Grandy::SINE_OUTPUT);
+    appendTimingMenu(menu, module);
+  }
 };
 
 Model *modelGrandy = createModel<Grandy, GrandyWidget>("Grandy");
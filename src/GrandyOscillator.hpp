@@ -13,29 +13,55 @@
 #include "dsp/digital.hpp"
 
 #include "wavetable.hpp"
+#include "State.hpp"
+#include "fastmath.hpp"
 
 #define MAX_BPTS 50
 
+/*
+ * One row of a process dispatch table: every distribution for a given
+ * mirror / fm combination
+ */
+#define GENDY_MODE_ROW(OSC, M, F) { \
+  &OSC::processMode<M, F, LINEAR>, \
+  &OSC::processMode<M, F, CAUCHY>, \
+  &OSC::processMode<M, F, ARCSINE>, \
+  &OSC::processMode<M, F, LOGISTIC>, \
+  &OSC::processMode<M, F, HYPCOS>, \
+  &OSC::processMode<M, F, EXPON>, \
+  &OSC::processMode<M, F, SINUS> }
+
 namespace rack {
+
+  /*
+   * Keep a walked value inside lb..ub, picked at compile time
+   */
+  template <bool MIRROR>
+  inline float bound(float in, float lb, float ub) {
+    return MIRROR ? mirror(in, lb, ub) : wrap(in, lb, ub);
+  }
   struct GendyOscillator {
     float phase = 1.f;
     
     bool GRAN_ON = true;
+
+    // modes, only change these through setMode()
     bool is_fm_on = true; 
     bool is_mirroring = false;
+    DistType dt = LINEAR;
 
     int num_bpts = 12;
     int min_freq = 30; 
     int max_freq = 1000;
 
-    float amps[MAX_BPTS] = {0.f};
-    float durs[MAX_BPTS] = {1.f};
-    float offs[MAX_BPTS] = {0.f};
-    float rats[MAX_BPTS] = {1.f};
+    float amps[MAX_BPTS];
+    float durs[MAX_BPTS];
+    float offs[MAX_BPTS];
+    float rats[MAX_BPTS];
 
     int index = 0;
     float amp = 0.0; 
-    float amp_next = amps[0];
+    float amp_next = 0.f;
     
     float max_amp_step = 0.05f;
     float max_dur_step = 0.05f;
@@ -61,10 +87,10 @@ namespace rack {
     float rat = 1.f;
     float rat_next = 1.f;
 
-    Wavetable sample = Wavetable(SIN);
-    Wavetable env = Wavetable(TRI); 
+    // shared tables, see initWavetables()
+    const Wavetable *sample = &sample_table;
+    const EnvTable *env = &env_tables[TRI];
 
-    DistType dt = LINEAR;
     gRandGen rg;
     
     float amp_out = 0.f;
@@ -94,7 +120,144 @@ namespace rack {
 
     float freq = 261.626f;
 
+    GendyOscillator() {
+      reset();
+    }
+
+    /*
+     * Put the walk back to its starting point, every breakpoint at its
+     * neutral value
+     */
+    void reset() {
+      for (int i=0; i<MAX_BPTS; i++) {
+        amps[i] = 0.f;
+        durs[i] = 1.f;
+        offs[i] = 0.f;
+        rats[i] = 1.f;
+      }
+
+      phase = 1.f;
+      index = 0;
+      amp = amp_next = 0.f;
+      rat = rat_next = 1.f;
+      off = off_next = 0.f;
+      g_idx = 0.f;
+      g_idx_next = 0.5f;
+      g_amp = g_amp_next = 0.f;
+      speed = 0.f;
+      amp_out = 0.f;
+
+      phase_mod1 = phase_mod2 = 0.f;
+      phase_car1 = phase_car2 = 0.f;
+      f_car1 = f_car2 = f_car;
+
+      last_flag = false;
+      count = 0;
+    }
+
+    void seed(uint64_t x) {
+      rg.seed(x);
+    }
+
+    void setEnvType(EnvType e) {
+      env = &env_tables[e];
+    }
+
+    /*
+     * Write everything needed to continue the walk exactly where it
+     * stopped. Params that are reapplied at control rate aren't saved
+     */
+    void save(StateWriter &w) {
+      w.put<int32_t>(MAX_BPTS);
+      w.putArray(amps, MAX_BPTS);
+      w.putArray(durs, MAX_BPTS);
+      w.putArray(offs, MAX_BPTS);
+      w.putArray(rats, MAX_BPTS);
+      w.put<int32_t>(index);
+
+      w.put(phase);
+      w.put(speed);
+      w.put(amp);
+      w.put(amp_next);
+      w.put(off);
+      w.put(off_next);
+      w.put(rat);
+      w.put(rat_next);
+      w.put(g_idx);
+      w.put(g_idx_next);
+      w.put(g_amp);
+      w.put(g_amp_next);
+      w.put(amp_out);
+      w.put(phase_mod1);
+      w.put(phase_mod2);
+      w.put(phase_car1);
+      w.put(phase_car2);
+      w.put(f_car1);
+      w.put(f_car2);
+
+      w.putArray(rg.gen.s, 4);
+    }
+
+    void load(StateReader &r) {
+      size_t n = std::max(0, r.get<int32_t>());
+      r.getArray(amps, n, MAX_BPTS);
+      r.getArray(durs, n, MAX_BPTS);
+      r.getArray(offs, n, MAX_BPTS);
+      r.getArray(rats, n, MAX_BPTS);
+      index = clamp(r.get<int32_t>(), 0, MAX_BPTS - 1);
+
+      r.get(phase);
+      r.get(speed);
+      r.get(amp);
+      r.get(amp_next);
+      r.get(off);
+      r.get(off_next);
+      r.get(rat);
+      r.get(rat_next);
+      r.get(g_idx);
+      r.get(g_idx_next);
+      r.get(g_amp);
+      r.get(g_amp_next);
+      r.get(amp_out);
+      r.get(phase_mod1);
+      r.get(phase_mod2);
+      r.get(phase_car1);
+      r.get(phase_car2);
+      r.get(f_car1);
+      r.get(f_car2);
+
+      r.getArray(rg.gen.s, 4);
+    }
+
+    typedef void (GendyOscillator::*ProcessFn)(float);
+
+    // specialization of processMode for the current modes
+    ProcessFn process_fn = &GendyOscillator::processMode<false, true, LINEAR>;
+
+    /*
+     * Switch modes, looking up the matching process specialization. Cheap
+     * to call every control tick, nothing happens unless a mode changed
+     */
+    void setMode(bool mirroring, bool fm_on, DistType t) {
+      if (mirroring == is_mirroring && fm_on == is_fm_on && t == dt) return;
+
+      is_mirroring = mirroring;
+      is_fm_on = fm_on;
+      dt = t;
+
+      static const ProcessFn modes[2][2][NUM_DISTS] = {
+        {GENDY_MODE_ROW(GendyOscillator, false, false), GENDY_MODE_ROW(GendyOscillator, false, true)},
+        {GENDY_MODE_ROW(GendyOscillator, true, false), GENDY_MODE_ROW(GendyOscillator, true, true)}
+      };
+      process_fn = modes[mirroring][fm_on][t];
+    }
+
     void process(float deltaTime) {
+      (this->*process_fn)(deltaTime);
+    }
+
+    template <bool MIRROR, bool FM, DistType DT>
+    void processMode(float deltaTime) {
       last_flag = false;
       if (phase >= 1.0) {
         
@@ -108,18 +271,10 @@ namespace rack {
         last_flag = index == num_bpts - 1;
 
         /* adjust vals */
-        if (is_mirroring) {
-          amps[index] = mirror(amps[index] + (max_amp_step * rg.my_rand(dt, random::normal())), -1.0f, 1.0f); 
-          durs[index] = mirror(durs[index] + (max_dur_step * rg.my_rand(dt, random::normal())), 0.5f, 1.5f);
-          offs[index] = mirror(offs[index] + (max_off_step * rg.my_rand(dt, random::normal())), 0.f, 1.0f);
-          rats[index] = mirror(rats[index] + (max_off_step * rg.my_rand(dt, random::normal())), 0.7f, 1.3f);
-        }
-        else {
-          amps[index] = wrap(amps[index] + (max_amp_step * rg.my_rand(dt, random::normal())), -1.0f, 1.0f); 
-          durs[index] = wrap(durs[index] + (max_dur_step * rg.my_rand(dt, random::normal())), 0.5f, 1.5f);
-          offs[index] = wrap(offs[index] + (max_off_step * rg.my_rand(dt, random::normal())), 0.f, 1.0f);
-          rats[index] = wrap(rats[index] + (max_off_step * rg.my_rand(dt, random::normal())), 0.7f, 1.3f);
-        }
+        amps[index] = bound<MIRROR>(amps[index] + (max_amp_step * rg.next<DT>()), -1.0f, 1.0f); 
+        durs[index] = bound<MIRROR>(durs[index] + (max_dur_step * rg.next<DT>()), 0.5f, 1.5f);
+        offs[index] = bound<MIRROR>(offs[index] + (max_off_step * rg.next<DT>()), 0.f, 1.0f);
+        rats[index] = bound<MIRROR>(rats[index] + (max_off_step * rg.next<DT>()), 0.7f, 1.3f);
         
         amp_next = amps[index];
         rate = durs[index];
@@ -138,26 +293,26 @@ namespace rack {
         //speed *= freq_mul;
       }
      
-      if (!is_fm_on) {
+      if (!FM) {
        
-        g_amp = amp + (env.get(g_idx) * sample.get(off));
-        g_amp_next = amp_next + (env.get(g_idx_next) * sample.get(off_next));
+        g_amp = amp + (env->get(g_idx) * sample->get(off));
+        g_amp_next = amp_next + (env->get(g_idx_next) * sample->get(off_next));
         
         // linear interpolation
         amp_out = ((1.0 - phase) * g_amp) + (phase * g_amp_next); 
       } else {
         //amp_out = ((1.0 - phase) * amp) + (phase * amp_next); 
-        g_amp = amp + (env.get(g_idx) * sinf(phase_car1));
-        g_amp_next = amp_next + (env.get(g_idx_next) * sinf(phase_car2));
+        g_amp = amp + (env->get(g_idx) * dspmath::sin(phase_car1));
+        g_amp_next = amp_next + (env->get(g_idx_next) * dspmath::sin(phase_car2));
         amp_out = ((1.0 - phase) * g_amp) + (phase * g_amp_next); 
       }
 
       // advance the grain envelope indices
-      g_idx = fmod(g_idx + (g_rate * deltaTime), 1.f);
-      g_idx_next = fmod(g_idx_next + (g_rate * deltaTime), 1.f);
+      g_idx = dspmath::fmod1(g_idx + (g_rate * deltaTime));
+      g_idx_next = dspmath::fmod1(g_idx_next + (g_rate * deltaTime));
 
-      off = fmod(off + (g_rate * deltaTime), 1.f);
-      off_next = fmod(off_next + (g_rate * deltaTime), 1.f);
+      off = dspmath::fmod1(off + (g_rate * deltaTime));
+      off_next = dspmath::fmod1(off_next + (g_rate * deltaTime));
       
       phase += speed;
 
@@ -165,17 +320,17 @@ namespace rack {
       phase_car1 += deltaTime * f_car1 * rat;
       phase_car2 += deltaTime * f_car2 * rat_next;
 
-      phase_car1 = fmod(phase_car1, 1.f);
-      phase_car2 = fmod(phase_car2, 1.f);
+      phase_car1 = dspmath::fmod1(phase_car1);
+      phase_car2 = dspmath::fmod1(phase_car2);
 
       phase_mod1 += deltaTime * f_mod;
       phase_mod2 += deltaTime * f_mod;
 
-      phase_mod1 = fmod(phase_mod1, 1.f);
-      phase_mod2 = fmod(phase_mod2, 1.f);
+      phase_mod1 = dspmath::fmod1(phase_mod1);
+      phase_mod2 = dspmath::fmod1(phase_mod2);
 
-      f_car1 = fmod(f_car + (i_mod * sample.get(phase_mod1)), 22050.f);
-      f_car2 = fmod(f_car + (i_mod * sample.get(phase_mod2)), 22050.f);
+      f_car1 = dspmath::fmod(f_car + (i_mod * sample->get(phase_mod1)), 22050.f);
+      f_car2 = dspmath::fmod(f_car + (i_mod * sample->get(phase_mod2)), 22050.f);
     
       count++;
     }
@@ -205,6 +360,305 @@ namespace rack {
     }
   };
 
+  /*
+   * Four GendyOscillator voices packed into the lanes of a float_4.
+   * The per-sample work (grain envelope lookups, interpolation, fm phase
+   * advance) runs vectorized across the lanes. The random walk of the
+   * breakpoints only happens when a lane's phase wraps, so it is done
+   * per lane in scalar code.
+   */
+  struct GendyOscillator4 {
+    simd::float_4 phase = 1.f;
+
+    // modes, only change these through setMode()
+    bool is_fm_on = true; 
+    bool is_mirroring = false;
+    DistType dt = LINEAR;
+
+    int num_bpts[4] = {12, 12, 12, 12};
+
+    // breakpoint values are stored lane-interleaved: amps[bpt][lane]
+    float amps[MAX_BPTS][4];
+    float durs[MAX_BPTS][4];
+    float offs[MAX_BPTS][4];
+    float rats[MAX_BPTS][4];
+
+    int index[4] = {0, 0, 0, 0};
+
+    simd::float_4 amp = 0.f; 
+    simd::float_4 amp_next = 0.f;
+    
+    float max_amp_step[4] = {0.05f, 0.05f, 0.05f, 0.05f};
+    float max_dur_step[4] = {0.05f, 0.05f, 0.05f, 0.05f};
+    float max_off_step = 0.005f;
+
+    simd::float_4 speed = 0.f;
+    simd::float_4 rate = 0.f;
+
+    simd::float_4 off = 0.f;
+    simd::float_4 off_next = 0.f;
+
+    simd::float_4 g_idx = 0.f;
+    simd::float_4 g_idx_next = 0.5f;
+
+    simd::float_4 g_amp = 0.f;
+    simd::float_4 g_amp_next = 0.f;
+    simd::float_4 g_rate = 1.f;
+
+    simd::float_4 rat = 1.f;
+    simd::float_4 rat_next = 1.f;
+
+    // shared tables, see initWavetables()
+    const Wavetable *sample = &sample_table;
+    const EnvTable *env = &env_tables[TRI];
+
+    // one generator per lane so every voice has its own reproducible walk
+    gRandGen rg[4];
+    
+    simd::float_4 amp_out = 0.f;
+
+    simd::float_4 f_mod = 400.f;
+    simd::float_4 f_car = 800.f;
+    simd::float_4 f_car1 = 800.f;
+    simd::float_4 f_car2 = 800.f;
+    simd::float_4 i_mod = 100.f;
+
+    simd::float_4 phase_mod1 = 0.f;
+    simd::float_4 phase_mod2 = 0.f;
+    simd::float_4 phase_car1 = 0.f;
+    simd::float_4 phase_car2 = 0.f;
+
+    // bit i is only set when lane i just reached its last break point
+    int last_flag = 0;
+    // bit i is only set when lane i just stepped a break point
+    int step_flag = 0;
+
+    simd::float_4 freq = 261.626f;
+
+    GendyOscillator4() {
+      reset();
+    }
+
+    /*
+     * Put the walks of all lanes back to their starting point
+     */
+    void reset() {
+      for (int k=0; k<MAX_BPTS; k++) {
+        for (int i=0; i<4; i++) {
+          amps[k][i] = 0.f;
+          durs[k][i] = 1.f;
+          offs[k][i] = 0.f;
+          rats[k][i] = 1.f;
+        }
+      }
+
+      for (int i=0; i<4; i++) index[i] = 0;
+
+      phase = 1.f;
+      amp = amp_next = 0.f;
+      rat = rat_next = 1.f;
+      off = off_next = 0.f;
+      g_idx = 0.f;
+      g_idx_next = 0.5f;
+      g_amp = g_amp_next = 0.f;
+      speed = 0.f;
+      amp_out = 0.f;
+
+      phase_mod1 = phase_mod2 = 0.f;
+      phase_car1 = phase_car2 = 0.f;
+      f_car1 = f_car2 = f_car;
+
+      last_flag = 0;
+      step_flag = 0;
+    }
+
+    /*
+     * Seed the generator of a single lane
+     */
+    void seed(int lane, uint64_t x) {
+      rg[lane].seed(x);
+    }
+
+    void setEnvType(EnvType e) {
+      env = &env_tables[e];
+    }
+
+    /*
+     * Same as GendyOscillator::save, for all four lanes
+     */
+    void save(StateWriter &w) {
+      w.put<int32_t>(MAX_BPTS);
+      w.putArray(&amps[0][0], MAX_BPTS * 4);
+      w.putArray(&durs[0][0], MAX_BPTS * 4);
+      w.putArray(&offs[0][0], MAX_BPTS * 4);
+      w.putArray(&rats[0][0], MAX_BPTS * 4);
+      w.putArray(index, 4);
+
+      w.put(phase);
+      w.put(speed);
+      w.put(amp);
+      w.put(amp_next);
+      w.put(off);
+      w.put(off_next);
+      w.put(rat);
+      w.put(rat_next);
+      w.put(g_idx);
+      w.put(g_idx_next);
+      w.put(g_amp);
+      w.put(g_amp_next);
+      w.put(amp_out);
+      w.put(phase_mod1);
+      w.put(phase_mod2);
+      w.put(phase_car1);
+      w.put(phase_car2);
+      w.put(f_car1);
+      w.put(f_car2);
+
+      for (int i=0; i<4; i++) w.putArray(rg[i].gen.s, 4);
+    }
+
+    void load(StateReader &r) {
+      size_t n = std::max(0, r.get<int32_t>());
+      r.getArray(&amps[0][0], n * 4, MAX_BPTS * 4);
+      r.getArray(&durs[0][0], n * 4, MAX_BPTS * 4);
+      r.getArray(&offs[0][0], n * 4, MAX_BPTS * 4);
+      r.getArray(&rats[0][0], n * 4, MAX_BPTS * 4);
+      r.getArray(index, 4);
+      for (int i=0; i<4; i++) index[i] = clamp(index[i], 0, MAX_BPTS - 1);
+
+      r.get(phase);
+      r.get(speed);
+      r.get(amp);
+      r.get(amp_next);
+      r.get(off);
+      r.get(off_next);
+      r.get(rat);
+      r.get(rat_next);
+      r.get(g_idx);
+      r.get(g_idx_next);
+      r.get(g_amp);
+      r.get(g_amp_next);
+      r.get(amp_out);
+      r.get(phase_mod1);
+      r.get(phase_mod2);
+      r.get(phase_car1);
+      r.get(phase_car2);
+      r.get(f_car1);
+      r.get(f_car2);
+
+      for (int i=0; i<4; i++) r.getArray(rg[i].gen.s, 4);
+    }
+
+    typedef void (GendyOscillator4::*ProcessFn)(float);
+
+    // specialization of processMode for the current modes
+    ProcessFn process_fn = &GendyOscillator4::processMode<false, true, LINEAR>;
+
+    /*
+     * Switch modes, looking up the matching process specialization
+     */
+    void setMode(bool mirroring, bool fm_on, DistType t) {
+      if (mirroring == is_mirroring && fm_on == is_fm_on && t == dt) return;
+
+      is_mirroring = mirroring;
+      is_fm_on = fm_on;
+      dt = t;
+
+      static const ProcessFn modes[2][2][NUM_DISTS] = {
+        {GENDY_MODE_ROW(GendyOscillator4, false, false), GENDY_MODE_ROW(GendyOscillator4, false, true)},
+        {GENDY_MODE_ROW(GendyOscillator4, true, false), GENDY_MODE_ROW(GendyOscillator4, true, true)}
+      };
+      process_fn = modes[mirroring][fm_on][t];
+    }
+
+    void process(float deltaTime) {
+      (this->*process_fn)(deltaTime);
+    }
+
+    template <bool MIRROR, bool FM, DistType DT>
+    void processMode(float deltaTime) {
+      last_flag = 0;
+
+      simd::float_4 wrapped = phase >= 1.f;
+      int wrapped_lanes = simd::movemask(wrapped);
+      step_flag = wrapped_lanes;
+      if (wrapped_lanes) {
+        phase -= simd::ifelse(wrapped, 1.f, 0.f);
+        for (int i=0; i<4; i++) {
+          if (wrapped_lanes & (1 << i)) step<MIRROR, DT>(i, deltaTime);
+        }
+      }
+
+      if (!FM) {
+        g_amp = amp + (env->get(g_idx) * sample->get(off));
+        g_amp_next = amp_next + (env->get(g_idx_next) * sample->get(off_next));
+      } else {
+        g_amp = amp + (env->get(g_idx) * dspmath::sin(phase_car1));
+        g_amp_next = amp_next + (env->get(g_idx_next) * dspmath::sin(phase_car2));
+      }
+      
+      // linear interpolation
+      amp_out = ((1.f - phase) * g_amp) + (phase * g_amp_next); 
+
+      // advance the grain envelope indices
+      simd::float_4 g_step = g_rate * deltaTime;
+      g_idx = dspmath::fmod1(g_idx + g_step);
+      g_idx_next = dspmath::fmod1(g_idx_next + g_step);
+
+      off = dspmath::fmod1(off + g_step);
+      off_next = dspmath::fmod1(off_next + g_step);
+      
+      phase += speed;
+
+      // step phases and frequencies for fm in grans
+      phase_car1 = dspmath::fmod1(phase_car1 + (deltaTime * f_car1 * rat));
+      phase_car2 = dspmath::fmod1(phase_car2 + (deltaTime * f_car2 * rat_next));
+
+      phase_mod1 = dspmath::fmod1(phase_mod1 + (deltaTime * f_mod));
+      phase_mod2 = dspmath::fmod1(phase_mod2 + (deltaTime * f_mod));
+
+      f_car1 = dspmath::fmod(f_car + (i_mod * sample->get(phase_mod1)), 22050.f);
+      f_car2 = dspmath::fmod(f_car + (i_mod * sample->get(phase_mod2)), 22050.f);
+    }
+
+    /*
+     * Walk the breakpoints of a single lane, called when that lane's
+     * phase wraps
+     */
+    template <bool MIRROR, DistType DT>
+    void step(int i, float deltaTime) {
+      amp[i] = amp_next[i];
+      rat[i] = rat_next[i];
+      index[i] = (index[i] + 1) % num_bpts[i];
+      
+      int k = index[i];
+      if (k == num_bpts[i] - 1) last_flag |= 1 << i;
+
+      amps[k][i] = bound<MIRROR>(amps[k][i] + (max_amp_step[i] * rg[i].next<DT>()), -1.0f, 1.0f); 
+      durs[k][i] = bound<MIRROR>(durs[k][i] + (max_dur_step[i] * rg[i].next<DT>()), 0.5f, 1.5f);
+      offs[k][i] = bound<MIRROR>(offs[k][i] + (max_off_step * rg[i].next<DT>()), 0.f, 1.0f);
+      rats[k][i] = bound<MIRROR>(rats[k][i] + (max_off_step * rg[i].next<DT>()), 0.7f, 1.3f);
+
+      amp_next[i] = amps[k][i];
+      rate[i] = durs[k][i];
+      rat_next[i] = rats[k][i];
+
+      off[i] = off_next[i];
+      off_next[i] = offs[k][i];
+
+      g_idx[i] = g_idx_next[i];
+      g_idx_next[i] = 0.f;
+
+      speed[i] = freq[i] * deltaTime * num_bpts[i];
+    }
+
+    simd::float_4 out() {
+      return amp_out;
+    }
+  };
+
 }
 
+#undef GENDY_MODE_ROW
+
 #endif
@@ -0,0 +1,67 @@
+/*
+ * OversampleMenu.hpp
+ * Samuel Laing - 2019
+ *
+ * Context menu for the oversampling rate. A module using it needs an
+ * OVSM_PARAM holding log2 of the rate, so 0 is off and 3 is 8x, and a
+ * BLEP_PARAM switching band-limited breakpoints on or off.
+ */
+
+#ifndef __OVERSAMPLEMENU_HPP__
+#define __OVERSAMPLEMENU_HPP__
+
+#include "rack.hpp"
+
+#define NUM_OVERSAMPLE_RATES 4
+
+namespace rack {
+
+  static const char *OVERSAMPLE_LABELS[NUM_OVERSAMPLE_RATES] = {
+    "Off",
+    "2x",
+    "4x",
+    "8x"
+  };
+
+  template <class TModule>
+  struct OversampleItem : MenuItem {
+    TModule *module;
+    int rate;
+
+    void onAction(const event::Action &e) override {
+      module->params[TModule::OVSM_PARAM].setValue(rate);
+    }
+  };
+
+  template <class TModule>
+  struct BandLimitItem : MenuItem {
+    TModule *module;
+
+    void onAction(const event::Action &e) override {
+      Param &p = module->params[TModule::BLEP_PARAM];
+      p.setValue(p.getValue() > 0.5f ? 0.f : 1.f);
+    }
+  };
+
+  template <class TModule>
+  void appendOversampleMenu(Menu *menu, TModule *module) {
+    int current = (int) module->params[TModule::OVSM_PARAM].getValue();
+
+    menu->addChild(new MenuSeparator);
+    menu->addChild(createMenuLabel("Oversampling"));
+
+    for (int i=0; i<NUM_OVERSAMPLE_RATES; i++) {
+      OversampleItem<TModule> *item = createMenuItem<OversampleItem<TModule>>(OVERSAMPLE_LABELS[i], CHECKMARK(current == i));
+      item->module = module;
+      item->rate = i;
+      menu->addChild(item);
+    }
+
+    bool band_limited = module->params[TModule::BLEP_PARAM].getValue() > 0.5f;
+    BandLimitItem<TModule> *blepItem = createMenuItem<BandLimitItem<TModule>>("Band-limited breakpoints", CHECKMARK(band_limited));
+    blepItem->module = module;
+    menu->addChild(blepItem);
+  }
+}
+
+#endif
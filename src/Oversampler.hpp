@@ -0,0 +1,77 @@
+/*
+ * Oversampler.hpp
+ * Samuel Laing - 2019
+ *
+ * Runs an oscillator at 2x, 4x or 8x the engine sample rate and brings
+ * the result back down with a polyphase dsp::Decimator. The decimator
+ * only evaluates the output samples that are kept, so the cost is one
+ * FIR of OVERSAMPLE * QUALITY taps per engine sample on top of the
+ * extra oscillator work.
+ */
+
+#ifndef __OVERSAMPLER_HPP__
+#define __OVERSAMPLER_HPP__
+
+#include "rack.hpp"
+#include "dsp/resampler.hpp"
+
+#define MAX_OVERSAMPLE 8
+
+namespace rack {
+
+  /*
+   * T is either float or simd::float_4. Every decimator gets at least
+   * 32 taps, and the tap counts are powers of two so the ring buffer
+   * index wraps with a mask instead of a division
+   */
+  template <typename T>
+  struct TOversampler {
+    int factor = 1;
+
+    dsp::Decimator<2, 16, T> dec2;
+    dsp::Decimator<4, 8, T> dec4;
+    dsp::Decimator<8, 8, T> dec8;
+
+    T buffer[MAX_OVERSAMPLE];
+
+    /*
+     * f is 1, 2, 4 or 8, anything else turns oversampling off. The
+     * decimator history is cleared so stale samples from the previous
+     * rate are never mixed in
+     */
+    void setFactor(int f) {
+      if (f != 2 && f != 4 && f != 8) f = 1;
+      if (f == factor) return;
+      factor = f;
+      reset();
+    }
+
+    void reset() {
+      dec2.reset();
+      dec4.reset();
+      dec8.reset();
+    }
+
+    /*
+     * Call f(subSampleTime) factor times and return the decimated
+     * output for one engine sample
+     */
+    template <typename F>
+    T process(float sampleTime, F f) {
+      if (factor == 1) return f(sampleTime);
+
+      float subSampleTime = sampleTime / factor;
+      for (int i=0; i<factor; i++) buffer[i] = f(subSampleTime);
+
+      switch (factor) {
+        case 2: return dec2.process(buffer);
+        case 4: return dec4.process(buffer);
+        default: return dec8.process(buffer);
+      }
+    }
+  };
+
+  typedef TOversampler<float> Oversampler;
+}
+
+#endif
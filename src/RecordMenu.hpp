@@ -0,0 +1,72 @@
+/*
+ * RecordMenu.hpp
+ * Samuel Laing - 2019
+ *
+ * Context menu entries to start and stop recording a module's output.
+ * A module using it needs a Recorder recorder member, and names the
+ * output to record, every channel of which is recorded.
+ */
+
+#ifndef __RECORDMENU_HPP__
+#define __RECORDMENU_HPP__
+
+#include "rack.hpp"
+#include "osdialog.h"
+#include "Recorder.hpp"
+
+namespace rack {
+
+  template <class TModule>
+  struct StartRecordingItem : MenuItem {
+    TModule *module;
+    int output;
+
+    void onAction(const event::Action &e) override {
+      osdialog_filters *filters = osdialog_filters_parse("WAV:wav");
+      char *file = osdialog_file(OSDIALOG_SAVE, asset::user("").c_str(), "recording.wav", filters);
+      osdialog_filters_free(filters);
+
+      if (!file) return;
+
+      std::string path = file;
+      free(file);
+      if (string::filenameExtension(string::filename(path)) != "wav") path += ".wav";
+
+      int channels = std::max(1, module->outputs[output].getChannels());
+      module->recorder.start(path, channels, (int) APP->engine->getSampleRate());
+    }
+  };
+
+  template <class TModule>
+  struct StopRecordingItem : MenuItem {
+    TModule *module;
+
+    void onAction(const event::Action &e) override {
+      module->recorder.stop();
+    }
+  };
+
+  template <class TModule>
+  void appendRecordMenu(Menu *menu, TModule *module, int output) {
+    Recorder &recorder = module->recorder;
+
+    menu->addChild(new MenuSeparator);
+
+    if (recorder.active) {
+      float t = recorder.seconds();
+      menu->addChild(createMenuLabel(string::f("Recording %s (%d:%02d)", string::filename(recorder.path).c_str(), (int) t / 60, (int) t % 60)));
+
+      StopRecordingItem<TModule> *stopItem = createMenuItem<StopRecordingItem<TModule>>("Stop recording");
+      stopItem->module = module;
+      menu->addChild(stopItem);
+    }
+    else {
+      StartRecordingItem<TModule> *startItem = createMenuItem<StartRecordingItem<TModule>>("Start recording...");
+      startItem->module = module;
+      startItem->output = output;
+      menu->addChild(startItem);
+    }
+  }
+}
+
+#endif
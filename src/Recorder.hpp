@@ -0,0 +1,199 @@
+/*
+ * Recorder.hpp
+ * Samuel Laing - 2019
+ *
+ * Built in recording of a module's output to a WAV file. The audio
+ * thread pushes frames into a single producer / single consumer ring
+ * buffer without locking or allocating, and a Worker of the recorder's
+ * own drains the ring to disk in the background. It is never shared
+ * with a module's worker, whose decoding and file writes could stall it
+ * for longer than the ring holds.
+ */
+
+#ifndef __RECORDER_HPP__
+#define __RECORDER_HPP__
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "rack.hpp"
+#include "wavfile.hpp"
+#include "Worker.hpp"
+
+// seconds of audio the ring holds, how long the disk may stall before
+// frames are dropped
+#define RECORD_BUFFER_SECONDS 2
+
+namespace rack {
+
+  struct Recorder {
+    // set by start() once everything is allocated, the only thing the
+    // audio thread checks when not recording
+    std::atomic<bool> active;
+
+    // set by the audio thread for as long as it is inside push(). stop()
+    // waits for it, so the ring, mask and channels never change under a
+    // push in flight
+    std::atomic<bool> pushing;
+
+    // ring of interleaved samples, its size is a power of two. head is
+    // only written by the audio thread, tail only by the worker
+    std::vector<float> ring;
+    size_t mask = 0;
+    std::atomic<size_t> head;
+    std::atomic<size_t> tail;
+
+    int channels = 1;
+    int sample_rate = 44100;
+
+    // frames dropped because the ring was full, and samples on disk
+    std::atomic<uint32_t> dropped;
+    std::atomic<uint64_t> written;
+
+    std::string path;
+    WavWriter wav;
+
+    // held while the ring is drained into wav, or either is set up or
+    // closed. open is whether there is a file to drain into
+    std::mutex wav_mutex;
+    bool open = false;
+
+    Worker worker;
+
+    Recorder() {
+      active = false;
+      pushing = false;
+      head = 0;
+      tail = 0;
+      dropped = 0;
+      written = 0;
+    }
+
+    ~Recorder() {
+      stop();
+    }
+
+    /*
+     * Start writing channels of audio at sample_rate to path. Called
+     * from the UI thread
+     */
+    bool start(const std::string &p, int channels, int sample_rate) {
+      stop();
+
+      std::unique_lock<std::mutex> lock(wav_mutex);
+      if (!wav.open(p, channels, sample_rate)) return false;
+
+      path = p;
+      this->channels = channels;
+      this->sample_rate = sample_rate;
+
+      size_t size = 1;
+      while (size < (size_t) (sample_rate * channels * RECORD_BUFFER_SECONDS)) size <<= 1;
+
+      // not active and no push in flight since stop(), so the ring may
+      // be replaced
+      if (ring.size() < size) ring.assign(size, 0.f);
+      mask = ring.size() - 1;
+
+      head = 0;
+      tail = 0;
+      dropped = 0;
+      written = 0;
+      open = true;
+      lock.unlock();
+
+      worker.start([this]() { poll(); });
+      active = true;
+
+      INFO("Recording to %s", path.c_str());
+      return true;
+    }
+
+    /*
+     * Stop and close the file, writing out whatever is still in the
+     * ring. Called from the UI thread
+     */
+    void stop() {
+      if (!active) return;
+
+      active = false;
+      while (pushing) std::this_thread::yield();
+
+      worker.stop();
+
+      std::lock_guard<std::mutex> lock(wav_mutex);
+      drain();
+      wav.close();
+      open = false;
+
+      if (dropped > 0) WARN("Recording to %s dropped %u frames", path.c_str(), dropped.load());
+      INFO("Stopped recording to %s", path.c_str());
+    }
+
+    /*
+     * Audio thread, push one frame of channels voltages. Scaled so 5V
+     * is full scale. Checks active again under pushing, whatever the
+     * caller saw may be stale by now
+     */
+    void push(const float *v) {
+      pushing = true;
+      if (!active) {
+        pushing = false;
+        return;
+      }
+
+      size_t h = head.load(std::memory_order_relaxed);
+      size_t t = tail.load(std::memory_order_acquire);
+
+      if (h - t + channels > ring.size()) {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+        pushing = false;
+        return;
+      }
+
+      for (int c=0; c<channels; c++) ring[(h + c) & mask] = v[c] * 0.2f;
+      head.store(h + channels, std::memory_order_release);
+      pushing = false;
+    }
+
+    /*
+     * Worker thread, write everything pushed so far to disk if recording
+     */
+    void poll() {
+      std::lock_guard<std::mutex> lock(wav_mutex);
+      if (open) drain();
+    }
+
+    /*
+     * Write everything pushed so far to disk, under wav_mutex
+     */
+    void drain() {
+      size_t t = tail.load(std::memory_order_relaxed);
+      size_t h = head.load(std::memory_order_acquire);
+
+      while (t != h) {
+        // up to the end of the ring at most, then wrap around
+        size_t start = t & mask;
+        size_t n = std::min(h - t, ring.size() - start);
+
+        wav.write(&ring[start], n);
+        t += n;
+        tail.store(t, std::memory_order_release);
+      }
+
+      written = wav.samples;
+    }
+
+    /*
+     * Length of the recording so far
+     */
+    float seconds() {
+      return (float) written.load() / (channels * sample_rate);
+    }
+  };
+}
+
+#endif
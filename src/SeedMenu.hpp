@@ -0,0 +1,61 @@
+/*
+ * SeedMenu.hpp
+ * Samuel Laing - 2019
+ *
+ * Context menu entries for the random seed shared by all modules. A
+ * module using it needs a SEED_PARAM and an int seed member holding the
+ * seed its generators were last seeded with (-1 forces a reseed).
+ */
+
+#ifndef __SEEDMENU_HPP__
+#define __SEEDMENU_HPP__
+
+#include "rack.hpp"
+
+#define MAX_SEED 99999
+
+namespace rack {
+
+  template <class TModule>
+  struct SeedItem : MenuItem {
+    TModule *module;
+    int seed;
+
+    void onAction(const event::Action &e) override {
+      module->params[TModule::SEED_PARAM].setValue(seed);
+    }
+  };
+
+  template <class TModule>
+  struct RestartWalkItem : MenuItem {
+    TModule *module;
+
+    void onAction(const event::Action &e) override {
+      module->seed = -1;
+    }
+  };
+
+  template <class TModule>
+  void appendSeedMenu(Menu *menu, TModule *module) {
+    int seed = (int) module->params[TModule::SEED_PARAM].getValue();
+
+    menu->addChild(new MenuSeparator);
+    menu->addChild(createMenuLabel(seed == 0 ? "Seed: free running" : string::f("Seed: %d", seed)));
+
+    SeedItem<TModule> *freeItem = createMenuItem<SeedItem<TModule>>("Free running", CHECKMARK(seed == 0));
+    freeItem->module = module;
+    freeItem->seed = 0;
+    menu->addChild(freeItem);
+
+    SeedItem<TModule> *newItem = createMenuItem<SeedItem<TModule>>("New seed");
+    newItem->module = module;
+    newItem->seed = 1 + random::u32() % MAX_SEED;
+    menu->addChild(newItem);
+
+    RestartWalkItem<TModule> *restartItem = createMenuItem<RestartWalkItem<TModule>>("Restart from seed");
+    restartItem->module = module;
+    menu->addChild(restartItem);
+  }
+}
+
+#endif
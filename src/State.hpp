@@ -0,0 +1,159 @@
+/*
+ * State.hpp
+ * Samuel Laing - 2019
+ *
+ * Compact versioned binary format for module state saved with a patch.
+ * Values are written in native byte order (little endian on every
+ * platform Rack runs on) behind a header holding a magic number, the
+ * format version and a tag naming what follows. Small state goes into
+ * the patch JSON as base64, large buffers into sidecar files.
+ */
+
+#ifndef __STATE_HPP__
+#define __STATE_HPP__
+
+#include <cstring>
+#include <vector>
+
+#include "rack.hpp"
+
+// "SGDS"
+#define STATE_MAGIC 0x53444753
+// 2: Stitcher keeps its oscillators in one SIMD bank
+// 3: Stitcher saves a bank for every expander it can take
+// 4: Stitcher saves every polyphonic voice
+// 5: GenEcho saves every polyphonic voice
+// 6: Stitcher only saves the voices and banks in use
+// 7: GenEcho sidecars hold the capture alone, behind the save's tag
+#define STATE_VERSION 7
+
+namespace rack {
+
+  enum StateTag {
+    GRANDY_STATE = 1,
+    STITCHER_STATE,
+    GENECHO_STATE,
+    GENECHO_BUFFER,
+    STEPPER_STATE
+  };
+
+  struct StateWriter {
+    std::vector<uint8_t> data;
+
+    void header(StateTag tag) {
+      put<uint32_t>(STATE_MAGIC);
+      put<uint16_t>(STATE_VERSION);
+      put<uint16_t>(tag);
+    }
+
+    void putBytes(const void *x, size_t n) {
+      const uint8_t *b = (const uint8_t *) x;
+      data.insert(data.end(), b, b + n);
+    }
+
+    template <typename T>
+    void put(const T &x) {
+      putBytes(&x, sizeof(T));
+    }
+
+    template <typename T>
+    void putArray(const T *x, size_t n) {
+      putBytes(x, n * sizeof(T));
+    }
+
+    /*
+     * Base64 JSON string for the patch file
+     */
+    json_t *toJson() const {
+      return json_string(string::toBase64(data.data(), data.size()).c_str());
+    }
+  };
+
+  /*
+   * Reads are bounds checked. After the first short read ok is false
+   * and every further read returns zeros
+   */
+  struct StateReader {
+    const uint8_t *p = NULL;
+    const uint8_t *end = NULL;
+    bool ok = true;
+    uint16_t version = 0;
+
+    StateReader(const uint8_t *data, size_t size) : p(data), end(data + size) {}
+
+    /*
+     * Check the header, false if this isn't tag state in a version this
+     * build understands
+     */
+    bool header(StateTag tag) {
+      uint32_t magic = get<uint32_t>();
+      version = get<uint16_t>();
+      uint16_t t = get<uint16_t>();
+
+      ok = ok && magic == STATE_MAGIC && version >= 1 && version <= STATE_VERSION && t == tag;
+      return ok;
+    }
+
+    void getBytes(void *x, size_t n) {
+      if (!ok || (size_t) (end - p) < n) {
+        ok = false;
+        memset(x, 0, n);
+        return;
+      }
+      memcpy(x, p, n);
+      p += n;
+    }
+
+    void skip(size_t n) {
+      if (!ok || (size_t) (end - p) < n) {
+        ok = false;
+        return;
+      }
+      p += n;
+    }
+
+    template <typename T>
+    T get() {
+      T x;
+      getBytes(&x, sizeof(T));
+      return x;
+    }
+
+    template <typename T>
+    void get(T &x) {
+      getBytes(&x, sizeof(T));
+    }
+
+    template <typename T>
+    void getArray(T *x, size_t n) {
+      getBytes(x, n * sizeof(T));
+    }
+
+    /*
+     * Read a saved array of n elements into one of size, dropping what
+     * doesn't fit, for arrays whose size differs between builds
+     */
+    template <typename T>
+    void getArray(T *x, size_t n, size_t size) {
+      getArray(x, std::min(n, size));
+      if (n > size) skip((n - size) * sizeof(T));
+    }
+  };
+
+  /*
+   * Decode a base64 state string from the patch JSON, false if missing
+   */
+  inline bool stateFromJson(json_t *stateJ, std::vector<uint8_t> &data) {
+    if (!stateJ || !json_is_string(stateJ)) return false;
+
+    size_t size = 0;
+    uint8_t *bytes = string::fromBase64(json_string_value(stateJ), &size);
+    if (!bytes) return false;
+
+    data.assign(bytes, bytes + size);
+    free(bytes);
+    return true;
+  }
+}
+
+#endif
@@ -0,0 +1,207 @@
+/*
+ * StepWalk.hpp
+ * Samuel Laing - 2019
+ *
+ * The random walk behind the StochStepper, four channels at once. Each
+ * channel walks a cycle of breakpoints the way a GRANDY oscillator does,
+ * only slowly enough to be CV, and moves from one breakpoint's amplitude
+ * to the next by stepping, ramping or curving exponentially. Only needs
+ * the DSP headers.
+ */
+
+#ifndef __STEPWALK_HPP__
+#define __STEPWALK_HPP__
+
+#include "rack.hpp"
+#include "GrandyOscillator.hpp"
+
+// how sharply the exponential curve bends, it covers all but 2^-CURVE
+// of the way by itself and is scaled to land exactly on the breakpoint
+#define STEP_EXP_CURVE 8.f
+
+namespace rack {
+
+  enum StepType {
+    STEP,
+    RAMP,
+    EXP,
+    NUM_STEP_TYPES
+  };
+
+  /*
+   * Free running, a channel moves on to its next breakpoint after its
+   * duration at freq steps per second. Clocked, it moves on at every
+   * trigger and glides over as long as the last two triggers were apart.
+   * The interpolation runs vectorized across the lanes, the walk itself
+   * only on a step, per lane in scalar code
+   */
+  struct StepWalk4 {
+    // through the current segment, free running lanes step at 1
+    simd::float_4 phase = 1.f;
+    // 1 / duration of the current breakpoint, free running
+    simd::float_4 rate = 1.f;
+    // phase per sample and samples since the last trigger, clocked
+    simd::float_4 clock_inc = 0.f;
+    simd::float_4 elapsed = 0.f;
+
+    // modes, shared by all lanes
+    bool is_mirroring = false;
+    bool clocked = false;
+    DistType dt = LINEAR;
+    StepType step_type = STEP;
+
+    int num_bpts[4] = {8, 8, 8, 8};
+
+    // breakpoint values are stored lane-interleaved: amps[bpt][lane]
+    float amps[MAX_BPTS][4];
+    float durs[MAX_BPTS][4];
+
+    int index[4] = {0, 0, 0, 0};
+
+    float max_amp_step[4] = {0.05f, 0.05f, 0.05f, 0.05f};
+    float max_dur_step[4] = {0.05f, 0.05f, 0.05f, 0.05f};
+
+    // steps per second, free running
+    simd::float_4 freq = 2.f;
+
+    simd::float_4 amp = 0.f;
+    simd::float_4 amp_next = 0.f;
+    simd::float_4 amp_out = 0.f;
+
+    gRandGen rg[4];
+
+    // bit i is only set when lane i just stepped a break point
+    int step_flag = 0;
+
+    StepWalk4() {
+      reset();
+    }
+
+    void reset() {
+      for (int k=0; k<MAX_BPTS; k++) {
+        for (int i=0; i<4; i++) {
+          amps[k][i] = 0.f;
+          durs[k][i] = 1.f;
+        }
+      }
+
+      for (int i=0; i<4; i++) index[i] = 0;
+
+      phase = 1.f;
+      rate = 1.f;
+      clock_inc = 0.f;
+      elapsed = 0.f;
+      amp = amp_next = amp_out = 0.f;
+      step_flag = 0;
+    }
+
+    void seed(int lane, uint64_t x) {
+      rg[lane].seed(x);
+    }
+
+    void save(StateWriter &w) {
+      w.put<int32_t>(MAX_BPTS);
+      w.putArray(&amps[0][0], MAX_BPTS * 4);
+      w.putArray(&durs[0][0], MAX_BPTS * 4);
+      w.putArray(index, 4);
+
+      w.put(phase);
+      w.put(rate);
+      w.put(clock_inc);
+      w.put(elapsed);
+      w.put(amp);
+      w.put(amp_next);
+      w.put(amp_out);
+
+      for (int i=0; i<4; i++) w.putArray(rg[i].gen.s, 4);
+    }
+
+    void load(StateReader &r) {
+      size_t n = std::max(0, r.get<int32_t>());
+      r.getArray(&amps[0][0], n * 4, MAX_BPTS * 4);
+      r.getArray(&durs[0][0], n * 4, MAX_BPTS * 4);
+      r.getArray(index, 4);
+      for (int i=0; i<4; i++) index[i] = clamp(index[i], 0, MAX_BPTS - 1);
+
+      r.get(phase);
+      r.get(rate);
+      r.get(clock_inc);
+      r.get(elapsed);
+      r.get(amp);
+      r.get(amp_next);
+      r.get(amp_out);
+
+      for (int i=0; i<4; i++) r.getArray(rg[i].gen.s, 4);
+    }
+
+    /*
+     * Advance one sample. Bit i of triggers steps lane i, only while
+     * clocked
+     */
+    void process(float deltaTime, int triggers) {
+      if (clocked) {
+        step_flag = triggers;
+        elapsed += 1.f;
+      }
+      else {
+        simd::float_4 wrapped = phase >= 1.f;
+        step_flag = simd::movemask(wrapped);
+        phase -= simd::ifelse(wrapped, 1.f, 0.f);
+      }
+
+      if (step_flag) {
+        for (int i=0; i<4; i++) {
+          if (step_flag & (1 << i)) step(i);
+        }
+      }
+
+      simd::float_4 t = simd::fmin(phase, 1.f);
+      switch (step_type) {
+        case RAMP:
+          amp_out = amp + t * (amp_next - amp);
+          break;
+        case EXP:
+          amp_out = amp + (amp_next - amp) * (1.f - dspmath::exp2(-STEP_EXP_CURVE * t))
+              / (1.f - dspmath::exp2(-STEP_EXP_CURVE));
+          break;
+        default:
+          amp_out = amp_next;
+          break;
+      }
+
+      // clocked lanes wait at the breakpoint for the next trigger
+      if (clocked) phase = simd::fmin(phase + clock_inc, 1.f);
+      else phase += freq * deltaTime * rate;
+    }
+
+    /*
+     * Walk the breakpoints of a single lane. The segment starts from
+     * wherever the output is, so a trigger that comes early doesn't jump
+     */
+    void step(int i) {
+      amp[i] = amp_out[i];
+      index[i] = (index[i] + 1) % num_bpts[i];
+
+      int k = index[i];
+      float a = amps[k][i] + (max_amp_step[i] * rg[i].next(dt));
+      float d = durs[k][i] + (max_dur_step[i] * rg[i].next(dt));
+      amps[k][i] = is_mirroring ? mirror(a, -1.f, 1.f) : wrap(a, -1.f, 1.f);
+      durs[k][i] = is_mirroring ? mirror(d, 0.5f, 1.5f) : wrap(d, 0.5f, 1.5f);
+
+      amp_next[i] = amps[k][i];
+      rate[i] = 1.f / durs[k][i];
+
+      if (clocked) {
+        clock_inc[i] = 1.f / std::max(elapsed[i], 1.f);
+        elapsed[i] = 0.f;
+        phase[i] = 0.f;
+      }
+    }
+
+    simd::float_4 out() {
+      return amp_out;
+    }
+  };
+}
+
+#endif
@@ -0,0 +1,277 @@
+/*
+ * Stitch.hpp
+ * Samuel Laing - 2019
+ *
+ * One voice of the Stitcher: its GRANDY oscillators and the stitching
+ * from one to the next. Only needs the DSP headers, so the Stitcher's
+ * sound can also be rendered outside of Rack.
+ */
+
+#ifndef __STITCH_HPP__
+#define __STITCH_HPP__
+
+#include "GrandyOscillator.hpp"
+#include "Blep.hpp"
+
+// oscillators come in banks of four, the Stitcher's own and one per
+// expander
+#define STITCHER_MAX_BANKS 4
+
+// samples the output is delayed by, so a crossfade into the next
+// oscillator can finish right where the last cycle of the current one
+// ends. Must be a power of two
+#define STITCH_LOOKAHEAD 16
+
+// frames of corrections the band-limited stitch can have pending, the
+// lookahead plus the minBLAMP's length. A power of two
+#define STITCH_TAILS 64
+
+namespace rack {
+
+  struct StitchVoice {
+    // banks of four with one oscillator per lane. Those in use run in
+    // lockstep, so the next one is always primed and every sample costs
+    // the same
+    GendyOscillator4 banks[STITCHER_MAX_BANKS];
+
+    // the oscillator being output and how many more of its cycles to
+    // output
+    int osc_idx = 0;
+    int current_stutter = 1;
+
+    // crossfade from oscillator from_idx to osc_idx, done at 1
+    int from_idx = 0;
+    float xfade = 1.f;
+
+    // the last STITCH_LOOKAHEAD frames of every oscillator, the output
+    // reads the oldest one
+    simd::float_4 history[STITCHER_MAX_BANKS][STITCH_LOOKAHEAD];
+    int history_pos = 0;
+
+    // band-limited mode: every oscillator's breakpoints are smoothed by
+    // its own minBLAMPs, and instead of crossfading, the output switches
+    // instantly, right at the delayed cycle end, smoothed as well. Then
+    // from_idx is the oscillator being heard
+    bool band_limited = false;
+    GendyBlep4 bleps[STITCHER_MAX_BANKS];
+    MinBlep stitch_blep;
+    MinBlamp stitch_blamp;
+
+    // switches waiting for the delayed output, by the history frame they
+    // happen in: the oscillator switched to plus one, 0 for none, where
+    // in the frame the switch falls and the step and change of slope
+    // between the two oscillators there
+    int switch_to[STITCH_LOOKAHEAD] = {};
+    float switch_p[STITCH_LOOKAHEAD] = {};
+    float switch_jump[STITCH_LOOKAHEAD] = {};
+    float switch_kink[STITCH_LOOKAHEAD] = {};
+
+    // at a switch the outgoing oscillator's last corners should go on
+    // ringing and the incoming one's not be heard at all. Their minBLAMP
+    // tails are moved over here, by frame, until the output gets there
+    float tails[STITCH_TAILS] = {};
+    int frame = 0;
+
+    StitchVoice() {
+      clearHistory();
+    }
+
+    void clearHistory() {
+      for (int b=0; b<STITCHER_MAX_BANKS; b++) {
+        for (int j=0; j<STITCH_LOOKAHEAD; j++) history[b][j] = 0.f;
+      }
+    }
+
+    /*
+     * Bank b was idle and is about to be processed again. Its history and
+     * minBLAMPs were frozen when it stopped, start them over from where
+     * its oscillators are now
+     */
+    void activateBank(int b) {
+      for (int j=0; j<STITCH_LOOKAHEAD; j++) history[b][j] = 0.f;
+      bleps[b].reset(banks[b]);
+    }
+
+    /*
+     * Restart the stitching and every oscillator's walk, oscillator k
+     * gets stream + k
+     */
+    void reset(int seed, int stream) {
+      for (int b=0; b<STITCHER_MAX_BANKS; b++) {
+        banks[b].reset();
+        for (int i=0; i<4; i++) banks[b].seed(i, streamSeed(seed, stream + b * 4 + i));
+      }
+      clearHistory();
+
+      osc_idx = 0;
+      from_idx = 0;
+      current_stutter = 1;
+      xfade = 1.f;
+      history_pos = 0;
+      resetBleps();
+    }
+
+    void resetBleps() {
+      for (int b=0; b<STITCHER_MAX_BANKS; b++) bleps[b].reset(banks[b]);
+      for (int j=0; j<2 * BLEP_ZERO_CROSSINGS; j++) stitch_blep.buf[j] = 0.f;
+      stitch_blamp.reset();
+
+      for (int j=0; j<STITCH_LOOKAHEAD; j++) switch_to[j] = 0;
+      for (int j=0; j<STITCH_TAILS; j++) tails[j] = 0.f;
+      if (band_limited) from_idx = osc_idx;
+    }
+
+    void setBandLimited(bool on) {
+      if (on == band_limited) return;
+
+      band_limited = on;
+      xfade = 1.f;
+      resetBleps();
+    }
+
+    /*
+     * Move on to the first oscillator if the active one is no longer
+     * among the first num_oscs
+     */
+    void limit(int num_oscs, const int *stutters) {
+      if (osc_idx < num_oscs) return;
+
+      // band-limited, the switch comes with the next frame heard
+      if (band_limited) {
+        switch_to[history_pos] = 1;
+        switch_p[history_pos] = 0.f;
+        switch_jump[history_pos] = 0.f;
+        switch_kink[history_pos] = 0.f;
+      }
+      else {
+        from_idx = osc_idx;
+        xfade = 0.f;
+      }
+
+      osc_idx = 0;
+      current_stutter = stutters[0];
+    }
+
+    /*
+     * Advance the first num_oscs oscillators by one (sub) sample and
+     * output the active one, STITCH_LOOKAHEAD samples late. When the
+     * active oscillator ends its last stutter the crossfade into the
+     * next one starts on the delayed output, and is over by the time
+     * that cycle end is heard
+     */
+    float process(float deltaTime, int num_oscs, const int *stutters) {
+      int active_banks = (num_oscs + 3) / 4;
+      for (int k=0; k<active_banks; k++) banks[k].process(deltaTime);
+
+      if (band_limited) return processBandLimited(num_oscs, stutters);
+
+      if (banks[osc_idx / 4].last_flag & (1 << (osc_idx % 4))) {
+        current_stutter--;
+        if (current_stutter < 1) {
+          from_idx = osc_idx;
+          osc_idx = (osc_idx + 1) % num_oscs;
+          current_stutter = stutters[osc_idx];
+          xfade = 0.f;
+        }
+      }
+
+      // the oldest frame, read before it is overwritten
+      int pos = history_pos;
+      float a = history[from_idx / 4][pos][from_idx % 4];
+      float b = history[osc_idx / 4][pos][osc_idx % 4];
+
+      for (int k=0; k<active_banks; k++) history[k][pos] = banks[k].out();
+      history_pos = (pos + 1) & (STITCH_LOOKAHEAD - 1);
+
+      xfade = std::min(xfade + 1.f / STITCH_LOOKAHEAD, 1.f);
+
+      return a + xfade * (b - a);
+    }
+
+    /*
+     * As process, but the switch happens STITCH_LOOKAHEAD samples after
+     * the cycle end, at the same point within its sample
+     */
+    float processBandLimited(int num_oscs, const int *stutters) {
+      int active_banks = (num_oscs + 3) / 4;
+
+      int switched = 0;
+      float p = 0.f, jump = 0.f, kink = 0.f;
+      int from_bank = osc_idx / 4, from_lane = osc_idx % 4;
+
+      if (banks[from_bank].last_flag & (1 << from_lane)) {
+        current_stutter--;
+        if (current_stutter < 1) {
+          osc_idx = (osc_idx + 1) % num_oscs;
+          current_stutter = stutters[osc_idx];
+          switched = osc_idx + 1;
+
+          int to_bank = osc_idx / 4, to_lane = osc_idx % 4;
+          const GendyOscillator4 &from = banks[from_bank];
+          const GendyOscillator4 &to = banks[to_bank];
+
+          // the outgoing oscillator is at its breakpoint, the incoming
+          // one is traced back to it, both as naive polygons, which the
+          // delayed history follows. Until the switch the history still
+          // has the outgoing one's last segment in it
+          p = bleps[from_bank].stepOffset(from, from_lane);
+          float from_slope = bleps[from_bank].slope[from_lane];
+          float to_slope = (to.amp_next[to_lane] - to.amp[to_lane]) * to.speed[to_lane];
+          float to_value = to.amp_out[to_lane] + to_slope * p;
+
+          // the incoming oscillator may have stepped in the same sample,
+          // before the switch its corner's tail is cut below, after it the
+          // switch is onto the segment before
+          float to_p = 0.f, to_kink = 0.f;
+          if (to.step_flag & (1 << to_lane)) {
+            to_p = bleps[to_bank].stepOffset(to, to_lane);
+            to_kink = to_slope - bleps[to_bank].slope[to_lane];
+
+            if (to_p > p) {
+              to_slope -= to_kink;
+              to_value = to.g_amp[to_lane] + to_slope * (p - to_p);
+              to_kink = 0.f;
+            }
+          }
+
+          jump = to_value - from.g_amp[from_lane];
+          kink = to_slope - from_slope;
+
+          const MinBlamp4 &from_blamp = bleps[from_bank].blamp;
+          const MinBlamp4 &to_blamp = bleps[to_bank].blamp;
+          for (int j=0; j<2 * BLEP_ZERO_CROSSINGS; j++) {
+            int k = (from_blamp.pos + j) % (2 * BLEP_ZERO_CROSSINGS);
+            tails[(frame + j) & (STITCH_TAILS - 1)] += from_blamp.buf[k][from_lane] - to_blamp.buf[k][to_lane]
+                - to_kink * MinBlamp::residual(j - to_p);
+          }
+        }
+      }
+
+      // the oldest frame, read before it is overwritten
+      int pos = history_pos;
+
+      int to = switch_to[pos] - 1;
+      if (to >= 0 && to < num_oscs) {
+        stitch_blep.insertDiscontinuity(switch_p[pos], switch_jump[pos]);
+        stitch_blamp.insertDiscontinuity(switch_p[pos], switch_kink[pos]);
+        from_idx = to;
+      }
+
+      float &tail = tails[(frame - STITCH_LOOKAHEAD) & (STITCH_TAILS - 1)];
+      float out = history[from_idx / 4][pos][from_idx % 4] + tail;
+      tail = 0.f;
+
+      for (int k=0; k<active_banks; k++) history[k][pos] = bleps[k].process(banks[k]);
+      switch_to[pos] = switched;
+      switch_p[pos] = p;
+      switch_jump[pos] = jump;
+      switch_kink[pos] = kink;
+      history_pos = (pos + 1) & (STITCH_LOOKAHEAD - 1);
+      frame = (frame + 1) & (STITCH_TAILS - 1);
+
+      return out + stitch_blep.process() + stitch_blamp.process();
+    }
+  };
+}
+
+#endif
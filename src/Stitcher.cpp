@@ -9,12 +9,31 @@
 
 #include "plugin.hpp"
 #include "dsp/digital.hpp"
-#include "dsp/resampler.hpp"
 
 #include "wavetable.hpp"
 #include "GrandyOscillator.hpp"
-
+#include "ControlRate.hpp"
+#include "Oversampler.hpp"
+#include "SeedMenu.hpp"
+#include "DistMenu.hpp"
+#include "OversampleMenu.hpp"
+#include "RecordMenu.hpp"
+#include "TimingMenu.hpp"
+#include "Stitch.hpp"
+#include "StitcherExpander.hpp"
+
+// oscillators on the Stitcher's own panel, one per lane of a
+// GendyOscillator4. Expanders add a bank of four each
 #define NUM_OSCS 4
+#define MAX_OSCS (NUM_OSCS * STITCHER_MAX_BANKS)
+
+/*
+ * The knob goes up to every oscillator the expanders could add, those
+ * missing are shown in its tooltip
+ */
+struct NumOscsQuantity : ParamQuantity {
+  std::string getDisplayValueString() override;
+};
 
 struct Stitcher : Module {
 	enum ParamIds {
@@ -56,6 +75,10 @@ struct Stitcher : Module {
     FMTR_PARAM,
     PDST_PARAM,
     MIRR_PARAM,
+    SEED_PARAM,
+    OVSM_PARAM,
+    BLEP_PARAM,
+    XDST_PARAM,
     NUM_PARAMS
 	};
 	enum InputIds {
@@ -92,29 +115,27 @@ struct Stitcher : Module {
 
   dsp::SchmittTrigger smpTrigger;
   
-  GendyOscillator gos[NUM_OSCS];
-  int osc_idx = 0;
-
-  // allow an adjustable number of oscillators
-  // to be used 1 -> 4
+  // every voice has its own oscillators and stitches independently.
+  // Bank 0 of each is controlled from this panel, bank b from the b-th
+  // expander
+  StitchVoice voices[16];
+
+  // controls of the expanders' banks, from the rightExpander message,
+  // and how many banks there are with this panel's
+  StitcherControlsMessage expander_controls[2];
+  StitcherControlsMessage *expanders = &expander_controls[1];
+  int num_banks = 1;
+
+  // allow an adjustable number of oscillators to be used, 1 to four
+  // per bank. Only the banks they need are processed
   int curr_num_oscs = NUM_OSCS;
-  int stutters[NUM_OSCS] = {1};
-  int current_stutter = 1;
+  int active_banks = 1;
+  int stutters[MAX_OSCS] = {1};
 
-  float phase = 0.f;
-  float amp = 0.f;
-  float amp_next = 0.f;
-  float amp_out = 0.f;
-  float speed = 0.f;
-
-  bool is_swapping = false;
-  int stutter = 1;
+  // the widest polyphonic input sets the number of voices
+  int channels = 1;
 
   // vars for global parameter controls
-  float g_freq_mul = 1.0;
-  float g_max_amp_add = 0.f;
-  float g_max_dur_add = 0.f;
-
   float g_freq_sig = 0.f;
   float g_bpts_sig = 0.f;
   float g_astp_sig = 0.f;
@@ -130,13 +151,31 @@ struct Stitcher : Module {
   float dstp_sig = 0.f;
   float grat_sig = 0.f;
   float fcar_sig = 0.f;
-  float fmod_sig = 0.f;
   float imod_sig = 0.f;
 
   bool g_is_mirroring = false;
   bool g_is_fm_on = false;
   DistType g_dt = LINEAR;
 
+  // seed the oscillators were last seeded with, -1 forces a reseed
+  int seed = -1;
+
+  // params are read at control rate and ramped per sample
+  ControlRate control;
+  TParamRamp<simd::float_4> freq_ramp[16][STITCHER_MAX_BANKS];
+  TParamRamp<simd::float_4> grat_ramp[16][STITCHER_MAX_BANKS];
+  TParamRamp<simd::float_4> fcar_ramp[16][STITCHER_MAX_BANKS];
+  TParamRamp<simd::float_4> fmod_ramp[16][STITCHER_MAX_BANKS];
+  TParamRamp<simd::float_4> imod_ramp[16][STITCHER_MAX_BANKS];
+
+  // the distribution from the panel switch or the menu
+  DistSelect dist;
+
+  Oversampler oversamplers[16];
+
+  Recorder recorder;
+  ProcessTimer timer;
+
   Stitcher() {
     config(NUM_PARAMS, NUM_INPUTS, NUM_OUTPUTS, NUM_LIGHTS);
 
@@ -170,128 +209,355 @@ struct Stitcher : Module {
     configParam(G_FCARCV_PARAM, 0.f, 1.f, 0.f);
     configParam(G_FMODCV_PARAM, 0.f, 1.f, 0.f);
     configParam(G_IMODCV_PARAM, 0.f, 1.f, 0.f);
-    configParam(G_NOSC_PARAM, 1.f, 4.f, 4.f);
+    configParam<NumOscsQuantity>(G_NOSC_PARAM, 1.f, MAX_OSCS, 4.f, "Number of oscillators");
     configParam(FMTR_PARAM, 0.0f, 1.0f, 0.0f);
     configParam(MIRR_PARAM, 0.f, 1.f, 0.f);
     configParam(PDST_PARAM, 0.f, 2.f, 0.f);
+    configParam(XDST_PARAM, 0.f, NUM_DISTS - 1, 0.f, "Distribution");
+    configParam(SEED_PARAM, 0.f, MAX_SEED, 0.f, "Random seed");
+    configParam(OVSM_PARAM, 0.f, NUM_OVERSAMPLE_RATES - 1, 0.f, "Oversampling");
+    configParam(BLEP_PARAM, 0.f, 1.f, 0.f, "Band-limited breakpoints");
+
+    rightExpander.producerMessage = &expander_controls[0];
+    rightExpander.consumerMessage = &expander_controls[1];
   }
 
   void process(const ProcessArgs &args) override;
+  void processControls();
+  void findExpanders();
+  void sendLights();
+  void reseed();
   float wrap(float,float,float);
+
+  // per oscillator controls of bank b, by this module's ids
+  float bankParam(int b, int id, int j) {
+    if (b == 0) return params[id + j].getValue();
+    return expanders->banks[b - 1].getParam(id - F_PARAM + j);
+  }
+
+  float bankInput(int b, int id, int j, int c) {
+    if (b == 0) return inputs[id + j].getPolyVoltage(c);
+    return expanders->banks[b - 1].getPolyVoltage(id - F_INPUT + j, c);
+  }
+
+  json_t *dataToJson() override;
+  void dataFromJson(json_t *rootJ) override;
 };
 
+static_assert(StitcherExpander::ST_PARAM == Stitcher::ST_PARAM - Stitcher::F_PARAM, "expander params out of step");
+static_assert(StitcherExpander::IMOD_INPUT == Stitcher::IMOD_INPUT - Stitcher::F_INPUT, "expander inputs out of step");
+
+std::string NumOscsQuantity::getDisplayValueString() {
+  int n = (int) getValue();
+  Stitcher *m = dynamic_cast<Stitcher*>(module);
+  if (!m || n <= m->num_banks * NUM_OSCS) return string::f("%d", n);
+  return string::f("%d (%d in use, expanders add more)", n, m->num_banks * NUM_OSCS);
+}
+
 void Stitcher::process(const ProcessArgs &args) {
   float deltaTime = args.sampleTime;
 
+  timer.begin();
+
+  if (control.process()) {
+    timer.mark(TIMING_CONTROL);
+    processControls();
+  }
+
+  for (int c=0; c<channels; c++) {
+    for (int b=0; b<active_banks; b++) {
+      GendyOscillator4 &bank = voices[c].banks[b];
+      bank.freq = freq_ramp[c][b].process();
+      bank.g_rate = grat_ramp[c][b].process();
+      bank.f_car = fcar_ramp[c][b].process();
+      bank.f_mod = fmod_ramp[c][b].process();
+      bank.i_mod = imod_ramp[c][b].process();
+    }
+
+    StitchVoice &v = voices[c];
+    int osc = v.osc_idx;
+    int stepped = 0;
+
+    float out = oversamplers[c].process(deltaTime, [&](float subSampleTime) {
+      float x = v.process(subSampleTime, curr_num_oscs, stutters);
+      for (int b=0; b<active_banks; b++) stepped |= v.banks[b].step_flag;
+      return x;
+    });
+
+    if (stepped) timer.mark(TIMING_BREAKPOINT);
+    if (v.osc_idx != osc) timer.mark(TIMING_SWITCH);
+
+    outputs[SINE_OUTPUT].setVoltage(5.0f * out, c);
+  }
+
+  outputs[SINE_OUTPUT].setChannels(channels);
+
+  if (recorder.active) recorder.push(outputs[SINE_OUTPUT].voltages);
+
+  timer.end();
+}
+
+/*
+ * Count the banks of the expanders to the right from the controls
+ * they sent, none if the module there isn't one
+ */
+void Stitcher::findExpanders() {
+  num_banks = 1;
+  expanders = (StitcherControlsMessage*) rightExpander.consumerMessage;
+
+  Module *m = rightExpander.module;
+  if (m && m->model == modelStitcherExpander) {
+    num_banks += std::min(expanders->num_banks, STITCHER_MAX_BANKS - 1);
+  }
+}
+
+/*
+ * Tell the first expander how many oscillators are in use, it passes
+ * that on to the others
+ */
+void Stitcher::sendLights() {
+  Module *m = rightExpander.module;
+  if (!m || m->model != modelStitcherExpander) return;
+
+  StitcherLightsMessage *msg = (StitcherLightsMessage*) m->leftExpander.producerMessage;
+  msg->bank = 1;
+  msg->num_oscs = curr_num_oscs;
+  m->leftExpander.messageFlipRequested = true;
+}
+
+/*
+ * Read the global and per oscillator params and CV inputs, called once
+ * per CONTROL_RATE_DIVISION samples. Every CV input is polyphonic,
+ * voice c reads channel c
+ */
+void Stitcher::processControls() {
+  int new_seed = (int) params[SEED_PARAM].getValue();
+  if (new_seed != seed) {
+    timer.mark(TIMING_RESET);
+    seed = new_seed;
+    reseed();
+  }
+
+  findExpanders();
+
+  // the number of voices follows the widest polyphonic input, on this
+  // panel or an expander
+  channels = num_banks > 1 ? expanders->channels : 1;
+  for (size_t i=0; i<inputs.size(); i++) {
+    channels = std::max(channels, inputs[i].getChannels());
+  }
+
   // read in global switches
   g_is_mirroring = (int) params[MIRR_PARAM].getValue();
   g_is_fm_on = !(params[FMTR_PARAM].getValue() > 0.f); 
-  g_dt = (DistType) params[PDST_PARAM].getValue();
-  
-  // read in global controls
-  g_freq_sig = params[G_FREQ_PARAM].getValue();
-  g_bpts_sig = params[G_BPTS_PARAM].getValue();
-  g_astp_sig = params[G_ASTP_PARAM].getValue();
-  g_dstp_sig = params[G_DSTP_PARAM].getValue();
-  g_grat_sig = params[G_GRAT_PARAM].getValue();
-  
-  g_fcar_sig = params[G_FCAR_PARAM].getValue();
-  g_fmod_sig = params[G_FMOD_PARAM].getValue();
-  g_imod_sig = params[G_IMOD_PARAM].getValue();
+  g_dt = dist.process(params[PDST_PARAM], params[XDST_PARAM]);
 
-  g_freq_sig = (inputs[G_FREQ_INPUT].getVoltage() / 5.f) * params[G_FREQCV_PARAM].getValue();
-  g_bpts_sig = (inputs[G_BPTS_INPUT].getVoltage() / 5.f) * params[G_BPTSCV_PARAM].getValue();
-  g_astp_sig = (inputs[G_ASTP_INPUT].getVoltage() / 5.f) * params[G_ASTPCV_PARAM].getValue();
-  g_dstp_sig = (inputs[G_DSTP_INPUT].getVoltage() / 5.f) * params[G_DSTPCV_PARAM].getValue();
-  g_grat_sig = (inputs[G_GRAT_INPUT].getVoltage() / 5.f) * params[G_GRATCV_PARAM].getValue();
+  int oversample = 1 << clamp((int) params[OVSM_PARAM].getValue(), 0, NUM_OVERSAMPLE_RATES - 1);
+  for (int c=0; c<16; c++) oversamplers[c].setFactor(oversample);
 
-  g_fcar_sig += (inputs[G_FCAR_INPUT].getVoltage() / 5.f) * params[G_FCARCV_PARAM].getValue();
-  g_fmod_sig += (inputs[G_FMOD_INPUT].getVoltage() / 5.f) * params[G_FMODCV_PARAM].getValue();
-  g_imod_sig += (inputs[G_IMOD_INPUT].getVoltage() / 5.f) * params[G_IMODCV_PARAM].getValue();
+  bool band_limited = params[BLEP_PARAM].getValue() > 0.5f;
+  for (int c=0; c<16; c++) voices[c].setBandLimited(band_limited);
 
   int prev = curr_num_oscs;
-  curr_num_oscs = (int) clamp(params[G_NOSC_PARAM].getValue(), 1.f, 4.f);
+  int prev_banks = active_banks;
+  curr_num_oscs = clamp((int) params[G_NOSC_PARAM].getValue(), 1, num_banks * 4);
+  active_banks = (curr_num_oscs + 3) / 4;
 
   if (prev != curr_num_oscs) DEBUG("new # of oscs: %d\n", curr_num_oscs);
 
-  // read in all the parameters for each oscillator
-  for (int i=0; i<NUM_OSCS; i++) {
-	
-    lights[ONOFF_LIGHT + i].setBrightness(i < curr_num_oscs ? 1.0f : 0.0f);
-    stutters[i] = (int) params[ST_PARAM + i].getValue();
-    
-    gos[i].is_mirroring = g_is_mirroring;
-    gos[i].is_fm_on = g_is_fm_on;
-    gos[i].dt = g_dt;
-
-    // accept modulation of signal inputs for each parameter
-        
-    freq_sig = (inputs[F_INPUT + i].getVoltage() / 5.f) * params[FCV_PARAM + i].getValue();
-    freq_sig += g_freq_sig;
-    freq_sig += params[F_PARAM + i].getValue();
-    gos[i].freq = clamp(261.626f * powf(2.0f, freq_sig), 1.f, 3000.f);
-
-    bpts_sig = 5.f * dsp::quadraticBipolar((inputs[B_INPUT + i].getVoltage() / 5.f) * params[BCV_PARAM + i].getValue());
-    bpts_sig += g_bpts_sig;
-    gos[i].num_bpts = clamp((int) params[B_PARAM + i].getValue() + (int) bpts_sig, 2, MAX_BPTS);
-    
-    astp_sig = dsp::quadraticBipolar((inputs[A_INPUT + i].getVoltage() / 5.f) * params[ACV_PARAM + i].getValue());
-    astp_sig += g_astp_sig;
-    gos[i].max_amp_step = rescale(params[A_PARAM + i].getValue() + (astp_sig / 4.f), 0.0, 1.0, 0.05, 0.3);
-    
-    dstp_sig = dsp::quadraticBipolar((inputs[D_INPUT + i].getVoltage() / 5.f) * params[DCV_PARAM].getValue());
-    dstp_sig += g_dstp_sig;
-    gos[i].max_dur_step = rescale(params[D_PARAM + i].getValue() + (dstp_sig / 4.f), 0.0, 1.0, 0.01, 0.3);
+  // banks coming back into use, say with an expander just attached, start
+  // from a clean history and jump straight to their controls
+  for (int b=prev_banks; b<active_banks; b++) {
+    for (int c=0; c<16; c++) {
+      voices[c].activateBank(b);
+      freq_ramp[c][b].primed = false;
+      grat_ramp[c][b].primed = false;
+      fcar_ramp[c][b].primed = false;
+      fmod_ramp[c][b].primed = false;
+      imod_ramp[c][b].primed = false;
+    }
+  }
 
-    grat_sig = (inputs[G_INPUT + i].getVoltage() / 5.f) * params[GCV_PARAM].getValue();
-    gos[i].g_rate = clamp(261.626f * powf(2.0f, grat_sig + g_grat_sig), 1e-6, 3000.f);
-    
-    // fm control sigs
-    fcar_sig = g_grat_sig;
-    fcar_sig += g_fcar_sig;
-    fcar_sig += params[FCAR_PARAM + i].getValue();
-    gos[i].f_car = clamp(261.626f * powf(2.0f, fcar_sig), 1.f, 3000.f);
-  
-    // no local controls for the frequency of the modulating signal, so just 
-    // respond to the global control values
-    gos[i].f_mod = clamp(261.626f * powf(2.0f, g_fmod_sig), 1.f, 3000.f);
-  
-    imod_sig = dsp::quadraticBipolar((inputs[IMOD_INPUT + i].getVoltage() / 5.f) * params[IMODCV_PARAM + i].getValue());
-    imod_sig += g_imod_sig; 
-    imod_sig += params[IMOD_PARAM].getValue();
-    gos[i].i_mod = rescale(imod_sig, 0.f, 1.f, 10.f, 3000.f);
+  // per oscillator switches, the same for every voice. The expanders
+  // light their own
+  for (int k=0; k<num_banks * 4; k++) {
+    if (k < NUM_OSCS) lights[ONOFF_LIGHT + k].setBrightness(k < curr_num_oscs ? 1.0f : 0.0f);
+    stutters[k] = (int) bankParam(k / 4, ST_PARAM, k % 4);
   }
+  sendLights();
+
+  float freq[MAX_OSCS];
+  float grat[MAX_OSCS];
+  float fcar[MAX_OSCS];
+  float imod[MAX_OSCS];
+
+  for (int c=0; c<channels; c++) {
+    // voices whose active oscillator was switched off move on to the
+    // first
+    voices[c].limit(curr_num_oscs, stutters);
+
+    // read in global controls
+    g_freq_sig = params[G_FREQ_PARAM].getValue();
+    g_bpts_sig = params[G_BPTS_PARAM].getValue();
+    g_astp_sig = params[G_ASTP_PARAM].getValue();
+    g_dstp_sig = params[G_DSTP_PARAM].getValue();
+    g_grat_sig = params[G_GRAT_PARAM].getValue();
+
+    g_fcar_sig = params[G_FCAR_PARAM].getValue();
+    g_fmod_sig = params[G_FMOD_PARAM].getValue();
+    g_imod_sig = params[G_IMOD_PARAM].getValue();
+
+    g_freq_sig = (inputs[G_FREQ_INPUT].getPolyVoltage(c) / 5.f) * params[G_FREQCV_PARAM].getValue();
+    g_bpts_sig = (inputs[G_BPTS_INPUT].getPolyVoltage(c) / 5.f) * params[G_BPTSCV_PARAM].getValue();
+    g_astp_sig = (inputs[G_ASTP_INPUT].getPolyVoltage(c) / 5.f) * params[G_ASTPCV_PARAM].getValue();
+    g_dstp_sig = (inputs[G_DSTP_INPUT].getPolyVoltage(c) / 5.f) * params[G_DSTPCV_PARAM].getValue();
+    g_grat_sig = (inputs[G_GRAT_INPUT].getPolyVoltage(c) / 5.f) * params[G_GRATCV_PARAM].getValue();
+
+    g_fcar_sig += (inputs[G_FCAR_INPUT].getPolyVoltage(c) / 5.f) * params[G_FCARCV_PARAM].getValue();
+    g_fmod_sig += (inputs[G_FMOD_INPUT].getPolyVoltage(c) / 5.f) * params[G_FMODCV_PARAM].getValue();
+    g_imod_sig += (inputs[G_IMOD_INPUT].getPolyVoltage(c) / 5.f) * params[G_IMODCV_PARAM].getValue();
+
+    // read in all the parameters for each oscillator
+    for (int k=0; k<active_banks * 4; k++) {
+      int b = k / 4;
+      int j = k % 4;
+      GendyOscillator4 &bank = voices[c].banks[b];
+
+      // accept modulation of signal inputs for each parameter
+      freq_sig = (bankInput(b, F_INPUT, j, c) / 5.f) * bankParam(b, FCV_PARAM, j);
+      freq_sig += g_freq_sig;
+      freq_sig += bankParam(b, F_PARAM, j);
+      freq[k] = clamp(261.626f * dspmath::exp2(freq_sig), 1.f, 3000.f);
+
+      bpts_sig = 5.f * dsp::quadraticBipolar((bankInput(b, B_INPUT, j, c) / 5.f) * bankParam(b, BCV_PARAM, j));
+      bpts_sig += g_bpts_sig;
+      bank.num_bpts[j] = clamp((int) bankParam(b, B_PARAM, j) + (int) bpts_sig, 2, MAX_BPTS);
+
+      astp_sig = dsp::quadraticBipolar((bankInput(b, A_INPUT, j, c) / 5.f) * bankParam(b, ACV_PARAM, j));
+      astp_sig += g_astp_sig;
+      bank.max_amp_step[j] = rescale(bankParam(b, A_PARAM, j) + (astp_sig / 4.f), 0.0, 1.0, 0.05, 0.3);
+
+      dstp_sig = dsp::quadraticBipolar((bankInput(b, D_INPUT, j, c) / 5.f) * bankParam(b, DCV_PARAM, j));
+      dstp_sig += g_dstp_sig;
+      bank.max_dur_step[j] = rescale(bankParam(b, D_PARAM, j) + (dstp_sig / 4.f), 0.0, 1.0, 0.01, 0.3);
+
+      grat_sig = (bankInput(b, G_INPUT, j, c) / 5.f) * bankParam(b, GCV_PARAM, j);
+      grat[k] = clamp(261.626f * dspmath::exp2(grat_sig + g_grat_sig), 1e-6, 3000.f);
+
+      // fm control sigs
+      fcar_sig = g_grat_sig;
+      fcar_sig += g_fcar_sig;
+      fcar_sig += bankParam(b, FCAR_PARAM, j);
+      fcar[k] = clamp(261.626f * dspmath::exp2(fcar_sig), 1.f, 3000.f);
+
+      imod_sig = dsp::quadraticBipolar((bankInput(b, IMOD_INPUT, j, c) / 5.f) * bankParam(b, IMODCV_PARAM, j));
+      imod_sig += g_imod_sig;
+      imod_sig += bankParam(b, IMOD_PARAM, j);
+      imod[k] = rescale(imod_sig, 0.f, 1.f, 10.f, 3000.f);
+    }
 
-  if (is_swapping) {
-    amp_out = ((1.0 - phase) * amp) + (phase * amp_next); 
-    phase += speed;
-    
-    if (phase >= 1.0) is_swapping = false;
-  } else {
-    
-    gos[osc_idx].process(deltaTime);
-    amp_out = gos[osc_idx].out();
-    
-    if (gos[osc_idx].last_flag) {
-      current_stutter--;
-      if (current_stutter < 1) {
-        amp = amp_out;
-        speed = gos[osc_idx].speed;
-        osc_idx = (osc_idx + 1) % curr_num_oscs;
-        
-
-        gos[osc_idx].process(deltaTime);
-        amp_next = gos[osc_idx].out();  
-       
-        current_stutter = stutters[osc_idx];
-
-        phase = 0.f;
-        is_swapping = true;
-      }
+    // no local controls for the frequency of the modulating signal, so
+    // just respond to the global control values
+    float fmod = clamp(261.626f * dspmath::exp2(g_fmod_sig), 1.f, 3000.f);
+
+    for (int b=0; b<active_banks; b++) {
+      voices[c].banks[b].setMode(g_is_mirroring, g_is_fm_on, g_dt);
+
+      freq_ramp[c][b].setTarget(simd::float_4::load(&freq[b * 4]));
+      grat_ramp[c][b].setTarget(simd::float_4::load(&grat[b * 4]));
+      fcar_ramp[c][b].setTarget(simd::float_4::load(&fcar[b * 4]));
+      fmod_ramp[c][b].setTarget(fmod);
+      imod_ramp[c][b].setTarget(simd::float_4::load(&imod[b * 4]));
     }
   }
-  
-  outputs[SINE_OUTPUT].setVoltage(5.0f * amp_out);
+}
+
+/*
+ * Restart the stitching and every oscillator's walk from the current
+ * seed. Oscillator k of voice c gets stream c * MAX_OSCS + k
+ */
+void Stitcher::reseed() {
+  for (int c=0; c<16; c++) voices[c].reset(seed, c * MAX_OSCS);
+}
+
+/*
+ * Save the oscillators' walks and where the stitch is, a reloaded patch
+ * continues mid cycle. Only the voices and banks in use are saved, the
+ * rest start over from the seed when loaded
+ */
+json_t *Stitcher::dataToJson() {
+  int nc = channels;
+  int nb = active_banks;
+
+  StateWriter w;
+  w.header(STITCHER_STATE);
+  w.put<int32_t>(seed);
+  w.put<int32_t>(nc);
+  w.put<int32_t>(nb);
+  for (int c=0; c<nc; c++) {
+    for (int b=0; b<nb; b++) voices[c].banks[b].save(w);
+  }
+
+  for (int c=0; c<nc; c++) w.put(voices[c].osc_idx);
+  for (int c=0; c<nc; c++) w.put(voices[c].from_idx);
+  for (int c=0; c<nc; c++) w.put(voices[c].current_stutter);
+  for (int c=0; c<nc; c++) w.put(voices[c].xfade);
+  w.put<int32_t>(STITCH_LOOKAHEAD);
+  for (int c=0; c<nc; c++) w.putArray(&voices[c].history[0][0], nb * STITCH_LOOKAHEAD);
+  for (int c=0; c<nc; c++) w.put(voices[c].history_pos);
+
+  json_t *rootJ = json_object();
+  json_object_set_new(rootJ, "state", w.toJson());
+  return rootJ;
+}
+
+void Stitcher::dataFromJson(json_t *rootJ) {
+  std::vector<uint8_t> data;
+  if (!stateFromJson(json_object_get(rootJ, "state"), data)) return;
+
+  StateReader r(data.data(), data.size());
+
+  // older versions saved a single voice, versions 4 and 5 every voice
+  // and bank
+  if (r.header(STITCHER_STATE) && r.version >= 4) {
+    int saved_seed = r.get<int32_t>();
+    int nc = r.version >= 6 ? r.get<int32_t>() : 16;
+    int nb = r.get<int32_t>();
+    if (nc < 1 || nc > 16 || nb < 1 || nb > STITCHER_MAX_BANKS) r.ok = false;
+    if (!r.ok) nc = nb = 0;
+
+    // whatever isn't saved starts over, as it would after a reseed
+    for (int c=0; c<16; c++) voices[c].reset(saved_seed, c * MAX_OSCS);
+
+    for (int c=0; c<nc; c++) {
+      for (int b=0; b<nb; b++) voices[c].banks[b].load(r);
+    }
+
+    for (int c=0; c<nc; c++) r.get(voices[c].osc_idx);
+    for (int c=0; c<nc; c++) r.get(voices[c].from_idx);
+    for (int c=0; c<nc; c++) r.get(voices[c].current_stutter);
+    for (int c=0; c<nc; c++) r.get(voices[c].xfade);
+    if (r.get<int32_t>() != STITCH_LOOKAHEAD) r.ok = false;
+    for (int c=0; c<nc; c++) r.getArray(&voices[c].history[0][0], nb * STITCH_LOOKAHEAD);
+    for (int c=0; c<nc; c++) r.get(voices[c].history_pos);
+
+    for (int c=0; c<nc; c++) {
+      StitchVoice &v = voices[c];
+      v.osc_idx = clamp(v.osc_idx, 0, nb * NUM_OSCS - 1);
+      v.from_idx = clamp(v.from_idx, 0, nb * NUM_OSCS - 1);
+      v.history_pos &= STITCH_LOOKAHEAD - 1;
+      v.resetBleps();
+    }
+
+    // the seed param is already restored, matching it skips the reseed
+    if (r.ok) {
+      seed = saved_seed;
+      return;
+    }
+  }
+
+  WARN("Stitcher: could not restore saved state, reseeding");
+  seed = -1;
 }
 
 struct StitcherWidget : ModuleWidget {
@@ -378,6 +644,17 @@ struct StitcherWidget : ModuleWidget {
 		
     addOutput(createOutput<PJ301MPort>(Vec(278.140, 347.50), module, Stitcher::SINE_OUTPUT));
   }
+
+  void appendContextMenu(Menu *menu) override {
+    Stitcher *module = dynamic_cast<Stitcher*>(this->module);
+    if (!module) return;
+
+    appendDistMenu(menu, module);
+    appendOversampleMenu(menu, module);
+    appendSeedMenu(menu, module);
+    appendRecordMenu(menu, module, Stitcher::SINE_OUTPUT);
+    appendTimingMenu(menu, module);
+  }
 };
 
 Model *modelStitcher = createModel<Stitcher, StitcherWidget>("Stitcher");
@@ -0,0 +1,115 @@
+/*
+ * StitcherExpander.cpp
+ * Samuel Laing - 2019
+ *
+ * Panel of four more oscillators for a Stitcher, see
+ * StitcherExpander.hpp
+ */
+
+#include "StitcherExpander.hpp"
+
+void StitcherExpander::process(const ProcessArgs &args) {
+  if (!divider.process()) return;
+
+  sendControls();
+  sendLights();
+
+  // the Stitcher lights the oscillators it uses, nothing is in use
+  // when it isn't there
+  StitcherLightsMessage *msg = (StitcherLightsMessage*) leftExpander.consumerMessage;
+  bool attached = isAttached();
+  for (int i=0; i<4; i++) {
+    bool on = attached && msg->bank * 4 + i < msg->num_oscs;
+    lights[ONOFF_LIGHT + i].setBrightness(on ? 1.f : 0.f);
+  }
+}
+
+/*
+ * Copy this panel's controls, followed by those forwarded from the
+ * expanders to the right, into the left neighbour's message
+ */
+void StitcherExpander::sendControls() {
+  Module *left = leftExpander.module;
+  if (!left || (left->model != modelStitcher && left->model != modelStitcherExpander)) return;
+
+  StitcherControlsMessage *out = (StitcherControlsMessage*) left->rightExpander.producerMessage;
+  StitcherControlsMessage *in = (StitcherControlsMessage*) rightExpander.consumerMessage;
+
+  bool chained = rightExpander.module && rightExpander.module->model == modelStitcherExpander;
+  int forward = chained ? std::min(in->num_banks, STITCHER_MAX_BANKS - 2) : 0;
+
+  StitcherBankControls &bank = out->banks[0];
+  out->channels = chained ? in->channels : 1;
+
+  for (int i=0; i<NUM_PARAMS; i++) bank.params[i] = params[i].getValue();
+
+  for (int i=0; i<NUM_INPUTS; i++) {
+    int n = inputs[i].getChannels();
+    bank.channels[i] = n;
+    for (int c=0; c<std::max(n, 1); c++) bank.voltages[i][c] = inputs[i].getVoltage(c);
+    out->channels = std::max(out->channels, n);
+  }
+
+  std::copy(in->banks, in->banks + forward, out->banks + 1);
+  out->num_banks = 1 + forward;
+
+  left->rightExpander.messageFlipRequested = true;
+}
+
+/*
+ * Pass the oscillators in use on to the expander to the right
+ */
+void StitcherExpander::sendLights() {
+  Module *right = rightExpander.module;
+  if (!right || right->model != modelStitcherExpander) return;
+
+  StitcherLightsMessage *in = (StitcherLightsMessage*) leftExpander.consumerMessage;
+  StitcherLightsMessage *out = (StitcherLightsMessage*) right->leftExpander.producerMessage;
+  out->bank = in->bank + 1;
+  out->num_oscs = in->num_oscs;
+
+  right->leftExpander.messageFlipRequested = true;
+}
+
+struct StitcherExpanderWidget : ModuleWidget {
+	StitcherExpanderWidget(StitcherExpander *module) {
+    setModule(module);
+    setPanel(APP->window->loadSvg(asset::plugin(pluginInstance, "res/StitcherExpander.svg")));
+
+    // same layout as the Stitcher's own oscillators
+    for (int i = 0; i < 4; i++) {
+      addParam(createParam<RoundSmallBlackKnob>(Vec(10.004, 15.89+(i*95)), module, StitcherExpander::F_PARAM + i));
+      addParam(createParam<RoundSmallBlackKnob>(Vec(36.004, 15.89+(i*95)), module, StitcherExpander::B_PARAM + i));
+
+      addParam(createParam<RoundSmallBlackKnob>(Vec(62.004, 15.89+(i*95)), module, StitcherExpander::A_PARAM + i));
+      addParam(createParam<RoundSmallBlackKnob>(Vec(88.004, 15.89+(i*95)), module, StitcherExpander::D_PARAM + i));
+
+      addParam(createParam<RoundSmallBlackKnob>(Vec(114.004, 15.89+(i*95)), module, StitcherExpander::G_PARAM + i));
+
+      addParam(createParam<RoundSmallBlackKnob>(Vec(10.004, 41.89+(i*95)), module, StitcherExpander::FCV_PARAM + i));
+      addParam(createParam<RoundSmallBlackKnob>(Vec(36.004, 41.89+(i*95)), module, StitcherExpander::BCV_PARAM + i));
+
+      addParam(createParam<RoundSmallBlackKnob>(Vec(62.004, 41.89+(i*95)), module, StitcherExpander::ACV_PARAM + i));
+      addParam(createParam<RoundSmallBlackKnob>(Vec(88.004, 41.89+(i*95)), module, StitcherExpander::DCV_PARAM + i));
+
+      addParam(createParam<RoundSmallBlackKnob>(Vec(114.004, 41.89+(i*95)), module, StitcherExpander::GCV_PARAM + i));
+
+      // stutter param
+      addParam(createParam<RoundBlackSnapKnob>(Vec(149.640, 28.57+(i*95)), module, StitcherExpander::ST_PARAM + i));
+
+      // CV inputs
+      addInput(createInput<PJ301MPort>(Vec(10.004, 69.39+(i*95)), module, StitcherExpander::F_INPUT + i));
+      addInput(createInput<PJ301MPort>(Vec(36.004, 69.39+(i*95)), module, StitcherExpander::B_INPUT + i));
+
+      addInput(createInput<PJ301MPort>(Vec(62.004, 69.39+(i*95)), module, StitcherExpander::A_INPUT + i));
+      addInput(createInput<PJ301MPort>(Vec(88.004, 69.39+(i*95)), module, StitcherExpander::D_INPUT + i));
+
+      addInput(createInput<PJ301MPort>(Vec(114.004, 69.39+(i*95)), module, StitcherExpander::G_INPUT + i));
+
+      // light to signal if oscillator on / off
+		  addChild(createLight<SmallLight<GreenLight>>(Vec(149.185, 80+(i*95)), module, StitcherExpander::ONOFF_LIGHT + i));
+    }
+  }
+};
+
+Model *modelStitcherExpander = createModel<StitcherExpander, StitcherExpanderWidget>("StitcherExpander");
@@ -0,0 +1,160 @@
+/*
+ * StitcherExpander.hpp
+ * Samuel Laing - 2019
+ *
+ * Expander adding four more oscillators to a Stitcher. Placed to the
+ * right of a Stitcher, or of another expander, up to STITCHER_MAX_BANKS
+ * banks in total. It holds only controls, the oscillators themselves
+ * run inside the Stitcher.
+ *
+ * Modules next to each other only talk through Rack's expander
+ * messages. Every control tick an expander copies its params and
+ * inputs, and those of the expanders to its right, into its left
+ * neighbour's rightExpander message, so the Stitcher reads the whole
+ * chain from its own. The Stitcher sends the number of oscillators in
+ * use back to the right the same way, and each expander sets its own
+ * lights from it.
+ */
+
+#ifndef __STITCHEREXPANDER_HPP__
+#define __STITCHEREXPANDER_HPP__
+
+#include "plugin.hpp"
+
+#include "Stitch.hpp"
+#include "ControlRate.hpp"
+
+/*
+ * Copy of one expander's controls, taken at control rate
+ */
+struct StitcherBankControls {
+  float params[17 * 4];
+  int channels[8 * 4];
+  float voltages[8 * 4][16];
+
+  float getParam(int id) {
+    return params[id];
+  }
+
+  // same as Input::getPolyVoltage, only the connected channels are
+  // copied
+  float getPolyVoltage(int id, int c) {
+    if (channels[id] <= 1) return voltages[id][0];
+    return c < channels[id] ? voltages[id][c] : 0.f;
+  }
+};
+
+/*
+ * Sent to the left, the controls of every expander from the sender on
+ */
+struct StitcherControlsMessage {
+  int num_banks = 0;
+  // the widest polyphonic input among them
+  int channels = 1;
+  StitcherBankControls banks[STITCHER_MAX_BANKS - 1];
+};
+
+/*
+ * Sent to the right, which bank the receiver is and how many
+ * oscillators the Stitcher runs
+ */
+struct StitcherLightsMessage {
+  int bank = 0;
+  int num_oscs = 0;
+};
+
+struct StitcherExpander : Module {
+  // the per oscillator blocks of the Stitcher's enums, in the same order
+	enum ParamIds {
+    ENUMS(F_PARAM, 4),
+    ENUMS(B_PARAM, 4),
+    ENUMS(A_PARAM, 4),
+    ENUMS(D_PARAM, 4),
+    ENUMS(G_PARAM, 4),
+    ENUMS(FCAR_PARAM, 4),
+    ENUMS(FMOD_PARAM, 4),
+    ENUMS(IMOD_PARAM, 4),
+    ENUMS(FCARCV_PARAM, 4),
+    ENUMS(FMODCV_PARAM, 4),
+    ENUMS(IMODCV_PARAM, 4),
+    ENUMS(FCV_PARAM, 4),
+    ENUMS(BCV_PARAM, 4),
+    ENUMS(ACV_PARAM, 4),
+    ENUMS(DCV_PARAM, 4),
+    ENUMS(GCV_PARAM, 4),
+    ENUMS(ST_PARAM, 4),
+    NUM_PARAMS
+	};
+	enum InputIds {
+		ENUMS(F_INPUT, 4),
+    ENUMS(B_INPUT, 4),
+    ENUMS(A_INPUT, 4),
+    ENUMS(D_INPUT, 4),
+    ENUMS(G_INPUT, 4),
+    ENUMS(FCAR_INPUT, 4),
+    ENUMS(FMOD_INPUT, 4),
+    ENUMS(IMOD_INPUT, 4),
+    NUM_INPUTS
+	};
+	enum OutputIds {
+		NUM_OUTPUTS
+	};
+	enum LightIds {
+    ENUMS(ONOFF_LIGHT, 4),
+		NUM_LIGHTS
+	};
+
+  dsp::ClockDivider divider;
+
+  // controls of the expanders to the right, and lights from the left
+  StitcherControlsMessage controls[2];
+  StitcherLightsMessage in_use[2];
+
+  StitcherExpander() {
+    config(NUM_PARAMS, NUM_INPUTS, NUM_OUTPUTS, NUM_LIGHTS);
+
+    rightExpander.producerMessage = &controls[0];
+    rightExpander.consumerMessage = &controls[1];
+    leftExpander.producerMessage = &in_use[0];
+    leftExpander.consumerMessage = &in_use[1];
+
+    for (int i = 0; i < 4; i++) {
+      configParam(F_PARAM + i, -4.f, 4.f, 0.f);
+      configParam(B_PARAM + i, 3.f, MAX_BPTS, 0.f);
+      configParam(A_PARAM + i, 0.f, 1.f, 0.f);
+      configParam(D_PARAM + i, 0.f, 1.f, 0.f);
+      configParam(G_PARAM + i, 0.7, 1.3, 0.0);
+      configParam(FCV_PARAM + i, 0.f, 1.f, 0.f);
+      configParam(BCV_PARAM + i, 0.f, 1.f, 0.f);
+      configParam(ACV_PARAM + i, 0.f, 1.f, 0.f);
+      configParam(DCV_PARAM + i, 0.f, 1.f, 0.f);
+      configParam(GCV_PARAM + i, 0.f, 1.f, 0.f);
+      configParam(ST_PARAM + i, 1.f, 5.f, 5.f);
+    }
+
+    divider.setDivision(CONTROL_RATE_DIVISION);
+  }
+
+  void process(const ProcessArgs &args) override;
+  void sendControls();
+  void sendLights();
+
+  /*
+   * True when there is a Stitcher at the left end of the chain of
+   * expanders this one is in, and this one is within reach of it
+   */
+  bool isAttached() {
+    Module *m = leftExpander.module;
+    for (int bank=1; m && bank<STITCHER_MAX_BANKS; bank++) {
+      if (m->model == modelStitcher) return true;
+      if (m->model != modelStitcherExpander) return false;
+      m = m->leftExpander.module;
+    }
+    return false;
+  }
+};
+
+static_assert(sizeof(StitcherBankControls::params) / sizeof(float) == StitcherExpander::NUM_PARAMS, "expander params out of step");
+static_assert(sizeof(StitcherBankControls::channels) / sizeof(int) == StitcherExpander::NUM_INPUTS, "expander inputs out of step");
+
+#endif
@@ -1,13 +1,44 @@
+/*
+ * StochStepper.cpp
+ * Samuel Laing - 2019
+ *
+ * VCV Rack Module with up to 16 channels of stochastic CV, a random
+ * walk of breakpoints per channel
+ *
+ */
+
 #include "plugin.hpp"
 #include "dsp/digital.hpp"
 
+#include "StepWalk.hpp"
+#include "ControlRate.hpp"
+#include "SeedMenu.hpp"
+#include "DistMenu.hpp"
+#include "RecordMenu.hpp"
+#include "TimingMenu.hpp"
+
 struct StochStepper : Module {
 	enum ParamIds {
     STEP_PARAM,
+    FREQ_PARAM,
+    FREQCV_PARAM,
+    BPTS_PARAM,
+    ASTP_PARAM,
+    ASTPCV_PARAM,
+    DSTP_PARAM,
+    DSTPCV_PARAM,
+    PDST_PARAM,
+    MIRR_PARAM,
+    CHAN_PARAM,
+    SEED_PARAM,
+    XDST_PARAM,
     NUM_PARAMS
 	};
 	enum InputIds {
-    STEP_INPUT, 
+    STEP_INPUT,
+    FREQ_INPUT,
+    ASTP_INPUT,
+    DSTP_INPUT,
     NUM_INPUTS
 	};
 	enum OutputIds {
@@ -18,78 +49,247 @@ struct StochStepper : Module {
 		NUM_LIGHTS
 	};
 
-	//float phase = 1.0;
-	float blinkPhase = 0.0;
+  // up to 16 channels, four per SIMD walk
+  StepWalk4 walks[4];
+  dsp::SchmittTrigger stepTriggers[16];
+  int channels = 1;
 
-  enum StepTypes {
-    STEP,
-    RAMP,
-    EXP 
-  };
+  // seed the walks were last seeded with, -1 forces a reseed
+  int seed = -1;
 
-  dsp::SchmittTrigger stepTrigger;
+  // params are read at control rate, the rate is ramped per sample
+  ControlRate control;
+  TParamRamp<simd::float_4> freq_ramp[4];
 
-  float amp = 0.f;
-  float amp_next = 0.f;
-  float amp_out = 0.f;
+  // the distribution from the panel switch or the menu
+  DistSelect dist;
 
-  StepTypes t_step = STEP;
+  Recorder recorder;
+  ProcessTimer timer;
 
   StochStepper() {
     config(NUM_PARAMS, NUM_INPUTS, NUM_OUTPUTS, NUM_LIGHTS);
     configParam(STEP_PARAM, 0.0f, 2.0f, 0.0f);
-    // configParam(FREQ_PARAM, -1.0, 1.0, 0.0);
+    configParam(FREQ_PARAM, -4.f, 4.f, 0.f);
+    configParam(FREQCV_PARAM, 0.f, 1.f, 0.f);
+    configParam(BPTS_PARAM, 2, MAX_BPTS, 8);
+    configParam(ASTP_PARAM, 0.f, 1.f, 0.f);
+    configParam(ASTPCV_PARAM, 0.f, 1.f, 0.f);
+    configParam(DSTP_PARAM, 0.f, 1.f, 0.f);
+    configParam(DSTPCV_PARAM, 0.f, 1.f, 0.f);
+    configParam(PDST_PARAM, 0.f, 2.f, 0.f);
+    configParam(XDST_PARAM, 0.f, NUM_DISTS - 1, 0.f, "Distribution");
+    configParam(MIRR_PARAM, 0.f, 1.f, 0.f);
+    configParam(CHAN_PARAM, 1.f, 16.f, 1.f, "Channels");
+    configParam(SEED_PARAM, 0.f, MAX_SEED, 0.f, "Random seed");
   }
 
   void process(const ProcessArgs &args) override;
-  float wrap(float,float,float);
+  void processControls();
+  void reseed();
+
+  json_t *dataToJson() override;
+  void dataFromJson(json_t *rootJ) override;
 };
 
 void StochStepper::process(const ProcessArgs &args) {
-  // Implement a simple sine oscillator
-  //float deltaTime = args.sampleTime;
- 
-  t_step = (StepTypes) params[STEP_PARAM].getValue();
-
-  if (stepTrigger.process(inputs[STEP_INPUT].getVoltage() / 2.f)) {
-    // handle the next amplitude generation here using the 
-    // different probability distributions
+  float deltaTime = args.sampleTime;
+
+  timer.begin();
+
+  if (control.process()) {
+    timer.mark(TIMING_CONTROL);
+    processControls();
+  }
+
+  for (int c=0; c<channels; c+=4) {
+    StepWalk4 &walk = walks[c / 4];
+
+    // a mono clock steps every channel at once
+    int triggers = 0;
+    if (walk.clocked) {
+      for (int i=0; i<4; i++) {
+        if (stepTriggers[c + i].process(inputs[STEP_INPUT].getPolyVoltage(c + i) / 2.f)) triggers |= 1 << i;
+      }
+    }
+
+    walk.freq = freq_ramp[c / 4].process();
+    walk.process(deltaTime, triggers);
+    if (walk.step_flag) timer.mark(TIMING_BREAKPOINT);
+
+    outputs[STOC_OUTPUT].setVoltageSimd(5.0f * walk.out(), c);
+  }
+
+  outputs[STOC_OUTPUT].setChannels(channels);
+
+  if (recorder.active) recorder.push(outputs[STOC_OUTPUT].voltages);
+
+  timer.end();
+}
+
+/*
+ * Read every param and CV input, called once per CONTROL_RATE_DIVISION
+ * samples
+ */
+void StochStepper::processControls() {
+  using simd::float_4;
+
+  // as many channels as picked in the menu, or as the widest input
+  channels = clamp((int) params[CHAN_PARAM].getValue(), 1, 16);
+  for (int i=0; i<NUM_INPUTS; i++) {
+    channels = std::max(channels, inputs[i].getChannels());
   }
- 
-  switch (t_step) {
-    case STEP:
-      break;
-    case RAMP:
-      break;
-    case EXP:
-      break;
-    default:
-      break;
+
+  int new_seed = (int) params[SEED_PARAM].getValue();
+  if (new_seed != seed) {
+    timer.mark(TIMING_RESET);
+    seed = new_seed;
+    reseed();
+  }
+
+  StepType step_type = (StepType) clamp((int) roundf(params[STEP_PARAM].getValue()), 0, NUM_STEP_TYPES - 1);
+  bool is_mirroring = (int) params[MIRR_PARAM].getValue();
+  DistType dt = dist.process(params[PDST_PARAM], params[XDST_PARAM]);
+  bool clocked = inputs[STEP_INPUT].isConnected();
+  int bpts = clamp((int) params[BPTS_PARAM].getValue(), 2, MAX_BPTS);
+
+  for (int c=0; c<channels; c+=4) {
+    StepWalk4 &walk = walks[c / 4];
+
+    walk.step_type = step_type;
+    walk.is_mirroring = is_mirroring;
+    walk.dt = dt;
+    walk.clocked = clocked;
+
+    float_4 astp_sig = dsp::quadraticBipolar((inputs[ASTP_INPUT].getPolyVoltageSimd<float_4>(c) / 5.f) * params[ASTPCV_PARAM].getValue());
+    float_4 dstp_sig = dsp::quadraticBipolar((inputs[DSTP_INPUT].getPolyVoltageSimd<float_4>(c) / 5.f) * params[DSTPCV_PARAM].getValue());
+
+    float_4 max_amp_step = simd::rescale(params[ASTP_PARAM].getValue() + (astp_sig / 4.f), 0.0, 1.0, 0.05, 0.5);
+    float_4 max_dur_step = simd::rescale(params[DSTP_PARAM].getValue() + (dstp_sig / 4.f), 0.0, 1.0, 0.01, 0.3);
+
+    for (int i=0; i<4; i++) {
+      walk.num_bpts[i] = bpts;
+      walk.max_amp_step[i] = max_amp_step[i];
+      walk.max_dur_step[i] = max_dur_step[i];
+    }
+
+    // 1V/oct around 2 steps per second
+    float_4 freq_sig = params[FREQ_PARAM].getValue() + inputs[FREQ_INPUT].getPolyVoltageSimd<float_4>(c) * params[FREQCV_PARAM].getValue();
+    freq_ramp[c / 4].setTarget(simd::clamp(2.f * dspmath::exp2(freq_sig), 0.01f, 1000.f));
   }
-  // continue with interpolation if not doing ramp
+}
 
-  outputs[STOC_OUTPUT].setVoltage(5.0f);
+/*
+ * Restart every channel's walk from the current seed, channel c gets
+ * stream c
+ */
+void StochStepper::reseed() {
+  for (int b=0; b<4; b++) {
+    walks[b].reset();
+    for (int i=0; i<4; i++) walks[b].seed(i, streamSeed(seed, b * 4 + i));
+  }
 }
 
+json_t *StochStepper::dataToJson() {
+  StateWriter w;
+  w.header(STEPPER_STATE);
+  w.put<int32_t>(seed);
+  for (int b=0; b<4; b++) walks[b].save(w);
+
+  json_t *rootJ = json_object();
+  json_object_set_new(rootJ, "state", w.toJson());
+  return rootJ;
+}
+
+void StochStepper::dataFromJson(json_t *rootJ) {
+  std::vector<uint8_t> data;
+  if (!stateFromJson(json_object_get(rootJ, "state"), data)) return;
+
+  StateReader r(data.data(), data.size());
+  if (r.header(STEPPER_STATE)) {
+    int saved_seed = r.get<int32_t>();
+    for (int b=0; b<4; b++) walks[b].load(r);
+
+    // the seed param is already restored, matching it skips the reseed
+    if (r.ok) {
+      seed = saved_seed;
+      return;
+    }
+  }
+
+  WARN("StochStepper: could not restore saved state, reseeding");
+  seed = -1;
+}
+
+struct ChannelsItem : MenuItem {
+  StochStepper *module;
+  int channels;
+
+  void onAction(const event::Action &e) override {
+    module->params[StochStepper::CHAN_PARAM].setValue(channels);
+  }
+};
+
 struct StochStepperWidget : ModuleWidget {
 	StochStepperWidget(StochStepper *module) {
     setModule(module);
     setPanel(APP->window->loadSvg(asset::plugin(pluginInstance, "res/StochStepper.svg")));
 
     addChild(createWidget<ScrewSilver>(Vec(RACK_GRID_WIDTH, 0)));
-		addChild(createWidget<ScrewSilver>(Vec(box.size.x - 6 * RACK_GRID_WIDTH, 0)));
+		addChild(createWidget<ScrewSilver>(Vec(box.size.x - 2 * RACK_GRID_WIDTH, 0)));
 		addChild(createWidget<ScrewSilver>(Vec(RACK_GRID_WIDTH, RACK_GRID_HEIGHT - RACK_GRID_WIDTH)));
-		addChild(createWidget<ScrewSilver>(Vec(box.size.x - 6 * RACK_GRID_WIDTH, RACK_GRID_HEIGHT - RACK_GRID_WIDTH)));
+		addChild(createWidget<ScrewSilver>(Vec(box.size.x - 2 * RACK_GRID_WIDTH, RACK_GRID_HEIGHT - RACK_GRID_WIDTH)));
+
+    // knob params
+    addParam(createParam<RoundLargeBlackKnob>(Vec(36.307, 50.42), module, StochStepper::FREQ_PARAM));
+    addParam(createParam<RoundSmallBlackKnob>(Vec(61.360, 94.21), module, StochStepper::FREQCV_PARAM));
 
+    addParam(createParam<RoundLargeBlackKnob>(Vec(104.307, 50.42), module, StochStepper::BPTS_PARAM));
+
+    addParam(createParam<RoundLargeBlackKnob>(Vec(14.307, 145.54), module, StochStepper::DSTP_PARAM));
+    addParam(createParam<RoundSmallBlackKnob>(Vec(39.360, 191.10), module, StochStepper::DSTPCV_PARAM));
+
+    addParam(createParam<RoundLargeBlackKnob>(Vec(84.307, 145.54), module, StochStepper::ASTP_PARAM));
+    addParam(createParam<RoundSmallBlackKnob>(Vec(107.360, 191.10), module, StochStepper::ASTPCV_PARAM));
+
+    addParam(createParam<CKSSThree>(Vec(143.417, 147.64), module, StochStepper::PDST_PARAM));
+    addParam(createParam<CKSS>(Vec(143.379, 202.07), module, StochStepper::MIRR_PARAM));
+
+    // step / ramp / exp
     addParam(createParam<CKSSThree>(Vec(110, 240), module, StochStepper::STEP_PARAM));
-		
-    //addParam(createParam<RoundHugeBlackKnob>(Vec(15, 68), module, StochStepper::FREQ_PARAM));
-   	//addInput(createInput<PJ301MPort>(Vec(76.210, 285.33), module, StochStepper::GRAT_INPUT));
 
-    addOutput(createOutput<PJ301MPort>(Vec(134.003, 334.86), module, StochStepper::STOC_OUTPUT));
+    // signal inputs
+    addInput(createInput<PJ301MPort>(Vec(24.967, 93.61), module, StochStepper::FREQ_INPUT));
+    addInput(createInput<PJ301MPort>(Vec(2.976, 188.72), module, StochStepper::DSTP_INPUT));
+    addInput(createInput<PJ301MPort>(Vec(70.966, 188.72), module, StochStepper::ASTP_INPUT));
+    addInput(createInput<PJ301MPort>(Vec(24.967, 250.50), module, StochStepper::STEP_INPUT));
 
-		//addChild(createWidget<MediumLight<RedLight>>(Vec(41, 59), module, StochStepper::BLINK_LIGHT));
+    // output signal
+    addOutput(createOutput<PJ301MPort>(Vec(134.003, 334.86), module, StochStepper::STOC_OUTPUT));
 	}
+
+  void appendContextMenu(Menu *menu) override {
+    StochStepper *module = dynamic_cast<StochStepper*>(this->module);
+    if (!module) return;
+
+    appendDistMenu(menu, module);
+
+    int channels = (int) module->params[StochStepper::CHAN_PARAM].getValue();
+
+    menu->addChild(new MenuSeparator);
+    menu->addChild(createMenuLabel("Channels"));
+
+    for (int i=1; i<=16; i++) {
+      ChannelsItem *item = createMenuItem<ChannelsItem>(string::f("%d", i), CHECKMARK(channels == i));
+      item->module = module;
+      item->channels = i;
+      menu->addChild(item);
+    }
+
+    appendSeedMenu(menu, module);
+    appendRecordMenu(menu, module, StochStepper::STOC_OUTPUT);
+    appendTimingMenu(menu, module);
+  }
 };
 
 Model *modelStochStepper = createModel<StochStepper, StochStepperWidget>("StochStepper");
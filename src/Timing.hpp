@@ -0,0 +1,182 @@
+/*
+ * Timing.hpp
+ * Samuel Laing - 2019
+ *
+ * Optional instrumentation of a module's process(). Rack's CPU meter
+ * only shows an average, dropouts come from the rare expensive samples.
+ * While enabled every call is timed in CPU cycles and counted into a
+ * histogram for the most expensive thing that happened during it, see
+ * TimingEvent. The audio thread is the only writer and never locks, the
+ * UI reads the counts while they change, so a snapshot may be off by a
+ * sample.
+ */
+
+#ifndef __TIMING_HPP__
+#define __TIMING_HPP__
+
+#include <atomic>
+#include <cstdio>
+#include <string>
+#include <x86intrin.h>
+
+#include "rack.hpp"
+
+// buckets per power of two of the histograms, about 19% apart
+#define TIMING_SUB_BUCKETS 4
+#define TIMING_BUCKETS (64 * TIMING_SUB_BUCKETS)
+
+namespace rack {
+
+  /*
+   * What a sample did besides the usual, ordered from least to most
+   * expensive: a sample doing several things is counted as the last
+   */
+  enum TimingEvent {
+    TIMING_SAMPLE,
+    TIMING_CONTROL,
+    TIMING_SPAN,
+    TIMING_BREAKPOINT,
+    TIMING_SWITCH,
+    TIMING_ENV,
+    TIMING_RESET,
+    NUM_TIMING_EVENTS
+  };
+
+  static const char *TIMING_EVENT_NAMES[NUM_TIMING_EVENTS] = {
+    "sample", "control", "span", "breakpoint", "switch", "env switch", "reset"
+  };
+
+  /*
+   * Log-linear histogram of cycle counts, exact below 8
+   */
+  struct TimingHistogram {
+    std::atomic<uint32_t> counts[TIMING_BUCKETS];
+    std::atomic<uint64_t> total;
+    std::atomic<uint64_t> max;
+
+    TimingHistogram() {
+      clear();
+    }
+
+    void clear() {
+      for (int b=0; b<TIMING_BUCKETS; b++) counts[b].store(0, std::memory_order_relaxed);
+      total.store(0, std::memory_order_relaxed);
+      max.store(0, std::memory_order_relaxed);
+    }
+
+    static int bucketOf(uint64_t cycles) {
+      if (cycles < 8) return (int) cycles;
+      int e = 63 - __builtin_clzll(cycles);
+      return e * TIMING_SUB_BUCKETS + (int) ((cycles >> (e - 2)) & (TIMING_SUB_BUCKETS - 1));
+    }
+
+    /*
+     * Smallest cycle count that lands in bucket b
+     */
+    static uint64_t bucketStart(int b) {
+      int e = b / TIMING_SUB_BUCKETS;
+      if (e < 3) return b;
+      return (uint64_t) (TIMING_SUB_BUCKETS + b % TIMING_SUB_BUCKETS) << (e - 2);
+    }
+
+    /*
+     * Only called from the audio thread, so plain loads and stores do
+     * instead of locked increments
+     */
+    void add(uint64_t cycles) {
+      std::atomic<uint32_t> &c = counts[bucketOf(cycles)];
+      c.store(c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+      total.store(total.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+      if (cycles > max.load(std::memory_order_relaxed)) max.store(cycles, std::memory_order_relaxed);
+    }
+
+    /*
+     * Start of the bucket holding quantile q of the counts
+     */
+    uint64_t quantile(double q) const {
+      uint64_t n = 0;
+      for (int b=0; b<TIMING_BUCKETS; b++) n += counts[b].load(std::memory_order_relaxed);
+      if (n == 0) return 0;
+
+      uint64_t rank = (uint64_t) (q * (n - 1));
+      uint64_t seen = 0;
+      for (int b=0; b<TIMING_BUCKETS; b++) {
+        seen += counts[b].load(std::memory_order_relaxed);
+        if (seen > rank) return bucketStart(b);
+      }
+      return max.load(std::memory_order_relaxed);
+    }
+  };
+
+  struct ProcessTimer {
+    // toggled from the context menu, the only thing checked while off
+    std::atomic<bool> enabled;
+    // set by the UI, the audio thread clears the histograms
+    std::atomic<bool> clear_requested;
+
+    TimingHistogram histograms[NUM_TIMING_EVENTS];
+
+    bool running = false;
+    uint64_t start = 0;
+    int event = TIMING_SAMPLE;
+
+    ProcessTimer() {
+      enabled = false;
+      clear_requested = false;
+    }
+
+    void begin() {
+      running = enabled.load(std::memory_order_relaxed);
+      if (!running) return;
+
+      if (clear_requested.exchange(false)) {
+        for (int e=0; e<NUM_TIMING_EVENTS; e++) histograms[e].clear();
+      }
+
+      event = TIMING_SAMPLE;
+      start = __rdtsc();
+    }
+
+    /*
+     * Tag the sample being timed, cheap enough to call while off
+     */
+    void mark(TimingEvent e) {
+      if (e > event) event = e;
+    }
+
+    void end() {
+      if (running) histograms[event].add(__rdtsc() - start);
+    }
+
+    /*
+     * One line per event, p50 / p99 / max in cycles, then every bucket
+     * that was hit. False if path can't be written
+     */
+    bool exportCsv(const std::string &path) const {
+      FILE *f = fopen(path.c_str(), "w");
+      if (!f) return false;
+
+      fprintf(f, "event,samples,p50,p99,max\n");
+      for (int e=0; e<NUM_TIMING_EVENTS; e++) {
+        const TimingHistogram &h = histograms[e];
+        fprintf(f, "%s,%llu,%llu,%llu,%llu\n", TIMING_EVENT_NAMES[e],
+            (unsigned long long) h.total.load(), (unsigned long long) h.quantile(0.5),
+            (unsigned long long) h.quantile(0.99), (unsigned long long) h.max.load());
+      }
+
+      fprintf(f, "\nevent,from_cycles,to_cycles,samples\n");
+      for (int e=0; e<NUM_TIMING_EVENTS; e++) {
+        for (int b=0; b<TIMING_BUCKETS; b++) {
+          uint32_t n = histograms[e].counts[b].load();
+          if (n == 0) continue;
+          fprintf(f, "%s,%llu,%llu,%u\n", TIMING_EVENT_NAMES[e], (unsigned long long) TimingHistogram::bucketStart(b),
+              (unsigned long long) TimingHistogram::bucketStart(b + 1) - 1, n);
+        }
+      }
+
+      return fclose(f) == 0;
+    }
+  };
+}
+
+#endif
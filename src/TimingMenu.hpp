@@ -0,0 +1,97 @@
+/*
+ * TimingMenu.hpp
+ * Samuel Laing - 2019
+ *
+ * Context menu entries to time a module's process() and show or export
+ * the histograms. A module using it needs a ProcessTimer timer member.
+ */
+
+#ifndef __TIMINGMENU_HPP__
+#define __TIMINGMENU_HPP__
+
+#include "rack.hpp"
+#include "osdialog.h"
+#include "Timing.hpp"
+
+namespace rack {
+
+  template <class TModule>
+  struct TimingEnableItem : MenuItem {
+    TModule *module;
+
+    void onAction(const event::Action &e) override {
+      module->timer.enabled = !module->timer.enabled;
+    }
+  };
+
+  template <class TModule>
+  struct ClearTimingsItem : MenuItem {
+    TModule *module;
+
+    void onAction(const event::Action &e) override {
+      module->timer.clear_requested = true;
+    }
+  };
+
+  template <class TModule>
+  struct ExportTimingsItem : MenuItem {
+    TModule *module;
+
+    void onAction(const event::Action &e) override {
+      osdialog_filters *filters = osdialog_filters_parse("CSV:csv");
+      char *file = osdialog_file(OSDIALOG_SAVE, asset::user("").c_str(), "timings.csv", filters);
+      osdialog_filters_free(filters);
+
+      if (!file) return;
+
+      std::string path = file;
+      free(file);
+      if (string::filenameExtension(string::filename(path)) != "csv") path += ".csv";
+
+      if (!module->timer.exportCsv(path)) WARN("Could not write timings to %s", path.c_str());
+    }
+  };
+
+  /*
+   * Cycle counts in thousands past 10000, they get long
+   */
+  inline std::string formatCycles(uint64_t cycles) {
+    if (cycles < 10000) return string::f("%llu", (unsigned long long) cycles);
+    return string::f("%lluk", (unsigned long long) (cycles / 1000));
+  }
+
+  template <class TModule>
+  void appendTimingMenu(Menu *menu, TModule *module) {
+    ProcessTimer &timer = module->timer;
+
+    menu->addChild(new MenuSeparator);
+
+    TimingEnableItem<TModule> *enableItem = createMenuItem<TimingEnableItem<TModule>>("Time process()", CHECKMARK(timer.enabled));
+    enableItem->module = module;
+    menu->addChild(enableItem);
+
+    bool any = false;
+    for (int e=0; e<NUM_TIMING_EVENTS; e++) {
+      const TimingHistogram &h = timer.histograms[e];
+      uint64_t n = h.total.load();
+      if (n == 0) continue;
+
+      any = true;
+      menu->addChild(createMenuLabel(string::f("%s: p50 %s, p99 %s, max %s cycles (%llu)", TIMING_EVENT_NAMES[e],
+          formatCycles(h.quantile(0.5)).c_str(), formatCycles(h.quantile(0.99)).c_str(),
+          formatCycles(h.max.load()).c_str(), (unsigned long long) n)));
+    }
+
+    if (!any) return;
+
+    ExportTimingsItem<TModule> *exportItem = createMenuItem<ExportTimingsItem<TModule>>("Export timings...");
+    exportItem->module = module;
+    menu->addChild(exportItem);
+
+    ClearTimingsItem<TModule> *clearItem = createMenuItem<ClearTimingsItem<TModule>>("Clear timings");
+    clearItem->module = module;
+    menu->addChild(clearItem);
+  }
+}
+
+#endif
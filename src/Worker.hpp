@@ -0,0 +1,105 @@
+/*
+ * Worker.hpp
+ * Samuel Laing - 2019
+ *
+ * A background thread for the work that must never happen in
+ * process(): allocating buffers, decoding and writing files. Jobs are
+ * posted from the UI or engine threads. The audio thread never posts,
+ * it only publishes requests through atomics and calls wake(), and the
+ * owner's poll callback picks them up.
+ */
+
+#ifndef __WORKER_HPP__
+#define __WORKER_HPP__
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+// upper bound on how late the worker notices a request whose wake() it
+// missed
+#define WORKER_POLL_MS 50
+
+namespace rack {
+
+  struct Worker {
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::function<void()>> jobs;
+    std::function<void()> poll;
+    bool quit = false;
+
+    ~Worker() {
+      stop();
+    }
+
+    /*
+     * p, if given, runs on the worker thread after every batch of jobs
+     * and at least every WORKER_POLL_MS
+     */
+    void start(std::function<void()> p = nullptr) {
+      poll = p;
+      quit = false;
+      thread = std::thread(&Worker::run, this);
+    }
+
+    /*
+     * Finish the job in progress and join, pending jobs are dropped
+     */
+    void stop() {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        quit = true;
+        jobs.clear();
+      }
+      cv.notify_one();
+      if (thread.joinable()) thread.join();
+    }
+
+    void post(std::function<void()> job) {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        jobs.push_back(job);
+      }
+      cv.notify_one();
+    }
+
+    /*
+     * Safe to call from the audio thread, never takes the lock
+     */
+    void wake() {
+      cv.notify_one();
+    }
+
+    void run() {
+      std::unique_lock<std::mutex> lock(mutex);
+
+      while (!quit) {
+        while (!jobs.empty() && !quit) {
+          std::function<void()> job = jobs.front();
+          jobs.pop_front();
+
+          lock.unlock();
+          job();
+          lock.lock();
+        }
+
+        if (quit) break;
+
+        if (poll) {
+          lock.unlock();
+          poll();
+          lock.lock();
+        }
+
+        if (jobs.empty() && !quit) cv.wait_for(lock, std::chrono::milliseconds(WORKER_POLL_MS));
+      }
+    }
+  };
+}
+
+#endif
@@ -0,0 +1,193 @@
+/*
+ * fastmath.hpp
+ * Samuel Laing - 2019
+ *
+ * Fast approximations of the transcendental functions used in the
+ * oscillator cores. Every function is a template that works on both
+ * float and simd::float_4, so the scalar and vectorized oscillators
+ * share the same kernels.
+ *
+ * Code should call these through the dspmath namespace alias at the
+ * bottom of this file. Building with PRECISE_MATH=1 swaps in the libm
+ * versions (stdmath) for comparison.
+ */
+
+#ifndef __FASTMATH_HPP__
+#define __FASTMATH_HPP__
+
+#include "rack.hpp"
+
+namespace rack {
+
+  namespace fastmath {
+
+    /*
+     * 2^n for whole numbers -126 <= n <= 127, built directly from the
+     * float exponent bits
+     */
+    inline float exp2Int(float n) {
+      union { int32_t i; float f; } u;
+      u.i = ((int32_t) n + 127) << 23;
+      return u.f;
+    }
+
+    inline simd::float_4 exp2Int(simd::float_4 n) {
+      __m128i i = _mm_cvttps_epi32(n.v);
+      i = _mm_slli_epi32(_mm_add_epi32(i, _mm_set1_epi32(127)), 23);
+      return simd::float_4(_mm_castsi128_ps(i));
+    }
+
+    /*
+     * 2^x, max relative error 4e-6 over -126 < x < 126. Inputs outside
+     * of that range are clamped
+     */
+    template <typename T>
+    T exp2(T x) {
+      x = simd::fmin(simd::fmax(x, T(-126.f)), T(126.f));
+      T n = simd::floor(x + 0.5f);
+      T f = x - n;
+
+      // taylor series of 2^f for -0.5 <= f <= 0.5
+      T p = 1.3333558e-3f;
+      p = p * f + 9.6181291e-3f;
+      p = p * f + 5.5504109e-2f;
+      p = p * f + 2.4022651e-1f;
+      p = p * f + 6.9314718e-1f;
+      p = p * f + 1.f;
+
+      return p * exp2Int(n);
+    }
+
+    /*
+     * Same as fmod(x, 1.f): the fractional part of x, keeping its sign
+     */
+    inline float fmod1(float x) {
+      return x - (float) (int32_t) x;
+    }
+
+    inline simd::float_4 fmod1(simd::float_4 x) {
+      return x - simd::float_4(_mm_cvtepi32_ps(_mm_cvttps_epi32(x.v)));
+    }
+
+    /*
+     * Same as fmod(x, y) for |x / y| < 2^31
+     */
+    template <typename T>
+    T fmod(T x, float y) {
+      return fmod1(x * (1.f / y)) * y;
+    }
+
+    /*
+     * Wrap a phase into 0 <= x < 1, unlike fmod1 negative phases wrap
+     * around to the top of the cycle
+     */
+    template <typename T>
+    T wrap01(T x) {
+      return x - simd::floor(x);
+    }
+
+    /*
+     * sin(2 pi x) where x is in cycles, max absolute error 4e-6 for any
+     * finite |x| < 2^22
+     */
+    template <typename T>
+    T sin2pi(T x) {
+      // reduce to -0.5 <= x <= 0.5 and fold into -0.25 <= x <= 0.25
+      x -= simd::floor(x + 0.5f);
+      x = simd::ifelse(x > 0.25f, 0.5f - x, x);
+      x = simd::ifelse(x < -0.25f, -0.5f - x, x);
+
+      // taylor series of sin(y) with y = 2 pi x, |y| <= pi / 2
+      T y = x * 6.2831853f;
+      T y2 = y * y;
+      T p = 2.7557319e-6f;
+      p = p * y2 - 1.9841270e-4f;
+      p = p * y2 + 8.3333333e-3f;
+      p = p * y2 - 1.6666667e-1f;
+      p = p * y2 + 1.f;
+      return p * y;
+    }
+
+    /*
+     * sin(x) for x in radians, same error bound as sin2pi
+     */
+    template <typename T>
+    T sin(T x) {
+      return sin2pi(x * 0.15915494f);
+    }
+
+    /*
+     * tan(x) for x in radians, max relative error 1e-5 away from the
+     * poles at pi / 2 + k pi
+     */
+    template <typename T>
+    T tan(T x) {
+      T c = x * 0.15915494f;
+      return sin2pi(c) / sin2pi(c + 0.25f);
+    }
+
+    /*
+     * atan(x), max absolute error 1.2e-5 for all x (Abramowitz & Stegun
+     * 4.4.49)
+     */
+    template <typename T>
+    T atan(T x) {
+      T ax = simd::fabs(x);
+      T inv = ax > 1.f;
+      T z = simd::ifelse(inv, 1.f / ax, ax);
+      T z2 = z * z;
+
+      T p = 0.0208351f;
+      p = p * z2 - 0.0851330f;
+      p = p * z2 + 0.1801410f;
+      p = p * z2 - 0.3302995f;
+      p = p * z2 + 0.9998660f;
+      p = p * z;
+
+      p = simd::ifelse(inv, 1.5707963f - p, p);
+      return simd::ifelse(x < 0.f, -p, p);
+    }
+  }
+
+  /*
+   * Reference implementations with the same interface, using libm
+   */
+  namespace stdmath {
+
+    inline float exp2(float x) { return std::pow(2.f, x); }
+    inline float fmod1(float x) { return std::fmod(x, 1.f); }
+    inline float fmod(float x, float y) { return std::fmod(x, y); }
+    inline float wrap01(float x) { return x - std::floor(x); }
+    inline float sin2pi(float x) { return std::sin(2.f * M_PI * x); }
+    inline float sin(float x) { return std::sin(x); }
+    inline float tan(float x) { return std::tan(x); }
+    inline float atan(float x) { return std::atan(x); }
+
+#define STDMATH_LANEWISE(name) \
+    inline simd::float_4 name(simd::float_4 x) { \
+      return simd::float_4(name(x[0]), name(x[1]), name(x[2]), name(x[3])); \
+    }
+
+    STDMATH_LANEWISE(exp2)
+    STDMATH_LANEWISE(fmod1)
+    STDMATH_LANEWISE(wrap01)
+    STDMATH_LANEWISE(sin2pi)
+    STDMATH_LANEWISE(sin)
+    STDMATH_LANEWISE(tan)
+    STDMATH_LANEWISE(atan)
+
+#undef STDMATH_LANEWISE
+
+    inline simd::float_4 fmod(simd::float_4 x, float y) {
+      return simd::float_4(fmod(x[0], y), fmod(x[1], y), fmod(x[2], y), fmod(x[3], y));
+    }
+  }
+
+#ifdef STOCHKIT_PRECISE_MATH
+  namespace dspmath = stdmath;
+#else
+  namespace dspmath = fastmath;
+#endif
+}
+
+#endif
@@ -1,4 +1,5 @@
 #include "plugin.hpp"
+#include "wavetable.hpp"
 
 Plugin *pluginInstance;
 
@@ -7,8 +8,14 @@ void init(Plugin *p) {
   p->slug = TOSTRING(SLUG);
   p->version = TOSTRING(VERSION);
 
+  // shared read-only lookup tables
+  initDistTables();
+  initWavetables();
+
   // Add all Models defined throughout the plugin
   p->addModel(modelGenEcho);
   p->addModel(modelGrandy);
   p->addModel(modelStitcher);
+  p->addModel(modelStitcherExpander);
+  p->addModel(modelStochStepper);
 }
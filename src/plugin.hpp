@@ -9,3 +9,5 @@ extern Plugin *pluginInstance;
 extern Model *modelGenEcho;
 extern Model *modelGrandy;
 extern Model *modelStitcher;
+extern Model *modelStitcherExpander;
+extern Model *modelStochStepper;
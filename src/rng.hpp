@@ -0,0 +1,76 @@
+/*
+ * rng.hpp
+ * Samuel Laing - 2019
+ *
+ * Small seedable random number generators so each oscillator owns its
+ * own reproducible stream instead of sharing Rack's global one.
+ */
+
+#ifndef __RNG_HPP__
+#define __RNG_HPP__
+
+#include "rack.hpp"
+
+namespace rack {
+
+  /*
+   * xoshiro128+ by David Blackman and Sebastiano Vigna. Only the top
+   * bits are used for floats, which are the good ones for this variant
+   */
+  struct Xoshiro128 {
+    uint32_t s[4] = {1, 2, 3, 4};
+
+    /*
+     * Expand a 64 bit seed into the full state with splitmix64
+     */
+    void seed(uint64_t x) {
+      for (int i=0; i<4; i+=2) {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        z = z ^ (z >> 31);
+        s[i] = (uint32_t) z;
+        s[i + 1] = (uint32_t) (z >> 32);
+      }
+      // the all zero state is the one state that never leaves itself
+      if (!(s[0] | s[1] | s[2] | s[3])) s[0] = 1;
+    }
+
+    static uint32_t rotl(uint32_t x, int k) {
+      return (x << k) | (x >> (32 - k));
+    }
+
+    uint32_t next() {
+      uint32_t result = s[0] + s[3];
+      uint32_t t = s[1] << 9;
+
+      s[2] ^= s[0];
+      s[3] ^= s[1];
+      s[1] ^= s[2];
+      s[0] ^= s[3];
+      s[2] ^= t;
+      s[3] = rotl(s[3], 11);
+
+      return result;
+    }
+
+    /*
+     * Uniform in 0 < x < 1, never exactly 0 so it is safe to take logs
+     */
+    float uniform() {
+      return ((next() >> 8) + 0.5f) * (1.f / 16777216.f);
+    }
+  };
+
+  /*
+   * Seed for one stream (oscillator / voice) of a module. A module seed
+   * of 0 means free running, every stream then gets a fresh seed from
+   * Rack's global generator
+   */
+  inline uint64_t streamSeed(int seed, int stream) {
+    if (seed == 0) return random::u64();
+    return ((uint64_t) seed << 32) | (uint32_t) stream;
+  }
+}
+
+#endif
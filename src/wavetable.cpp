@@ -27,4 +27,64 @@ namespace rack {
       
       return out;
     }
+
+    float dist_tables[NUM_DISTS][DIST_TABLE_SIZE + 1];
+
+    /*
+     * The exact inverse transforms the tables are built from. u is
+     * uniform over 0 <= u <= 1 and every distribution is scaled to
+     * -1 <= out <= 1
+     */
+    float distInverseCdf(DistType t, float u) {
+      double c, temp;
+      double a = 0.5;
+
+      switch (t) {
+        case CAUCHY:
+          c = atan(10.0 * a);
+          temp = (1.0 / a) * tan(c * (2.0 * u - 1.0));
+          return temp * 0.1;
+        case ARCSINE:
+          c = sin(1.5707963 * a);
+          return sin(M_PI * (u - 0.5) * a) / c;
+        case LOGISTIC:
+          c = 0.5 + (0.499 * a);
+          c = log((1.0 - c) / c);
+          u = ((u - 0.5) * 0.998 * a) + 0.5;
+          return log((1.0 - u) / u) / c;
+        case HYPCOS:
+          c = tan(1.5692255 * a);
+          temp = tan(1.5692255 * a * u) / c;
+          temp = log(temp * 0.999 + 0.001) * -0.1447648;
+          return 2.0 * temp - 1.0;
+        case EXPON:
+          c = log(1.0 - (0.999 * a));
+          temp = log(1.0 - (u * 0.999 * a)) / c;
+          return 2.0 * temp - 1.0;
+        case SINUS:
+          // density shaped like one half cycle of a sine
+          return 2.0 * (acos(1.0 - 2.0 * u) / M_PI) - 1.0;
+        case LINEAR:
+        default:
+          return 2.0 * u - 1.0;
+      }
+    }
+
+    Wavetable sample_table;
+    EnvTable env_tables[NUM_ENVS];
+
+    void initWavetables() {
+      sample_table.init(SIN);
+      for (int e=0; e<NUM_ENVS; e++) {
+        env_tables[e].init((EnvType) e);
+      }
+    }
+
+    void initDistTables() {
+      for (int t=0; t<NUM_DISTS; t++) {
+        for (int i=0; i<=DIST_TABLE_SIZE; i++) {
+          dist_tables[t][i] = distInverseCdf((DistType) t, (float) i / DIST_TABLE_SIZE);
+        }
+      }
+    }
 }
@@ -2,9 +2,9 @@
  * Wavetable.hpp
  * Samuel Laing - 2019
  *
- * Defines the Wavetable struct that is used to hold windows for
+ * Defines the TWavetable struct that is used to hold windows for
  * granular functions. Type of envelope / window is specified by a
- * EnvType enum
+ * EnvType enum, table size and interpolation are template parameters
  */
 
 #ifndef __WAVETABLE_HPP__
@@ -12,13 +12,26 @@
 
 #include <rack.hpp>
 
+#include "fastmath.hpp"
+#include "rng.hpp"
+
 #define TABLE_SIZE 2048 
+#define ENV_TABLE_SIZE 512
+#define DIST_TABLE_SIZE 1024
 
 namespace rack {
 
   float wrap(float in, float lb, float ub);
   float mirror(float in, float lb, float ub);
 
+  /*
+   * wrap for four values at once, lane for lane the same as the scalar
+   * one
+   */
+  inline simd::float_4 wrap(simd::float_4 in, float lb, float ub) {
+    return simd::ifelse(in > ub, lb, simd::ifelse(in < lb, ub, in));
+  }
+
   /*
    * The probability distribution inverse transform functions are thanks
    * to Nick Collins Gendy UGen implementations for SuperCollider licensed
@@ -27,32 +40,52 @@ namespace rack {
   enum DistType {
     LINEAR,
     CAUCHY,
-    ARCSINE
+    ARCSINE,
+    LOGISTIC,
+    HYPCOS,
+    EXPON,
+    SINUS,
+    NUM_DISTS
   };
 
+  /*
+   * Inverse cdf of each distribution sampled at DIST_TABLE_SIZE + 1
+   * evenly spaced points over 0 <= u <= 1. Filled once by
+   * initDistTables() when the plugin is loaded
+   */
+  extern float dist_tables[NUM_DISTS][DIST_TABLE_SIZE + 1];
+
+  void initDistTables();
+  float distInverseCdf(DistType t, float u);
+
   struct gRandGen {
-    float my_rand(DistType t, float rand) {
-      float c, temp, out;
+    // every generator owns its own seedable stream
+    Xoshiro128 gen;
 
-      float a = 0.5f;
-      
-      switch (t) {
-        case LINEAR:
-          return rand; 
-        case CAUCHY:
-          c = atan(10 * a);
-          temp = (1.f/a) * tan(c * (2.f * rand - 1.f));
-          out = temp*0.1f;
-          return out;
-        case ARCSINE:
-          c = sinf(1.5707963f * a); 
-		      out = sinf(M_PI * (rand - 0.5f) * a) / c;
-          return out;
-        default:
-          break;
-      }
+    void seed(uint64_t x) {
+      gen.seed(x);
+    }
+
+    /*
+     * Map a uniform 0 < u < 1 through an inverse cdf table
+     */
+    static float lookup(const float *table, float u) {
+      float x = u * DIST_TABLE_SIZE;
+      int i = (int) x;
+      float ph = x - i;
+      return table[i] + ph * (table[i + 1] - table[i]);
+    }
+
+    /*
+     * Draw the next step, -1 <= step <= 1, from distribution D
+     */
+    template <DistType D>
+    float next() {
+      return lookup(dist_tables[D], gen.uniform());
+    }
 
-      return rand;
+    float next(DistType t) {
+      return lookup(dist_tables[t], gen.uniform());
     }
   };
    
@@ -66,143 +99,234 @@ namespace rack {
     NUM_ENVS
   };
 
-  struct Wavetable {
+  enum InterpType {
+    INTERP_LINEAR,
+    INTERP_HERMITE
+  };
+
+  /*
+   * One cycle of SIZE samples, SIZE a power of two. The cycle is stored
+   * with a guard sample before it and two after it, so interpolating
+   * never needs to branch at the ends, and phases wrap with a bitmask.
+   * I picks what get() uses, both lookups are always available
+   */
+  template <int SIZE, InterpType I = INTERP_LINEAR>
+  struct TWavetable {
+    static_assert(SIZE >= 4 && (SIZE & (SIZE - 1)) == 0, "wavetable size must be a power of two");
+
+    static const int MASK = SIZE - 1;
 
-    float table[TABLE_SIZE];
+    // table[1] is the first sample of the cycle
+    float table[SIZE + 3];
     
     EnvType et;
 
-    Wavetable() {
-      // default to a cycle of a sin wave
+    /*
+     * Empty table, filled later by init(). Used for the shared tables
+     * so nothing is computed during static initialization
+     */
+    TWavetable() {
       et = SIN;
-      initSinWav(); 
     }
 
-    Wavetable(EnvType e) {
-      et = e;
+    TWavetable(EnvType e) {
       init(e);
     }
 
     void init(EnvType e) {
+      float *t = &table[1];
+      et = e;
+
       switch (e) {
         case SIN:
-          initSinWav();
+          initSinWav(t);
           break;
         case TRI:
-          initTriEnv();
+          initTriEnv(t);
           break;
         case HANN:
-          initHannEnv();
+          initHannEnv(t);
           break;
         case WELCH:
-          initWelchEnv();
+          initWelchEnv(t);
           break;
         case TUKEY:
-          initTukeyEnv();
+          initTukeyEnv(t);
           break;
         default:
-          initSinWav();
+          initSinWav(t);
       }
-    }
 
-    void switchEnvType(EnvType e) {
-      
-      // don't switch if already that env
-      if (et != e) {
-        et = e;
-        init(e); 
-      }
+      // guard samples continue the cycle on both sides
+      table[0] = t[SIZE - 1];
+      table[SIZE + 1] = t[0];
+      table[SIZE + 2] = t[1];
     }
 
-    void initSinWav() {
+    static void initSinWav(float *t) {
       // TODO
       // would fm synthesis be handled here or with two seperate
       // sine wavetables
       
       // Fill the wavetable
       float phase = 0.f;
-      for (int i=0; i<TABLE_SIZE; i++) {
-        table[i] = sinf(2.f*M_PI * phase); 
+      for (int i=0; i<SIZE; i++) {
+        t[i] = sinf(2.f*M_PI * phase); 
         phase += (float) i  / (2.f*M_PI);
       }
     }
 
-    void initTriEnv() {
+    static void initTriEnv(float *t) {
       float phase = 0.f;
-      for (int i=0; i<TABLE_SIZE; i++) {
+      for (int i=0; i<SIZE; i++) {
         if (phase < 0.5f) {
-          table[i] = ((2.f * i) / TABLE_SIZE);
+          t[i] = ((2.f * i) / SIZE);
         }
         else  {
-          table[i] = ((-2.f * i) / TABLE_SIZE) + 2.f;
+          t[i] = ((-2.f * i) / SIZE) + 2.f;
         }
         
-        phase += 1.f / TABLE_SIZE;
+        phase += 1.f / SIZE;
       }
     }
 
-    void initHannEnv() {
+    static void initHannEnv(float *t) {
       float a_0 = 0.5f;
-      for (int i=0; i<TABLE_SIZE; i++) {
-        table[i] = a_0 * (1 - cosf((2.f * M_PI * ((float) i / TABLE_SIZE)) / 1.f));
+      for (int i=0; i<SIZE; i++) {
+        t[i] = a_0 * (1 - cosf((2.f * M_PI * ((float) i / SIZE)) / 1.f));
       }
     }
 
-    void initWelchEnv() {
-      float ts = (float) TABLE_SIZE;
-      for (int i=0; i<TABLE_SIZE; i++) {
-        table[i] = 1.f - pow(((float) i - (ts / 2.f)) / (ts / 2.f), 2); 
+    static void initWelchEnv(float *t) {
+      float ts = (float) SIZE;
+      for (int i=0; i<SIZE; i++) {
+        t[i] = 1.f - pow(((float) i - (ts / 2.f)) / (ts / 2.f), 2); 
       }
     }
 
-    void initTukeyEnv() {
+    static void initTukeyEnv(float *t) {
       float p1,p2,N,alpha;
 
       alpha = 0.5f;
 
-      N = (float) TABLE_SIZE;
+      N = (float) SIZE;
       p1 = alpha * N / 2;
       p2 = N * (1 - (alpha / 2));
 
-      for (int i=0; i<TABLE_SIZE; i++) {
+      for (int i=0; i<SIZE; i++) {
         if (i < p1) {
-          table[i] = 0.5f * (1 + cosf(M_PI * (((2 * i) / (alpha * N)) - 1)));
+          t[i] = 0.5f * (1 + cosf(M_PI * (((2 * i) / (alpha * N)) - 1)));
         }
         else if (i <= p2) { 
-          table[i] = 1.f; 
+          t[i] = 1.f; 
         } 
         else {
-          table[i] = 0.5f * (1 + cosf(M_PI * (((2 * i) / (alpha * N)) - (2 / alpha) + 1)));
+          t[i] = 0.5f * (1 + cosf(M_PI * (((2 * i) / (alpha * N)) - (2 / alpha) + 1)));
         }
       }
     }
 
-    float operator[](int x) {
-      return table[x];
+    float operator[](int x) const {
+      return table[(x & MASK) + 1];
+    }
+
+    /*
+     * Lookups expect a phase x >= 0, whole cycles wrap around so x = 1.0
+     * reads the start of the table
+     */
+    float getLinear(float x) const {
+      float xs = x * (float) SIZE;
+      int i = (int) xs;
+      float ph = xs - (float) i;
+      const float *t = &table[(i & MASK) + 1];
+
+      return t[0] + ph * (t[1] - t[0]);
+    }
+
+    /*
+     * 4 point, 3rd order Hermite interpolation
+     */
+    float getHermite(float x) const {
+      float xs = x * (float) SIZE;
+      int i = (int) xs;
+      float ph = xs - (float) i;
+      const float *t = &table[i & MASK];
+
+      return hermite(t[0], t[1], t[2], t[3], ph);
+    }
+
+    float get(float x) const {
+      return (I == INTERP_HERMITE) ? getHermite(x) : getLinear(x);
+    }
+
+    /*
+     * Lookups for four phases at once, one per float_4 lane. The
+     * index math is vectorized, only the table reads are per lane
+     */
+    simd::float_4 getLinear(simd::float_4 x) const {
+      int32_t idx[4];
+      simd::float_4 ph = split(x, idx);
+
+      simd::float_4 y0 = gather(idx, 1);
+      simd::float_4 y1 = gather(idx, 2);
+
+      return y0 + ph * (y1 - y0);
     }
 
-    float operator[](float x) {
-      return index(x); 
+    simd::float_4 getHermite(simd::float_4 x) const {
+      int32_t idx[4];
+      simd::float_4 ph = split(x, idx);
+
+      return hermite(gather(idx, 0), gather(idx, 1), gather(idx, 2), gather(idx, 3), ph);
+    }
+
+    simd::float_4 get(simd::float_4 x) const {
+      return (I == INTERP_HERMITE) ? getHermite(x) : getLinear(x);
     }
 
-    float index(float x) {
-      float fl = floorf(x);
-      float ph = x - fl;
-      float lb = table[(int) fl];
-      float ub = table[(int) ceilf(x)];
+    template <typename T>
+    static T hermite(T ym1, T y0, T y1, T y2, T ph) {
+      T c1 = 0.5f * (y1 - ym1);
+      T c2 = ym1 - 2.5f * y0 + 2.f * y1 - 0.5f * y2;
+      T c3 = 0.5f * (y2 - ym1) + 1.5f * (y0 - y1);
 
-      return ((1.0 - ph) * lb) + (ph * ub);
+      return ((c3 * ph + c2) * ph + c1) * ph + y0;
     }
 
     /*
-     * Expects val 0.0 <= x < 1.0
+     * Scale four phases to table positions, returning the fractional
+     * parts and writing the masked whole parts to idx
      */
-    float get(float x) {
-      if (x > 1.000000) DEBUG("BAD!\n");
-      return index(x * (float) TABLE_SIZE); 
+    static simd::float_4 split(simd::float_4 x, int32_t *idx) {
+      simd::float_4 xs = x * (float) SIZE;
+      __m128i i = _mm_cvttps_epi32(xs.v);
+      simd::float_4 ph = xs - simd::float_4(_mm_cvtepi32_ps(i));
+
+      _mm_storeu_si128((__m128i *) idx, _mm_and_si128(i, _mm_set1_epi32(MASK)));
+      return ph;
+    }
+
+    simd::float_4 gather(const int32_t *idx, int offset) const {
+      return simd::float_4(table[idx[0] + offset], table[idx[1] + offset], table[idx[2] + offset], table[idx[3] + offset]);
     }
   };
 
+  // grain sources
+  typedef TWavetable<TABLE_SIZE, INTERP_LINEAR> Wavetable;
+
+  // grain envelopes are smooth, a small table stays in L1
+  typedef TWavetable<ENV_TABLE_SIZE, INTERP_LINEAR> EnvTable;
+
+  /*
+   * Read-only tables shared by every oscillator, which only hold
+   * pointers to them. Filled once by initWavetables() when the plugin
+   * is loaded
+   */
+  extern Wavetable sample_table;
+  extern EnvTable env_tables[NUM_ENVS];
+
+  void initWavetables();
+
 }
 
 #endif
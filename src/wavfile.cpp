@@ -0,0 +1,267 @@
+/*
+ * wavfile.cpp
+ * Samuel Laing - 2019
+ *
+ * RIFF / WAVE parsing for WavReader and writing for WavWriter
+ */
+
+#include "rack.hpp"
+#include "wavfile.hpp"
+
+namespace rack {
+
+    static uint32_t readU32(const uint8_t *b) {
+      return b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t) b[3] << 24);
+    }
+
+    static uint16_t readU16(const uint8_t *b) {
+      return b[0] | (b[1] << 8);
+    }
+
+    static void putU32(uint8_t *b, uint32_t x) {
+      b[0] = x;
+      b[1] = x >> 8;
+      b[2] = x >> 16;
+      b[3] = x >> 24;
+    }
+
+    static void putU16(uint8_t *b, uint16_t x) {
+      b[0] = x;
+      b[1] = x >> 8;
+    }
+
+    static uint64_t readU64(const uint8_t *b) {
+      return readU32(b) | ((uint64_t) readU32(b + 4) << 32);
+    }
+
+    static void putU64(uint8_t *b, uint64_t x) {
+      putU32(b, (uint32_t) x);
+      putU32(b + 4, (uint32_t) (x >> 32));
+    }
+
+    bool WavReader::open(const std::string &path) {
+      close();
+
+      f = fopen(path.c_str(), "rb");
+      if (!f) {
+        WARN("Could not open %s", path.c_str());
+        return false;
+      }
+
+      uint8_t riff[12];
+      if (fread(riff, 1, 12, f) != 12 || (memcmp(riff, "RIFF", 4) && memcmp(riff, "RF64", 4)) || memcmp(riff + 8, "WAVE", 4)) {
+        WARN("%s is not a WAV file", path.c_str());
+        close();
+        return false;
+      }
+
+      // walk the chunks until the sample data, picking up the format
+      // on the way. Files over 4 GB are RF64, whose data size is in the
+      // ds64 chunk
+      bool has_fmt = false;
+      uint64_t data_size = 0xFFFFFFFF;
+      uint8_t head[8];
+      while (fread(head, 1, 8, f) == 8) {
+        uint32_t size = readU32(head + 4);
+
+        if (!memcmp(head, "ds64", 4)) {
+          uint8_t ds64[16];
+          if (size < 16 || fread(ds64, 1, 16, f) != 16) break;
+          fseek(f, (size - 16) + (size & 1), SEEK_CUR);
+          data_size = readU64(ds64 + 8);
+        }
+        else if (!memcmp(head, "fmt ", 4)) {
+          uint8_t fmt[40] = {0};
+          uint32_t n = size < sizeof(fmt) ? size : sizeof(fmt);
+          if (n < 16 || fread(fmt, 1, n, f) != n) break;
+          fseek(f, (size - n) + (size & 1), SEEK_CUR);
+
+          format = readU16(fmt);
+          channels = readU16(fmt + 2);
+          sample_rate = readU32(fmt + 4);
+          bits = readU16(fmt + 14);
+
+          // the real format is the first two bytes of the sub format guid
+          if (format == WAV_EXTENSIBLE && n >= 26) format = readU16(fmt + 24);
+          has_fmt = true;
+        }
+        else if (!memcmp(head, "data", 4)) {
+          if (!has_fmt) break;
+
+          bool ok = channels > 0 && sample_rate > 0 &&
+            ((format == WAV_PCM && (bits == 8 || bits == 16 || bits == 24 || bits == 32)) ||
+             (format == WAV_FLOAT && bits == 32));
+          if (!ok) {
+            WARN("%s: unsupported WAV format %d, %d bits", path.c_str(), format, bits);
+            close();
+            return false;
+          }
+
+          uint64_t bytes = (size == 0xFFFFFFFF) ? data_size : size;
+          frames = (uint32_t) std::min(bytes / (channels * (bits / 8)), (uint64_t) 0xFFFFFFFF);
+          frames_left = frames;
+          return true;
+        }
+        else {
+          // chunks are padded to an even size
+          fseek(f, size + (size & 1), SEEK_CUR);
+        }
+      }
+
+      WARN("%s has no sample data", path.c_str());
+      close();
+      return false;
+    }
+
+    void WavReader::close() {
+      if (f) fclose(f);
+      f = NULL;
+      frames = frames_left = 0;
+    }
+
+    /*
+     * One sample at b in -1..1
+     */
+    float WavReader::decode(const uint8_t *b) {
+      switch (bits) {
+        case 8:
+          return (b[0] - 128) / 128.f;
+        case 16:
+          return (int16_t) readU16(b) / 32768.f;
+        case 24:
+          return (int32_t) ((b[0] << 8) | (b[1] << 16) | ((uint32_t) b[2] << 24)) / 2147483648.f;
+        default:
+          if (format == WAV_FLOAT) {
+            float x;
+            uint32_t u = readU32(b);
+            memcpy(&x, &u, 4);
+            return x;
+          }
+          return (int32_t) readU32(b) / 2147483648.f;
+      }
+    }
+
+    int WavReader::readRaw(int n) {
+      if (!f) return 0;
+      if ((uint32_t) n > frames_left) n = frames_left;
+
+      int frame_bytes = (bits / 8) * channels;
+      raw.resize(n * frame_bytes);
+
+      n = fread(raw.data(), frame_bytes, n, f);
+      frames_left -= n;
+      return n;
+    }
+
+    int WavReader::read(float *out, int n) {
+      n = readRaw(n);
+
+      int bytes = bits / 8;
+      float gain = 1.f / channels;
+      const uint8_t *b = raw.data();
+
+      for (int i=0; i<n; i++) {
+        float sum = 0.f;
+        for (int c=0; c<channels; c++, b+=bytes) sum += decode(b);
+        out[i] = sum * gain;
+      }
+
+      return n;
+    }
+
+    int WavReader::readFrames(float *out, int n) {
+      n = readRaw(n);
+
+      int bytes = bits / 8;
+      const uint8_t *b = raw.data();
+
+      for (int i=0; i<n * channels; i++, b+=bytes) out[i] = decode(b);
+
+      return n;
+    }
+
+    bool WavWriter::open(const std::string &path, int channels, int sample_rate) {
+      close();
+
+      f = fopen(path.c_str(), "wb");
+      if (!f) {
+        WARN("Could not create %s", path.c_str());
+        return false;
+      }
+
+      this->channels = channels;
+      samples = 0;
+      header_samples = 0;
+      update_samples = (uint64_t) sample_rate * channels * WAV_UPDATE_SECONDS;
+
+      // a JUNK chunk holds the place of the ds64 chunk the file becomes
+      // RF64 with once it passes 4 GB
+      uint8_t head[WAV_HEADER_BYTES] = {0};
+      memcpy(head, "RIFF", 4);
+      memcpy(head + 8, "WAVE", 4);
+      memcpy(head + 12, "JUNK", 4);
+      putU32(head + 16, 28);
+      memcpy(head + 48, "fmt ", 4);
+      putU32(head + 52, 16);
+      putU16(head + 56, WAV_FLOAT);
+      putU16(head + 58, channels);
+      putU32(head + 60, sample_rate);
+      putU32(head + 64, sample_rate * channels * 4);
+      putU16(head + 68, channels * 4);
+      putU16(head + 70, 32);
+      memcpy(head + 72, "data", 4);
+
+      fwrite(head, 1, sizeof(head), f);
+      updateHeader();
+      return true;
+    }
+
+    void WavWriter::write(const float *in, size_t n) {
+      if (!f) return;
+      samples += fwrite(in, sizeof(float), n, f);
+
+      // keep the header current, a file cut short by a crash still
+      // plays up to the last update
+      if (samples - header_samples >= update_samples) updateHeader();
+    }
+
+    /*
+     * Write the sizes of the samples so far into the header, as RF64
+     * once they don't fit 32 bits, and flush
+     */
+    void WavWriter::updateHeader() {
+      uint64_t data = samples * sizeof(float);
+      uint64_t riff = data + WAV_HEADER_BYTES - 8;
+      bool rf64 = riff > 0xFFFFFFFF;
+
+      uint8_t riff_head[8], ds64_id[4], ds64[24], size[4];
+      memcpy(riff_head, rf64 ? "RF64" : "RIFF", 4);
+      putU32(riff_head + 4, rf64 ? 0xFFFFFFFF : (uint32_t) riff);
+      memcpy(ds64_id, rf64 ? "ds64" : "JUNK", 4);
+      putU64(ds64, rf64 ? riff : 0);
+      putU64(ds64 + 8, rf64 ? data : 0);
+      putU64(ds64 + 16, rf64 ? samples / channels : 0);
+      putU32(size, rf64 ? 0xFFFFFFFF : (uint32_t) data);
+
+      fseek(f, 0, SEEK_SET);
+      fwrite(riff_head, 1, 8, f);
+      fseek(f, 12, SEEK_SET);
+      fwrite(ds64_id, 1, 4, f);
+      fseek(f, 20, SEEK_SET);
+      fwrite(ds64, 1, 24, f);
+      fseek(f, WAV_HEADER_BYTES - 4, SEEK_SET);
+      fwrite(size, 1, 4, f);
+      fseek(f, 0, SEEK_END);
+      fflush(f);
+
+      header_samples = samples;
+    }
+
+    void WavWriter::close() {
+      if (!f) return;
+
+      updateHeader();
+      fclose(f);
+      f = NULL;
+    }
+}
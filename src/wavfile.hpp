@@ -0,0 +1,103 @@
+/*
+ * wavfile.hpp
+ * Samuel Laing - 2019
+ *
+ * Minimal streaming WAV reader and writer. Reads 8/16/24/32 bit integer
+ * and 32 bit float PCM a block at a time, so long files never have to
+ * be held in memory twice, and writes 32 bit float. Meant for worker
+ * threads, never the audio thread.
+ */
+
+#ifndef __WAVFILE_HPP__
+#define __WAVFILE_HPP__
+
+#include <cstdio>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// the header WavWriter writes, RIFF, a ds64 chunk or its placeholder,
+// fmt and the data chunk's header
+#define WAV_HEADER_BYTES 80
+
+// seconds of audio WavWriter writes between updates of the header sizes
+#define WAV_UPDATE_SECONDS 1
+
+namespace rack {
+
+  enum WavFormat {
+    WAV_PCM = 1,
+    WAV_FLOAT = 3,
+    WAV_EXTENSIBLE = 0xFFFE
+  };
+
+  struct WavReader {
+    FILE *f = NULL;
+
+    int format = 0;
+    int channels = 0;
+    int sample_rate = 0;
+    int bits = 0;
+
+    // total frames in the file and frames not read yet
+    uint32_t frames = 0;
+    uint32_t frames_left = 0;
+
+    std::vector<uint8_t> raw;
+
+    ~WavReader() {
+      close();
+    }
+
+    /*
+     * Open path and parse its header, returns false and logs a warning
+     * if it isn't a WAV file this reader understands
+     */
+    bool open(const std::string &path);
+    void close();
+
+    /*
+     * Read up to n frames, mixing all channels down to mono in -1..1.
+     * Returns the number of frames read, 0 at the end of the file
+     */
+    int read(float *out, int n);
+
+    /*
+     * Read up to n frames of interleaved channels in -1..1, out holds
+     * n * channels samples. Returns the number of frames read
+     */
+    int readFrames(float *out, int n);
+
+    int readRaw(int n);
+    float decode(const uint8_t *b);
+  };
+
+  /*
+   * Writes interleaved 32 bit float samples. The header sizes are kept
+   * up to date every WAV_UPDATE_SECONDS and on close(), and a file that
+   * passes 4 GB turns into RF64
+   */
+  struct WavWriter {
+    FILE *f = NULL;
+
+    int channels = 0;
+    uint64_t samples = 0;
+
+    // samples the header describes so far, and how many more are written
+    // before it is updated
+    uint64_t header_samples = 0;
+    uint64_t update_samples = 0;
+
+    ~WavWriter() {
+      close();
+    }
+
+    bool open(const std::string &path, int channels, int sample_rate);
+    void close();
+
+    void write(const float *in, size_t n);
+    void updateHeader();
+  };
+}
+
+#endif